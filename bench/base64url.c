@@ -0,0 +1,63 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../u2f-server/base64url.c"
+#include "bench.h"
+
+struct base64url_input {
+  char encoded[BASE64URL_ENCODED_LEN(1024) + 1];
+  size_t len;
+};
+
+static void decode(void *data)
+{
+  struct base64url_input *in = data;
+  unsigned char out[1024];
+  size_t out_len = sizeof(out);
+
+  if (base64url_decode(in->encoded, in->len, out, &out_len) != U2FS_OK)
+    abort();
+}
+
+void bench_base64url(void)
+{
+  struct base64url_input in;
+  unsigned char raw[1024];
+  size_t i;
+
+  base64url_init();
+  for (i = 0; i < sizeof(raw); i++)
+    raw[i] = i * 7;
+
+  /* A key handle, and about a registrationData. */
+  in.len = base64url_encode(raw, 64, in.encoded);
+  bench_run("base64url/decode/64", decode, &in);
+  in.len = base64url_encode(raw, 800, in.encoded);
+  bench_run("base64url/decode/800", decode, &in);
+}
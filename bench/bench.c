@@ -0,0 +1,361 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Benchmarks of the verification hot path.  Each stage is run in
+ * batches of doubling size until a batch takes the requested time,
+ * and the time per operation of that batch is reported.  The
+ * throughput scenario then runs full authentication verifications on
+ * several threads and reports ops/s and latency percentiles.
+ */
+
+#include "bench.h"
+
+#include <u2f-server/u2f-server.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../u2f-server/internal.h"
+
+/* The internal modules linked into the benchmark need these. */
+U2FS_ATOMIC int debug;
+struct u2fs_allocator allocator = { malloc, realloc, free };
+
+const char *bench_reg_response =
+  "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJ"
+  "K6IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR"
+  "0Ei4_I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYp"
+  "X7xMR6Y9wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQ"
+  "EBCzAuMSwwKgYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1Nz"
+  "IwMDYzMTAgFw0xNDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMC"
+  "YGA1UEAwwfWXViaWNvIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGBy"
+  "qGSM49AgEGCCqGSM49AwEHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDL"
+  "mfd-0ACG0Fu7wR4ZTjKd9KAuidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA"
+  "4GCisGAQQBgsQKAQIEADALBgkqhkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAl"
+  "yD6UyT4cKyJZGVhWdtPgj_mWepT3Tu9jXtdgA5F3jfZtTc2eGxuS-PPvqRAk"
+  "Zd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQzQZeAHuZk3lKKd_LUCg5077dzdt90"
+  "lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkGQxtoD-otgvhZ2Fjk29o7Iy9ik"
+  "7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4BZWHtzhC0k5ceQslB9Xdntk"
+  "y-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0AABYNTNKTceA5dtR3UV"
+  "pI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUtZXfWL1aiEXU1qWRi"
+  "M_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzAedzpuE2tEjp1g"
+  "==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMTludV9ZWWpn"
+  "czI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ2luIjog"
+  "Imh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9y"
+  "LmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+const char *bench_auth_response =
+  "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMu"
+  "MJbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t3"
+  "9Wp\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGt"
+  "kTl9aOXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjo"
+  "gImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9"
+  "yLmlkLmdldEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57px"
+  "Hg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733L"
+  "RbJ-CG573N9jCY1g\" }";
+
+const unsigned char bench_userkey[U2FS_PUBLIC_KEY_LEN] = {
+  0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+  0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+  0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+  0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+  0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+  0x4c, 0x37, 0x97, 0x83, 0xcb
+};
+
+static double seconds = 0.25;
+static const char *filter;
+
+double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_run(const char *name, bench_func func, void *data)
+{
+  unsigned long n, i;
+  double start, elapsed;
+
+  if (filter != NULL && strstr(name, filter) == NULL)
+    return;
+
+  for (n = 1;; n *= 2) {
+    start = bench_now();
+    for (i = 0; i < n; i++)
+      func(data);
+    elapsed = bench_now() - start;
+    if (elapsed >= seconds || n >= (1UL << 30))
+      break;
+  }
+
+  printf("%-36s %12.1f ns/op %12.0f ops/s\n", name, elapsed / n * 1e9,
+         n / elapsed);
+  fflush(stdout);
+}
+
+static void check(u2fs_rc rc, const char *what)
+{
+  if (rc != U2FS_OK) {
+    fprintf(stderr, "error: %s (%d): %s\n", what, rc, u2fs_strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static u2fs_ctx_t *new_ctx(const u2fs_rp_t * rp, const char *challenge)
+{
+  u2fs_ctx_t *ctx;
+
+  check(u2fs_init(&ctx), "u2fs_init");
+  check(u2fs_set_rp(ctx, rp), "u2fs_set_rp");
+  check(u2fs_set_challenge(ctx, challenge), "u2fs_set_challenge");
+  check(u2fs_set_publicKey(ctx, bench_userkey), "u2fs_set_publicKey");
+
+  return ctx;
+}
+
+static void generate_challenge(void *data)
+{
+  char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
+
+  (void) data;
+  check(u2fs_generate_challenges(challenge, 1), "generate_challenges");
+}
+
+static void registration_challenge(void *data)
+{
+  char buf[1024];
+  size_t len = sizeof(buf);
+
+  check(u2fs_registration_challenge_buf(data, buf, &len),
+        "registration_challenge_buf");
+}
+
+static void authentication_challenge(void *data)
+{
+  char buf[1024];
+  size_t len = sizeof(buf);
+
+  check(u2fs_authentication_challenge_buf(data, buf, &len),
+        "authentication_challenge_buf");
+}
+
+static void registration_verify(void *data)
+{
+  u2fs_reg_res_t *res;
+
+  check(u2fs_registration_verify(data, bench_reg_response, &res),
+        "registration_verify");
+  u2fs_free_reg_res(res);
+}
+
+static void authentication_verify(void *data)
+{
+  u2fs_auth_res_t *res;
+
+  check(u2fs_authentication_verify(data, bench_auth_response, &res),
+        "authentication_verify");
+  u2fs_free_auth_res(res);
+}
+
+struct worker {
+  pthread_t thread;
+  const u2fs_rp_t *rp;
+  double until;
+  unsigned long count;
+  unsigned long size;
+  uint64_t *latency;
+};
+
+static void *throughput_worker(void *arg)
+{
+  struct worker *w = arg;
+  u2fs_ctx_t *ctx = new_ctx(w->rp, BENCH_AUTH_CHALLENGE);
+  double start, end;
+
+  for (start = bench_now(); start < w->until; start = end) {
+    authentication_verify(ctx);
+    end = bench_now();
+
+    if (w->count == w->size) {
+      w->size = w->size ? 2 * w->size : 4096;
+      w->latency = realloc(w->latency, w->size * sizeof(*w->latency));
+      if (w->latency == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    w->latency[w->count++] = (uint64_t) ((end - start) * 1e9);
+  }
+
+  u2fs_done(ctx);
+
+  return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void throughput(const u2fs_rp_t * rp, int threads)
+{
+  static const double pct[] = { 50, 90, 99, 99.9 };
+  struct worker *w;
+  uint64_t *all;
+  unsigned long total = 0, i, n;
+  double start, elapsed;
+  char name[64];
+  int t;
+
+  snprintf(name, sizeof(name), "throughput/authenticate/%d", threads);
+  if (filter != NULL && strstr(name, filter) == NULL)
+    return;
+
+  w = calloc(threads, sizeof(*w));
+  if (w == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  start = bench_now();
+  for (t = 0; t < threads; t++) {
+    w[t].rp = rp;
+    w[t].until = start + 4 * seconds;
+    if (pthread_create(&w[t].thread, NULL, throughput_worker, &w[t]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (t = 0; t < threads; t++) {
+    pthread_join(w[t].thread, NULL);
+    total += w[t].count;
+  }
+  elapsed = bench_now() - start;
+
+  all = malloc((total ? total : 1) * sizeof(*all));
+  if (all == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (t = 0, n = 0; t < threads; t++) {
+    memcpy(all + n, w[t].latency, w[t].count * sizeof(*all));
+    n += w[t].count;
+    free(w[t].latency);
+  }
+  qsort(all, total, sizeof(*all), cmp_latency);
+
+  printf("%-36s %12.0f ops/s", name, total / elapsed);
+  for (i = 0; i < sizeof(pct) / sizeof(pct[0]) && total > 0; i++)
+    printf("  p%g %.1fus", pct[i],
+           all[(unsigned long) (pct[i] / 100 * (total - 1))] / 1e3);
+  printf("\n");
+
+  free(all);
+  free(w);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-s SECONDS] [-t THREADS] [FILTER]\n"
+          "Time each stage for about SECONDS (default 0.25), then run\n"
+          "authentications on THREADS threads (default: one per CPU).\n"
+          "Only stages whose name contains FILTER are run.\n", argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  u2fs_ctx_t *reg_ctx, *auth_ctx;
+  u2fs_rp_t *rp;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+    switch (opt) {
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 't':
+      threads = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    filter = argv[optind++];
+  if (optind < argc || seconds <= 0 || threads < 1)
+    usage(argv[0]);
+
+  check(u2fs_global_init(0), "u2fs_global_init");
+
+  check(u2fs_rp_init(&rp, BENCH_ORIGIN, BENCH_ORIGIN), "u2fs_rp_init");
+  reg_ctx = new_ctx(rp, BENCH_REG_CHALLENGE);
+  auth_ctx = new_ctx(rp, BENCH_AUTH_CHALLENGE);
+  check(u2fs_set_keyHandle(auth_ctx, "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vO"
+                           "gqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jCY1g"),
+        "u2fs_set_keyHandle");
+
+  bench_run("challenge/generate", generate_challenge, NULL);
+  bench_run("challenge/registration_json", registration_challenge,
+            reg_ctx);
+  bench_run("challenge/authentication_json", authentication_challenge,
+            auth_ctx);
+
+  bench_scan();
+  bench_base64url();
+  bench_sha256();
+  bench_openssl();
+
+  bench_run("verify/registration", registration_verify, reg_ctx);
+  bench_run("verify/authentication", authentication_verify, auth_ctx);
+
+  throughput(rp, 1);
+  if (threads > 1)
+    throughput(rp, threads);
+
+  u2fs_done(auth_ctx);
+  u2fs_done(reg_ctx);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+
+  return EXIT_SUCCESS;
+}
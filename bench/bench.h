@@ -0,0 +1,55 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <u2f-server/u2f-server.h>
+
+#define BENCH_REG_CHALLENGE "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"
+#define BENCH_AUTH_CHALLENGE "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"
+#define BENCH_ORIGIN "http://demo.yubico.com"
+
+/* A registration and an authentication response, from tests/core.c. */
+extern const char *bench_reg_response;
+extern const char *bench_auth_response;
+extern const unsigned char bench_userkey[U2FS_PUBLIC_KEY_LEN];
+
+typedef void (*bench_func) (void *data);
+
+double bench_now(void);
+void bench_run(const char *name, bench_func func, void *data);
+
+/* Stages of the internal modules, one per source file. */
+void bench_sha256(void);
+void bench_base64url(void);
+void bench_scan(void);
+void bench_openssl(void);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef U2FS_CRYPTO_EVP
+#include "../u2f-server/openssl-evp.c"
+#else
+#include "../u2f-server/openssl-eckey.c"
+#endif
+#include "../u2f-server/openssl.c"
+#include "bench.h"
+
+/* The signature of bench_auth_response, made with bench_userkey. */
+static const unsigned char auth_dgst[] = {
+  0x27, 0x2c, 0x7f, 0x10, 0xbd, 0x9d, 0x90, 0xe7, 0x50, 0xf3, 0x6a, 0x6e,
+  0x10, 0x94, 0xfb, 0x27, 0x39, 0x8d, 0xd9, 0x29, 0xdd, 0xa6, 0xe6, 0x73,
+  0x68, 0xbf, 0x4d, 0x66, 0xa8, 0xc1, 0x70, 0xa3
+};
+
+static const unsigned char auth_der[] = {
+  0x30, 0x44, 0x02, 0x20, 0x5d, 0x41, 0x41, 0xe2, 0x98, 0x42, 0xba, 0xa7,
+  0x1c, 0xd3, 0xe6, 0xbd, 0xa1, 0xb0, 0xfc, 0x4b, 0xf7, 0x8c, 0xb8, 0xc2,
+  0x5b, 0x4c, 0x2d, 0x3f, 0x56, 0xb5, 0xa2, 0xce, 0x6c, 0x07, 0x69, 0xd1,
+  0x02, 0x20, 0x05, 0xdb, 0xfc, 0x66, 0x80, 0x10, 0x8b, 0x80, 0x26, 0xff,
+  0x34, 0xe9, 0xe5, 0x2f, 0x32, 0x37, 0x36, 0x42, 0x2f, 0xa2, 0x8b, 0x92,
+  0x0c, 0x6c, 0xdc, 0x36, 0x61, 0x4d, 0xad, 0xdf, 0xd5, 0xa9
+};
+
+static const unsigned char auth_raw[U2FS_ECDSA_RAW_LEN] = {
+  0x5d, 0x41, 0x41, 0xe2, 0x98, 0x42, 0xba, 0xa7, 0x1c, 0xd3, 0xe6, 0xbd,
+  0xa1, 0xb0, 0xfc, 0x4b, 0xf7, 0x8c, 0xb8, 0xc2, 0x5b, 0x4c, 0x2d, 0x3f,
+  0x56, 0xb5, 0xa2, 0xce, 0x6c, 0x07, 0x69, 0xd1, 0x05, 0xdb, 0xfc, 0x66,
+  0x80, 0x10, 0x8b, 0x80, 0x26, 0xff, 0x34, 0xe9, 0xe5, 0x2f, 0x32, 0x37,
+  0x36, 0x42, 0x2f, 0xa2, 0x8b, 0x92, 0x0c, 0x6c, 0xdc, 0x36, 0x61, 0x4d,
+  0xad, 0xdf, 0xd5, 0xa9
+};
+
+struct ecdsa_input {
+  u2fs_EC_KEY_t *key;
+  u2fs_ECDSA_t *sig;
+};
+
+static void user_key(void *data)
+{
+  u2fs_EC_KEY_t *key;
+
+  if (decode_user_key(bench_userkey, &key) != U2FS_OK)
+    abort();
+  free_key(key);
+}
+
+static void signature(void *data)
+{
+  u2fs_ECDSA_t *sig;
+
+  if (decode_ECDSA(auth_der, sizeof(auth_der), &sig) != U2FS_OK)
+    abort();
+  free_sig(sig);
+}
+
+static void verify(void *data)
+{
+  struct ecdsa_input *in = data;
+
+  if (verify_ECDSA(auth_dgst, sizeof(auth_dgst), in->sig, in->key)
+      != U2FS_OK)
+    abort();
+}
+
+static void verify_raw(void *data)
+{
+  struct ecdsa_input *in = data;
+
+  if (verify_ECDSA_raw(auth_dgst, sizeof(auth_dgst), auth_raw, in->key)
+      != U2FS_OK)
+    abort();
+}
+
+void bench_openssl(void)
+{
+  struct ecdsa_input in;
+
+  /* Measure with the shared state the library sets up, too. */
+  if (crypto_init() != U2FS_OK
+      || decode_user_key(bench_userkey, &in.key) != U2FS_OK
+      || decode_ECDSA(auth_der, sizeof(auth_der), &in.sig) != U2FS_OK)
+    abort();
+
+  bench_run("crypto/decode_user_key", user_key, NULL);
+  bench_run("crypto/decode_ECDSA", signature, NULL);
+  bench_run("crypto/verify_ECDSA", verify, &in);
+  bench_run("crypto/verify_ECDSA_raw", verify_raw, &in);
+
+  free_sig(in.sig);
+  free_key(in.key);
+  crypto_release();
+}
@@ -0,0 +1,72 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../u2f-server/scan.c"
+#include "bench.h"
+
+#include <stdlib.h>
+
+struct scan_input {
+  const char *json;
+  size_t len;
+  const char *const *keys;
+  size_t count;
+};
+
+/* What parse_registration_response() and friends in core.c do. */
+static void parse(void *data)
+{
+  struct scan_input *in = data;
+  struct u2fs_span values[3];
+
+  if (scan_object(in->json, in->len, in->keys, values, in->count)
+      != SCAN_OK)
+    abort();
+}
+
+void bench_scan(void)
+{
+  static const char *const reg_keys[] =
+      { "registrationData", "clientData" };
+  static const char *const auth_keys[] =
+      { "signatureData", "clientData", "keyHandle" };
+  struct scan_input in;
+
+  in.json = bench_reg_response;
+  in.len = strlen(in.json);
+  in.keys = reg_keys;
+  in.count = 2;
+  bench_run("parse/registration_response", parse, &in);
+
+  in.json = bench_auth_response;
+  in.len = strlen(in.json);
+  in.keys = auth_keys;
+  in.count = 3;
+  bench_run("parse/authentication_response", parse, &in);
+}
@@ -0,0 +1,74 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../u2f-server/sha256.c"
+#include "bench.h"
+
+struct sha256_input {
+  unsigned char data[1024];
+  unsigned long len;
+};
+
+static void digest(void *data)
+{
+  struct sha256_input *in = data;
+  unsigned char out[32];
+
+  sha256_digest(in->data, in->len, out);
+}
+
+static void process(void *data)
+{
+  struct sha256_input *in = data;
+  struct sha256_state md;
+  unsigned char out[32];
+
+  /* The registration digest is fed in five pieces. */
+  sha256_init(&md);
+  sha256_process(&md, in->data, 1);
+  sha256_process(&md, in->data + 1, 32);
+  sha256_process(&md, in->data + 33, 32);
+  sha256_process(&md, in->data + 65, 64);
+  sha256_process(&md, in->data + 129, 65);
+  sha256_done(&md, out);
+}
+
+void bench_sha256(void)
+{
+  struct sha256_input in;
+
+  sha256_setup();
+  memset(in.data, 0xa5, sizeof(in.data));
+
+  in.len = 64;
+  bench_run("sha256/digest/64", digest, &in);
+  in.len = sizeof(in.data);
+  bench_run("sha256/digest/1024", digest, &in);
+  bench_run("sha256/process/registration", process, &in);
+}
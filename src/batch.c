@@ -0,0 +1,394 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Batch mode: one JSON record per input line, one JSON result per
+ * output line, in input order.  Lines are read in chunks; the worker
+ * threads take groups of records from the chunk, each with its own
+ * contexts sharing one relying party handle, and authentications of a
+ * group go through a single u2fs_authentication_verify_batch() call.
+ */
+
+#include <u2f-server/u2f-server.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <json.h>
+
+#include "batch.h"
+
+#ifdef HAVE_JSON_OBJECT_OBJECT_GET_EX
+#define u2fs_json_object_object_get(obj, key, value) json_object_object_get_ex(obj, key, &value)
+#else
+typedef int json_bool;
+#define u2fs_json_object_object_get(obj, key, value) (value = json_object_object_get(obj, key)) == NULL ? (json_bool)FALSE : (json_bool)TRUE
+#endif
+
+#define CHUNK_LEN 65536
+#define GROUP_LEN 64
+#define RESULT_LEN 1024
+
+struct record {
+  char *line;
+  char *result;
+  size_t lineno;
+};
+
+struct batch {
+  int authenticate;
+  const char *challenge;
+  const u2fs_rp_t *rp;
+  struct record *records;
+  size_t count;
+  size_t next;
+  int failed;
+};
+
+static int hex_decode(const char *hex, unsigned char *out, size_t len)
+{
+  size_t i;
+  unsigned int v;
+
+  if (strlen(hex) != 2 * len)
+    return -1;
+
+  for (i = 0; i < len; i++) {
+    if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+      return -1;
+    out[i] = v;
+  }
+
+  return 0;
+}
+
+static void hex_encode(const unsigned char *data, size_t len, char *out)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    sprintf(out + 2 * i, "%02x", data[i]);
+}
+
+static const char *get_string(json_object * obj, const char *key)
+{
+  json_object *value;
+
+  if (!u2fs_json_object_object_get(obj, key, value) || value == NULL)
+    return NULL;
+
+  /* The response may be given as an object or as a JSON string. */
+  if (json_object_is_type(value, json_type_object))
+    return json_object_to_json_string(value);
+  if (!json_object_is_type(value, json_type_string))
+    return NULL;
+
+  return json_object_get_string(value);
+}
+
+static void set_result(struct batch *b, struct record *r, u2fs_rc rc,
+                       const char *extra)
+{
+  char buf[RESULT_LEN];
+
+  if (rc != U2FS_OK)
+    __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+
+  if (rc == U2FS_OK && extra != NULL)
+    snprintf(buf, sizeof(buf), "{ \"line\": %lu, \"result\": \"%s\", %s }",
+             (unsigned long) r->lineno, u2fs_strerror_name(rc), extra);
+  else if (rc == U2FS_OK)
+    snprintf(buf, sizeof(buf), "{ \"line\": %lu, \"result\": \"%s\" }",
+             (unsigned long) r->lineno, u2fs_strerror_name(rc));
+  else
+    snprintf(buf, sizeof(buf),
+             "{ \"line\": %lu, \"result\": \"%s\", \"error\": \"%s\" }",
+             (unsigned long) r->lineno, u2fs_strerror_name(rc),
+             u2fs_strerror(rc));
+
+  r->result = strdup(buf);
+}
+
+/*
+ * Parse the record @r into @ctx, returning its response.  The record
+ * fields are "response", "challenge" and, to authenticate, "keyHandle"
+ * and the hex encoded "publicKey".  @obj holds the parsed record and
+ * must be released by the caller.
+ */
+static u2fs_rc load_record(const struct batch *b, const struct record *r,
+                           u2fs_ctx_t * ctx, json_object ** obj,
+                           const char **response)
+{
+  unsigned char publicKey[U2FS_PUBLIC_KEY_LEN];
+  const char *challenge, *keyHandle, *hex;
+  u2fs_rc rc;
+
+  *obj = json_tokener_parse(r->line);
+  if (*obj == NULL || !json_object_is_type(*obj, json_type_object))
+    return U2FS_JSON_ERROR;
+
+  *response = get_string(*obj, "response");
+  challenge = get_string(*obj, "challenge");
+  if (challenge == NULL)
+    challenge = b->challenge;
+  if (*response == NULL || challenge == NULL)
+    return U2FS_JSON_ERROR;
+
+  rc = u2fs_set_challenge(ctx, challenge);
+  if (rc != U2FS_OK || !b->authenticate)
+    return rc;
+
+  keyHandle = get_string(*obj, "keyHandle");
+  hex = get_string(*obj, "publicKey");
+  if (keyHandle == NULL || hex == NULL)
+    return U2FS_JSON_ERROR;
+  if (hex_decode(hex, publicKey, sizeof(publicKey)) != 0)
+    return U2FS_FORMAT_ERROR;
+
+  rc = u2fs_set_keyHandle(ctx, keyHandle);
+  if (rc == U2FS_OK)
+    rc = u2fs_set_publicKey(ctx, publicKey);
+
+  return rc;
+}
+
+static void do_register(struct batch *b, struct record *r, u2fs_ctx_t * ctx)
+{
+  char extra[RESULT_LEN], hex[2 * U2FS_PUBLIC_KEY_LEN + 1];
+  u2fs_reg_res_t *res = NULL;
+  const char *response;
+  json_object *obj;
+  u2fs_rc rc;
+
+  rc = load_record(b, r, ctx, &obj, &response);
+  if (rc == U2FS_OK)
+    rc = u2fs_registration_verify(ctx, response, &res);
+
+  if (rc == U2FS_OK) {
+    hex_encode((const unsigned char *) u2fs_get_registration_publicKey(res),
+               U2FS_PUBLIC_KEY_LEN, hex);
+    snprintf(extra, sizeof(extra),
+             "\"keyHandle\": \"%s\", \"publicKey\": \"%s\"",
+             u2fs_get_registration_keyHandle(res), hex);
+    set_result(b, r, rc, extra);
+  } else
+    set_result(b, r, rc, NULL);
+
+  u2fs_free_reg_res(res);
+  if (obj != NULL)
+    json_object_put(obj);
+}
+
+static void do_authenticate(struct batch *b, struct record *r, size_t n,
+                            u2fs_ctx_t ** ctx)
+{
+  json_object *obj[GROUP_LEN];
+  const char *responses[GROUP_LEN];
+  u2fs_ctx_t *ready[GROUP_LEN];
+  struct record *pending[GROUP_LEN];
+  u2fs_auth_res_t *outputs[GROUP_LEN];
+  u2fs_rc rcs[GROUP_LEN];
+  char extra[RESULT_LEN];
+  size_t i, k = 0;
+  uint32_t counter;
+  uint8_t user_presence;
+  u2fs_rc rc, verified;
+
+  for (i = 0; i < n; i++) {
+    rc = load_record(b, &r[i], ctx[i], &obj[i], &responses[k]);
+    if (rc != U2FS_OK) {
+      set_result(b, &r[i], rc, NULL);
+      continue;
+    }
+    ready[k] = ctx[i];
+    pending[k++] = &r[i];
+  }
+
+  for (i = 0; i < k; i++)
+    rcs[i] = U2FS_MEMORY_ERROR;
+  if (k > 0)
+    u2fs_authentication_verify_batch(ready, responses, k, outputs, rcs);
+
+  for (i = 0; i < k; i++) {
+    if (rcs[i] == U2FS_OK) {
+      u2fs_get_authentication_result(outputs[i], &verified, &counter,
+                                     &user_presence);
+      snprintf(extra, sizeof(extra),
+               "\"counter\": %lu, \"userPresence\": %u",
+               (unsigned long) counter, (unsigned) user_presence);
+      set_result(b, pending[i], rcs[i], extra);
+      u2fs_free_auth_res(outputs[i]);
+    } else
+      set_result(b, pending[i], rcs[i], NULL);
+  }
+
+  for (i = 0; i < n; i++)
+    if (obj[i] != NULL)
+      json_object_put(obj[i]);
+}
+
+static void *worker(void *arg)
+{
+  struct batch *b = arg;
+  u2fs_ctx_t *ctx[GROUP_LEN];
+  size_t i, first, n;
+
+  for (i = 0; i < GROUP_LEN; i++) {
+    if (u2fs_init(&ctx[i]) != U2FS_OK
+        || u2fs_set_rp(ctx[i], b->rp) != U2FS_OK) {
+      fprintf(stderr, "error: unable to set up a context\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  while ((first = __atomic_fetch_add(&b->next, GROUP_LEN, __ATOMIC_RELAXED))
+         < b->count) {
+    n = b->count - first < GROUP_LEN ? b->count - first : GROUP_LEN;
+
+    if (b->authenticate)
+      do_authenticate(b, b->records + first, n, ctx);
+    else
+      for (i = 0; i < n; i++)
+        do_register(b, &b->records[first + i], ctx[0]);
+  }
+
+  for (i = 0; i < GROUP_LEN; i++)
+    u2fs_done(ctx[i]);
+
+  return NULL;
+}
+
+/* Process the records read so far on @threads threads and print them. */
+static int run_chunk(struct batch *b, int threads)
+{
+  pthread_t *tid;
+  size_t i;
+  int t, err;
+
+  tid = calloc(threads, sizeof(*tid));
+  if (tid == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  b->next = 0;
+
+  for (t = 0; t < threads; t++) {
+    err = pthread_create(&tid[t], NULL, worker, b);
+    if (err != 0) {
+      fprintf(stderr, "error: pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (t = 0; t < threads; t++)
+    pthread_join(tid[t], NULL);
+  free(tid);
+
+  for (i = 0; i < b->count; i++) {
+    if (b->records[i].result == NULL) {
+      fprintf(stderr, "error: out of memory\n");
+      return -1;
+    }
+    if (printf("%s\n", b->records[i].result) < 0) {
+      perror("write");
+      return -1;
+    }
+    free(b->records[i].result);
+    free(b->records[i].line);
+  }
+  b->count = 0;
+
+  return 0;
+}
+
+int batch_run(const struct gengetopt_args_info *args_info)
+{
+  struct batch b;
+  u2fs_rp_t *rp;
+  char *line = NULL;
+  size_t size = 0, lineno = 0;
+  ssize_t len;
+  u2fs_rc rc;
+  int threads = args_info->threads_arg;
+
+  if (threads < 1) {
+    fprintf(stderr, "error: --threads must be at least 1\n");
+    return EXIT_FAILURE;
+  }
+
+  rc = u2fs_rp_init(&rp, args_info->origin_arg, args_info->appid_arg);
+  if (rc != U2FS_OK) {
+    fprintf(stderr, "error: u2fs_rp_init (%d): %s\n", rc,
+            u2fs_strerror(rc));
+    return EXIT_FAILURE;
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.authenticate = args_info->action_arg == action_arg_authenticate;
+  b.challenge = args_info->challenge_arg;
+  b.rp = rp;
+  b.records = calloc(CHUNK_LEN, sizeof(*b.records));
+  if (b.records == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  while ((len = getline(&line, &size, stdin)) >= 0) {
+    lineno++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    b.records[b.count].lineno = lineno;
+    b.records[b.count].result = NULL;
+    b.records[b.count++].line = line;
+    line = NULL;
+    size = 0;
+
+    if (b.count == CHUNK_LEN && run_chunk(&b, threads) != 0)
+      exit(EXIT_FAILURE);
+  }
+  free(line);
+
+  if (ferror(stdin)) {
+    perror("read");
+    exit(EXIT_FAILURE);
+  }
+
+  if (run_chunk(&b, threads) != 0)
+    exit(EXIT_FAILURE);
+
+  free(b.records);
+  u2fs_rp_done(rp);
+
+  return b.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -37,6 +37,68 @@
 #include <getopt.h>
 
 #include "cmdline.h"
+#include "batch.h"
+
+/*
+ * Append the registered credential to the record array in @path,
+ * creating it if needed, and update the record count in its header.
+ */
+static int append_credential(const char *path, u2fs_reg_res_t * result)
+{
+  unsigned char header[U2FS_CREDENTIAL_HEADER_LEN];
+  unsigned char expected[U2FS_CREDENTIAL_HEADER_LEN];
+  unsigned char record[U2FS_CREDENTIAL_LEN];
+  size_t count = 0;
+  long size;
+  FILE *fp;
+
+  if (u2fs_get_registration_credential(result, record) != U2FS_OK) {
+    fprintf(stderr, "error: unable to encode the credential\n");
+    return -1;
+  }
+
+  if ((fp = fopen(path, "r+b")) == NULL && (fp = fopen(path, "w+b")) == NULL) {
+    perror("open");
+    return -1;
+  }
+
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+    perror("seek");
+    fclose(fp);
+    return -1;
+  }
+
+  if (size > 0) {
+    count = (size - U2FS_CREDENTIAL_HEADER_LEN) / U2FS_CREDENTIAL_LEN;
+    u2fs_credentials_header(expected, count);
+    if (size < U2FS_CREDENTIAL_HEADER_LEN || fseek(fp, 0, SEEK_SET) != 0
+        || fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header, expected, sizeof(header)) != 0
+        || (size - U2FS_CREDENTIAL_HEADER_LEN) % U2FS_CREDENTIAL_LEN != 0) {
+      fprintf(stderr, "error: %s is not a credential file\n", path);
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  u2fs_credentials_header(header, count + 1);
+  if (fseek(fp, U2FS_CREDENTIAL_HEADER_LEN + count * U2FS_CREDENTIAL_LEN,
+            SEEK_SET) != 0
+      || fwrite(record, 1, sizeof(record), fp) != sizeof(record)
+      || fseek(fp, 0, SEEK_SET) != 0
+      || fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+    perror("write");
+    fclose(fp);
+    return -1;
+  }
+
+  if (fclose(fp) != 0) {
+    perror("close");
+    return -1;
+  }
+
+  return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -85,6 +147,11 @@ int main(int argc, char *argv[])
             u2fs_strerror(rc));
     exit(EXIT_FAILURE);
   }
+  if (args_info.batch_flag) {
+    exit_code = batch_run(&args_info);
+    u2fs_global_done();
+    exit(exit_code);
+  }
   rc = u2fs_init(&ctx);
   if (rc != U2FS_OK) {
     fprintf(stderr, "error: u2fs_init (%d): %s\n", rc, u2fs_strerror(rc));
@@ -257,6 +324,10 @@ int main(int argc, char *argv[])
     } else {
       fprintf(stderr, "User key not saved!. Rerun with -p\n");
     }
+
+    if (args_info.credential_given
+        && append_credential(args_info.credential_arg, reg_result) != 0)
+      exit(EXIT_FAILURE);
     break;
   case action_arg_authenticate:
     rc = u2fs_authentication_verify(ctx, buf, &auth_result);
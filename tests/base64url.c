@@ -0,0 +1 @@
+#include "../u2f-server/base64url.c"
@@ -35,6 +35,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static size_t allocs;
+static size_t frees;
+
+static void *count_malloc(size_t size)
+{
+  allocs++;
+  return malloc(size);
+}
+
+static void count_free(void *ptr)
+{
+  frees++;
+  free(ptr);
+}
+
+static int save_counter(const char *keyHandle, uint32_t counter,
+                        void *data)
+{
+  uint32_t *saved = data;
+
+  ck_assert_str_eq(keyHandle,
+                   "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFl"
+                   "vxA04ULD9IJ-KpSyn733LRbJ-CG573N9jCY1g");
+  *saved = counter;
+
+  return 0;
+}
 
 START_TEST(test_create)
 {
@@ -64,6 +94,15 @@ END_TEST START_TEST(set_challenge)
                    U2FS_OK);
   ck_assert_str_eq(ctx->challenge,
                    "dDwRsjdFoPHZ5Qg2fHQsFba0NKl-F1hxjJ3uLLk5gbA");
+  ck_assert_int_eq(ctx->challenge_raw[0], 0x74);
+  ck_assert_int_eq(ctx->challenge_raw[U2FS_CHALLENGE_RAW_LEN - 1], 0xb0);
+
+  /* Right length, but not websafe Base64; the old one is kept. */
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "dDwRsjdFoPHZ5Qg2fHQsFba0NKl+F1hxjJ3uLLk5gbA"),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_str_eq(ctx->challenge,
+                   "dDwRsjdFoPHZ5Qg2fHQsFba0NKl-F1hxjJ3uLLk5gbA");
 
   ck_assert_int_eq(strlen(ctx->challenge), U2FS_CHALLENGE_B64U_LEN);
   char *s = strdup(ctx->challenge);
@@ -124,6 +163,11 @@ END_TEST START_TEST(set_appid)
 {
 
   u2fs_ctx_t *ctx;
+  unsigned char appid_hash[] = {
+    0x39, 0xb0, 0xe3, 0x40, 0xb5, 0xe5, 0x67, 0x57, 0x96, 0xc6, 0x81, 0x4f,
+    0x12, 0x71, 0xba, 0x26, 0xe5, 0xba, 0xdb, 0xca, 0x62, 0x13, 0x3b, 0x58,
+    0x2c, 0x39, 0x98, 0x94, 0x97, 0xb7, 0x01, 0x4e
+  };
 
   ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
   ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
@@ -133,6 +177,8 @@ END_TEST START_TEST(set_appid)
   ck_assert_str_eq(ctx->appid, "http://example.com");
   ck_assert_int_eq(u2fs_set_appid(ctx, "https://test.org"), U2FS_OK);
   ck_assert_str_eq(ctx->appid, "https://test.org");
+  ck_assert_int_eq(memcmp(ctx->application_parameter, appid_hash,
+                          sizeof(appid_hash)), 0);
 
   u2fs_done(ctx);
   u2fs_global_done();
@@ -162,6 +208,51 @@ END_TEST START_TEST(set_publicKey)
 
 }
 
+END_TEST START_TEST(compressed_publicKey)
+{
+
+  unsigned char compressed[U2FS_COMPRESSED_KEY_LEN];
+  unsigned char output[U2FS_PUBLIC_KEY_LEN];
+  unsigned char userkey_dat[] = {
+    0x04, 0x5c, 0x6d, 0xd1, 0x38, 0x3c, 0x71, 0x91, 0x68, 0x95, 0x13, 0x2b,
+    0xd8, 0x58, 0xe0, 0x6a, 0xd7, 0xfe, 0x36, 0x5a, 0xe5, 0xe5, 0xa0,
+    0x8c, 0x92, 0xba, 0x21, 0xfc, 0x1e, 0xce, 0xb9, 0xdd, 0x1e, 0xf4,
+    0x22, 0xed, 0x04, 0x2d, 0x60, 0x0d, 0xaa, 0x02, 0x0e, 0x0d, 0xad,
+    0xe6, 0xcd, 0x91, 0x20, 0xa8, 0x3b, 0x02, 0x74, 0x57, 0x53, 0xf3,
+    0x2e, 0x53, 0xf5, 0x5a, 0xbf, 0xce, 0x92, 0xef, 0xf4
+  };
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_compress_publicKey(userkey_dat, compressed),
+                   U2FS_OK);
+  ck_assert_int_eq(compressed[0], 0x02);
+  ck_assert_int_eq(memcmp(compressed + 1, userkey_dat + 1,
+                          U2FS_COMPRESSED_KEY_LEN - 1), 0);
+
+  ck_assert_int_eq(u2fs_decompress_publicKey(compressed, output), U2FS_OK);
+  ck_assert_int_eq(memcmp(output, userkey_dat, U2FS_PUBLIC_KEY_LEN), 0);
+
+  /* The other y has the opposite parity. */
+  compressed[0] = 0x03;
+  ck_assert_int_eq(u2fs_decompress_publicKey(compressed, output), U2FS_OK);
+  ck_assert_int_eq(memcmp(output, userkey_dat, U2FS_COMPRESSED_KEY_LEN), 0);
+  ck_assert_int_eq(output[U2FS_PUBLIC_KEY_LEN - 1] & 0x01, 1);
+
+  /* No point on the curve has this x coordinate. */
+  compressed[U2FS_COMPRESSED_KEY_LEN - 1] ^= 0x04;
+  ck_assert_int_eq(u2fs_decompress_publicKey(compressed, output),
+                   U2FS_CRYPTO_ERROR);
+
+  ck_assert_int_eq(u2fs_decompress_publicKey(userkey_dat, output),
+                   U2FS_FORMAT_ERROR);
+  ck_assert_int_eq(u2fs_compress_publicKey(compressed, output),
+                   U2FS_FORMAT_ERROR);
+
+  u2fs_global_done();
+
+}
+
 END_TEST START_TEST(registration_verify_ok)
 {
 
@@ -461,6 +552,1359 @@ END_TEST START_TEST(authentication_verify_signature_error)
   u2fs_global_done();
 }
 
+END_TEST START_TEST(authentication_verify_batch)
+{
+
+  u2fs_ctx_t *ctx[2];
+  const char *responses[2];
+  u2fs_auth_res_t *res[2];
+  u2fs_rc rcs[2];
+  uint32_t counter;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx[0]), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx[1]), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx[0], "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx[1], "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx[0], "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx[1], "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx[0], "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx[1], "0000000000000000000000000000000000000000000"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx[0], src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx[1], src_userkey_dat), U2FS_OK);
+
+  responses[0] = auth_response;
+  responses[1] = auth_response;
+
+  ck_assert_int_eq(u2fs_authentication_verify_batch
+                   (ctx, responses, 2, res, rcs), U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(rcs[0], U2FS_OK);
+  ck_assert_int_eq(rcs[1], U2FS_CHALLENGE_ERROR);
+  ck_assert(res[0] != NULL);
+  ck_assert(res[1] == NULL);
+  ck_assert_int_eq(u2fs_get_authentication_result
+                   (res[0], NULL, &counter, NULL), U2FS_OK);
+  ck_assert_int_eq(counter, 38);
+
+  u2fs_free_auth_res(res[0]);
+  u2fs_done(ctx[0]);
+  u2fs_done(ctx[1]);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(authentication_verify_buf)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_auth_res_t *res;
+  char buf[2048];
+  uint32_t counter;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert(U2FS_AUTH_BUFSIZE(strlen(auth_response)) <= sizeof(buf));
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx, src_userkey_dat), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, 64, &res), U2FS_MEMORY_ERROR);
+  ck_assert(res == NULL);
+
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res), U2FS_OK);
+  ck_assert((char *) res >= buf && (char *) res < buf + sizeof(buf));
+  ck_assert_int_eq(u2fs_get_authentication_result
+                   (res, NULL, &counter, NULL), U2FS_OK);
+  ck_assert_int_eq(counter, 38);
+
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(reset)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_pubkey_t *pubkey;
+  u2fs_auth_res_t *res;
+  char buf[2048];
+  uint32_t counter;
+  size_t round_allocs, len;
+  int i;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_reset(NULL), U2FS_MEMORY_ERROR);
+
+  allocs = frees = 0;
+  ck_assert_int_eq(u2fs_set_allocator(count_malloc, NULL, count_free),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+
+  for (i = 0; i < 2; i++) {
+    round_allocs = allocs;
+    ck_assert_int_eq(u2fs_set_challenge
+                     (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                     U2FS_OK);
+    ck_assert_int_eq(u2fs_set_keyHandle
+                     (ctx, "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFl"
+                      "vxA04ULD9IJ-KpSyn733LRbJ-CG573N9jCY1g"), U2FS_OK);
+    ck_assert_int_eq(u2fs_set_pubkey(ctx, pubkey), U2FS_OK);
+    ck_assert_int_eq(u2fs_authentication_verify_buf
+                     (ctx, auth_response, buf, sizeof(buf), &res), U2FS_OK);
+    ck_assert_int_eq(u2fs_get_authentication_result
+                     (res, NULL, &counter, NULL), U2FS_OK);
+    ck_assert_int_eq(counter, 38);
+    ck_assert_int_eq(u2fs_reset(ctx), U2FS_OK);
+
+    /* Only the first round allocates the key handle buffer. */
+    if (i > 0)
+      ck_assert_int_eq(allocs, round_allocs);
+  }
+
+  /* Nothing of the previous request is left to verify against. */
+  ck_assert_int_ne(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res), U2FS_OK);
+  len = sizeof(buf);
+  ck_assert_int_eq(u2fs_authentication_challenge_buf(ctx, buf, &len),
+                   U2FS_MEMORY_ERROR);
+
+  u2fs_done(ctx);
+  u2fs_pubkey_done(pubkey);
+  u2fs_global_done();
+
+  ck_assert_int_eq(allocs, frees);
+
+  ck_assert_int_eq(u2fs_set_allocator(NULL, NULL, NULL), U2FS_OK);
+}
+
+END_TEST START_TEST(ctx_cache)
+{
+
+  u2fs_ctx_t *ctx, *again;
+  u2fs_rp_t *rp;
+  u2fs_store_t *store;
+  u2fs_stats_t stats;
+  u2fs_reg_res_t *res;
+
+  char *reg_response =
+      "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+  allocs = frees = 0;
+  ck_assert_int_eq(u2fs_set_allocator(count_malloc, NULL, count_free),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_ctx_acquire(NULL), U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_store_init(&store, 60), U2FS_OK);
+  memset(&stats, 0, sizeof(stats));
+
+  ck_assert_int_eq(u2fs_ctx_acquire(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_rp(ctx, rp), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_store(ctx, store, U2FS_STORE_ANY), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_stats(ctx, &stats), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_keyHandle(ctx, "kAbb2p57pxHg2mY8y_Kgc"),
+                   U2FS_OK);
+  u2fs_ctx_release(ctx);
+
+  /* The same context comes back, with nothing of its last user. */
+  ck_assert_int_eq(u2fs_ctx_acquire(&again), U2FS_OK);
+  ck_assert(again == ctx);
+  ck_assert_int_eq(u2fs_registration_verify(again, reg_response, &res),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(stats.results[-U2FS_CHALLENGE_ERROR], 0);
+
+  ck_assert_int_eq(u2fs_set_origin(again, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(again, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (again, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_verify(again, reg_response, &res),
+                   U2FS_OK);
+  u2fs_free_reg_res(res);
+  u2fs_ctx_release(again);
+  u2fs_ctx_release(NULL);
+
+  u2fs_store_done(store);
+  u2fs_rp_done(rp);
+
+  /* The last u2fs_global_done() frees the contexts of this thread. */
+  u2fs_global_done();
+  ck_assert_int_eq(allocs, frees);
+
+  ck_assert_int_eq(u2fs_set_allocator(NULL, NULL, NULL), U2FS_OK);
+}
+
+END_TEST START_TEST(challenge_store)
+{
+
+  u2fs_ctx_t *issuer, *verifier;
+  u2fs_store_t *store;
+  u2fs_auth_res_t *res;
+  char buf[2048];
+  uint32_t counter;
+  char *output;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_store_init(&store, 60), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_init(&issuer), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(issuer, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_keyHandle(issuer,
+                                      "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgq"
+                                      "figyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG"
+                                      "573N9jCY1g"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (issuer, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_store(issuer, store, 0), U2FS_OK);
+
+  /* The verifying context never sees the challenge itself. */
+  ck_assert_int_eq(u2fs_init(&verifier), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(verifier, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(verifier, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(verifier, src_userkey_dat), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (verifier, auth_response, buf, sizeof(buf), &res),
+                   U2FS_CHALLENGE_ERROR);
+
+  ck_assert_int_eq(u2fs_set_store(verifier, store, U2FS_STORE_ANY),
+                   U2FS_OK);
+
+  /* Handed out for registration only. */
+  ck_assert_int_eq(u2fs_registration_challenge(issuer, &output), U2FS_OK);
+  free(output);
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (verifier, auth_response, buf, sizeof(buf), &res),
+                   U2FS_CHALLENGE_ERROR);
+
+  ck_assert_int_eq(u2fs_authentication_challenge(issuer, &output), U2FS_OK);
+  free(output);
+
+  /* Any stored challenge is only accepted when asked for. */
+  ck_assert_int_eq(u2fs_set_store(verifier, store, 0), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (verifier, auth_response, buf, sizeof(buf), &res),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(u2fs_set_store(verifier, store, U2FS_STORE_ANY),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (verifier, auth_response, buf, sizeof(buf), &res),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_get_authentication_result
+                   (res, NULL, &counter, NULL), U2FS_OK);
+  ck_assert_int_eq(counter, 38);
+
+  /* Replaying the same response fails. */
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (verifier, auth_response, buf, sizeof(buf), &res),
+                   U2FS_CHALLENGE_ERROR);
+
+  u2fs_done(verifier);
+  u2fs_done(issuer);
+  u2fs_store_done(store);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(challenge_json)
+{
+
+  u2fs_ctx_t *ctx;
+  char *output;
+  char buf[256];
+  size_t len;
+
+  const char *reg =
+      "{ \"challenge\": \"v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo\", "
+      "\"version\": \"U2F_V2\", \"appId\": \"http:\\/\\/a\\\"b\\tc\\u0001\" }";
+  const char *auth =
+      "{ \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\", \"version\": \"U2F_V2\", "
+      "\"challenge\": \"v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo\", "
+      "\"appId\": \"http:\\/\\/a\\\"b\\tc\\u0001\" }";
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://a\"b\tc\x01"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_registration_challenge(ctx, &output), U2FS_OK);
+  ck_assert_str_eq(output, reg);
+  free(output);
+
+  len = 10;
+  ck_assert_int_eq(u2fs_registration_challenge_buf(ctx, buf, &len),
+                   U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(len, strlen(reg) + 1);
+  ck_assert_int_eq(u2fs_registration_challenge_buf(ctx, buf, &len),
+                   U2FS_OK);
+  ck_assert_int_eq(len, strlen(reg));
+  ck_assert_str_eq(buf, reg);
+
+  ck_assert_int_eq(u2fs_set_keyHandle(ctx, "kAbb2p57pxHg2mY8y_Kgc"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_challenge(ctx, &output), U2FS_OK);
+  ck_assert_str_eq(output, auth);
+  free(output);
+
+  len = sizeof(buf);
+  ck_assert_int_eq(u2fs_authentication_challenge_buf(ctx, buf, &len),
+                   U2FS_OK);
+  ck_assert_str_eq(buf, auth);
+
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(set_allocator)
+{
+
+  u2fs_ctx_t *ctx;
+  char *output;
+
+  allocs = frees = 0;
+  ck_assert_int_eq(u2fs_set_allocator(count_malloc, NULL, count_free),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_challenge(ctx, &output), U2FS_OK);
+  count_free(output);
+  ck_assert_int_eq(u2fs_set_keyHandle(ctx, "kAbb2p57pxHg2mY8y_Kgc"),
+                   U2FS_OK);
+  u2fs_done(ctx);
+  u2fs_global_done();
+
+  ck_assert(allocs > 0);
+  ck_assert_int_eq(allocs, frees);
+
+  ck_assert_int_eq(u2fs_set_allocator(NULL, NULL, NULL), U2FS_OK);
+}
+
+END_TEST START_TEST(rp_shared)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_rp_t *rp;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  u2fs_auth_res_t *res = NULL;
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com", NULL),
+                   U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_rp(ctx, NULL), U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_set_rp(ctx, rp), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_OK);
+  u2fs_free_auth_res(res);
+
+  /* Overriding the origin takes a private copy of the appid. */
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://example.com"), U2FS_OK);
+  ck_assert(ctx->rp == NULL);
+  ck_assert_str_eq(ctx->appid, "http://demo.yubico.com");
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_ORIGIN_ERROR);
+
+  u2fs_done(ctx);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(pubkey_shared)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_pubkey_t *key;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  u2fs_auth_res_t *res = NULL;
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&key, NULL), U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_pubkey_init(&key, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_pubkey(ctx, key), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_OK);
+  u2fs_free_auth_res(res);
+  u2fs_done(ctx);
+
+  /* The same handle serves a second context. */
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_pubkey(ctx, key), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_OK);
+  u2fs_free_auth_res(res);
+  u2fs_done(ctx);
+
+  u2fs_pubkey_done(key);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(generate_challenges)
+{
+
+#define N 200
+  char challenges[N][U2FS_CHALLENGE_B64U_LEN + 1];
+  char child[U2FS_CHALLENGE_B64U_LEN + 1];
+  int fds[2];
+  pid_t pid;
+  int status;
+  size_t i, j;
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_generate_challenges(&challenges[0][0], N), U2FS_OK);
+
+  for (i = 0; i < N; i++) {
+    ck_assert_int_eq(strlen(challenges[i]), U2FS_CHALLENGE_B64U_LEN);
+    ck_assert(strspn(challenges[i], "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "abcdefghijklmnopqrstuvwxyz0123456789-_")
+              == U2FS_CHALLENGE_B64U_LEN);
+    for (j = 0; j < i; j++)
+      ck_assert_str_ne(challenges[i], challenges[j]);
+  }
+
+  /* A forked child must not repeat the parent's next challenge. */
+  ck_assert_int_eq(pipe(fds), 0);
+  pid = fork();
+  ck_assert(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    if (u2fs_generate_challenges(child, 1) != U2FS_OK
+        || write(fds[1], child, sizeof(child)) != sizeof(child))
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  ck_assert_int_eq(read(fds[0], child, sizeof(child)), sizeof(child));
+  close(fds[0]);
+  ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+  ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  ck_assert_int_eq(u2fs_generate_challenges(&challenges[0][0], 1), U2FS_OK);
+  ck_assert_str_ne(challenges[0], child);
+
+  u2fs_global_done();
+#undef N
+}
+
+END_TEST START_TEST(counters)
+{
+
+  u2fs_ctx_t *ctx;
+  const char *keyHandle =
+      "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-"
+      "KpSyn733LRbJ-CG573N9jCY1g";
+  u2fs_counters_t *counters;
+  u2fs_auth_res_t *res;
+  char buf[2048];
+  uint32_t saved;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_counters_init(&counters, 16), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_counters(ctx, counters), U2FS_OK);
+
+  /* The table is keyed by the key handle of the context. */
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res),
+                   U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_set_keyHandle(ctx, keyHandle), U2FS_OK);
+
+  /* The response has counter 38. */
+  ck_assert_int_eq(u2fs_counters_restore(counters, keyHandle, 38),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res),
+                   U2FS_COUNTER_ERROR);
+
+  u2fs_counters_done(counters);
+  ck_assert_int_eq(u2fs_counters_init(&counters, 16), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_counters(ctx, counters), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_counters_restore(counters, keyHandle, 37),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify_buf
+                   (ctx, auth_response, buf, sizeof(buf), &res),
+                   U2FS_COUNTER_ERROR);
+
+  /* Restoring never lowers a counter. */
+  ck_assert_int_eq(u2fs_counters_restore(counters, keyHandle, 10),
+                   U2FS_OK);
+  saved = 0;
+  ck_assert_int_eq(u2fs_counters_snapshot(counters, save_counter, &saved),
+                   U2FS_OK);
+  ck_assert_int_eq(saved, 38);
+
+  u2fs_done(ctx);
+  u2fs_counters_done(counters);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(certcache)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_certcache_t *cache;
+  u2fs_reg_res_t *res[3];
+  size_t i;
+
+  char *reg_response =
+      "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_certcache_init(&cache, 1), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+
+  /* Uncached, then a miss filling the cache, then a hit. */
+  for (i = 0; i < 3; i++) {
+    if (i == 1)
+      ck_assert_int_eq(u2fs_set_certcache(ctx, cache), U2FS_OK);
+    ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res[i]),
+                     U2FS_OK);
+  }
+
+  /* Results outlive the cache. */
+  u2fs_certcache_done(cache);
+
+  for (i = 1; i < 3; i++) {
+    ck_assert_str_eq(u2fs_get_registration_attestation(res[i]),
+                     u2fs_get_registration_attestation(res[0]));
+    ck_assert_int_eq(memcmp(u2fs_get_registration_publicKey(res[i]),
+                            u2fs_get_registration_publicKey(res[0]),
+                            U2FS_PUBLIC_KEY_LEN), 0);
+  }
+
+  for (i = 0; i < 3; i++)
+    u2fs_free_reg_res(res[i]);
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(truststore)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_truststore_t *trust;
+  u2fs_reg_res_t *res;
+  char path[] = "/tmp/u2f-server-trust-XXXXXX";
+  const char *pem;
+  FILE *f;
+  int fd;
+
+  static const char *unrelated_root =
+      "-----BEGIN CERTIFICATE-----\n"
+      "MIIBfzCCASWgAwIBAgIUNMIAnXm+vl+ke2sXctM1P1/UTaswCgYIKoZIzj0EAwIw\n"
+      "FDESMBAGA1UEAwwJVGVzdCBSb290MCAXDTI2MTAxNDA4MzkwNVoYDzIxMjYwOTIw\n"
+      "MDgzOTA1WjAUMRIwEAYDVQQDDAlUZXN0IFJvb3QwWTATBgcqhkjOPQIBBggqhkjO\n"
+      "PQMBBwNCAAT5TdOEoPf+0G5PNrUoOQ7hzkYbLQUVWHdXHDIOKBN0UucCU+XjF2Jk\n"
+      "qwUvsOisPrHN5yv/ZXyg9XSKYgvoMFG2o1MwUTAdBgNVHQ4EFgQUBtIPQoSYd8Cw\n"
+      "QZWbLpN1CcaVc5QwHwYDVR0jBBgwFoAUBtIPQoSYd8CwQZWbLpN1CcaVc5QwDwYD\n"
+      "VR0TAQH/BAUwAwEB/zAKBggqhkjOPQQDAgNIADBFAiEA2aX0KNm2VpmndsqL+8n9\n"
+      "Yjgd2hngJBDdUa6cJTHC5eMCIBFm0NLyhEDSKKQhYmaVzJIiwGI5NvaCNgfFJUPp\n"
+      "2JUV\n"
+      "-----END CERTIFICATE-----\n";
+
+  char *reg_response =
+      "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+  ck_assert_int_eq(u2fs_global_init(U2FS_DEBUG), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_truststore_init(&trust, path, NULL),
+                   U2FS_CRYPTO_ERROR);
+
+  /* Trusting a certificate from another vendor only. */
+  fd = mkstemp(path);
+  ck_assert(fd >= 0);
+  f = fdopen(fd, "w");
+  ck_assert(f != NULL);
+  ck_assert(fputs(unrelated_root, f) >= 0);
+  ck_assert_int_eq(fclose(f), 0);
+
+  ck_assert_int_eq(u2fs_truststore_init(&trust, path, NULL), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_truststore(ctx, trust), U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res),
+                   U2FS_ATTESTATION_ERROR);
+  ck_assert_int_eq(u2fs_set_truststore(ctx, NULL), U2FS_OK);
+  u2fs_truststore_done(trust);
+
+  /* Trusting the attestation certificate itself, twice for the memo. */
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res),
+                   U2FS_OK);
+  pem = u2fs_get_registration_attestation(res);
+  f = fopen(path, "a");
+  ck_assert(f != NULL);
+  ck_assert(fputs(pem, f) >= 0);
+  ck_assert_int_eq(fclose(f), 0);
+  u2fs_free_reg_res(res);
+
+  ck_assert_int_eq(u2fs_truststore_init(&trust, path, NULL), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_truststore(ctx, trust), U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res),
+                   U2FS_OK);
+  u2fs_free_reg_res(res);
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res),
+                   U2FS_OK);
+  u2fs_free_reg_res(res);
+
+  unlink(path);
+  u2fs_truststore_done(trust);
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(credential)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_reg_res_t *res;
+  u2fs_pubkey_t *key;
+  unsigned char array[U2FS_CREDENTIAL_HEADER_LEN + 2 * U2FS_CREDENTIAL_LEN];
+  unsigned char *record = array + U2FS_CREDENTIAL_HEADER_LEN;
+  const unsigned char *records;
+  const unsigned char *keyHandle;
+  const unsigned char *publicKey;
+  size_t keyHandle_len;
+  size_t count;
+  uint32_t counter;
+  uint8_t flags;
+
+  char *reg_response =
+      "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &res),
+                   U2FS_OK);
+
+  ck_assert_int_eq(u2fs_get_registration_credential(NULL, record),
+                   U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_get_registration_credential(res, record), U2FS_OK);
+  ck_assert_int_eq(u2fs_credential_decode(record, &keyHandle,
+                                          &keyHandle_len, &publicKey,
+                                          &counter, &flags), U2FS_OK);
+  ck_assert_int_eq(keyHandle_len, 64);
+  ck_assert_int_eq(counter, 0);
+  ck_assert_int_eq(flags, 0);
+  ck_assert(memcmp(publicKey, u2fs_get_registration_publicKey(res),
+                   U2FS_PUBLIC_KEY_LEN) == 0);
+  ck_assert_int_eq(u2fs_pubkey_init(&key, publicKey), U2FS_OK);
+  u2fs_pubkey_done(key);
+
+  ck_assert_int_eq(u2fs_credential_encode(record + U2FS_CREDENTIAL_LEN,
+                                          keyHandle, keyHandle_len,
+                                          publicKey, 0xfeedf00d, 0x5a),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_credential_decode(record + U2FS_CREDENTIAL_LEN,
+                                          NULL, &keyHandle_len, NULL,
+                                          &counter, &flags), U2FS_OK);
+  ck_assert_int_eq(keyHandle_len, 64);
+  ck_assert_int_eq(counter, 0xfeedf00d);
+  ck_assert_int_eq(flags, 0x5a);
+  ck_assert_int_eq(u2fs_credential_encode(record, keyHandle, 0, publicKey,
+                                          0, 0), U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_credential_encode(record, keyHandle,
+                                          U2FS_KEYHANDLE_MAX_LEN + 1,
+                                          publicKey, 0, 0),
+                   U2FS_MEMORY_ERROR);
+
+  ck_assert_int_eq(u2fs_credentials_header(array, 2), U2FS_OK);
+  ck_assert_int_eq(u2fs_credentials_parse(array, sizeof(array), &records,
+                                          &count), U2FS_OK);
+  ck_assert(records == record);
+  ck_assert_int_eq(count, 2);
+  ck_assert_int_eq(u2fs_credentials_parse(array, sizeof(array) - 1,
+                                          &records, &count),
+                   U2FS_FORMAT_ERROR);
+  ck_assert_int_eq(u2fs_credentials_header(array, 3), U2FS_OK);
+  ck_assert_int_eq(u2fs_credentials_parse(array, sizeof(array), &records,
+                                          &count), U2FS_FORMAT_ERROR);
+  ck_assert_int_eq(u2fs_credentials_header(array, 2), U2FS_OK);
+  array[0] = 'X';
+  ck_assert_int_eq(u2fs_credentials_parse(array, sizeof(array), &records,
+                                          &count), U2FS_FORMAT_ERROR);
+
+  record[0] = U2FS_CREDENTIAL_VERSION + 1;
+  ck_assert_int_eq(u2fs_credential_decode(record, NULL, NULL, NULL, NULL,
+                                          NULL), U2FS_FORMAT_ERROR);
+
+  u2fs_free_reg_res(res);
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(creddb)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_creddb_t *db;
+  u2fs_reg_res_t *reg;
+  u2fs_auth_res_t *auth;
+  unsigned char header[U2FS_CREDENTIAL_HEADER_LEN];
+  unsigned char record[U2FS_CREDENTIAL_LEN];
+  const unsigned char *found;
+  const unsigned char *publicKey;
+  char path[] = "/tmp/u2f-server-creddb-XXXXXX";
+  uint32_t counter;
+  FILE *f;
+  int fd;
+
+  static const unsigned char auth_keyHandle[] = {
+    0x90, 0x06, 0xdb, 0xda, 0x9e, 0x7b, 0xa7, 0x11, 0xe0, 0xda, 0x66, 0x3c,
+    0xcb, 0xf2, 0xa0, 0x71, 0xd7, 0x3b, 0x8e, 0x79, 0xc0, 0xa2, 0x77, 0x09,
+    0x9b, 0xcb, 0xce, 0x82, 0xa7, 0xe2, 0x83, 0x25, 0x93, 0xbc, 0xf1, 0x85,
+    0x96, 0xfc, 0x40, 0xd3, 0x85, 0x0b, 0x0f, 0xd2, 0x09, 0xf8, 0xaa, 0x52,
+    0xca, 0x7e, 0xf7, 0xdc, 0xb4, 0x5b, 0x27, 0xe0, 0x86, 0xe7, 0xbd, 0xcd,
+    0xf6, 0x30, 0x98, 0xd6
+  };
+
+  char *reg_response =
+      "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_registration_verify(ctx, reg_response, &reg),
+                   U2FS_OK);
+
+  fd = mkstemp(path);
+  ck_assert(fd >= 0);
+  f = fdopen(fd, "w+b");
+  ck_assert(f != NULL);
+
+  /* Nothing in the file yet. */
+  ck_assert_int_eq(u2fs_creddb_init(&db, path), U2FS_FORMAT_ERROR);
+
+  ck_assert_int_eq(u2fs_credentials_header(header, 2), U2FS_OK);
+  ck_assert_int_eq(fwrite(header, 1, sizeof(header), f), sizeof(header));
+  ck_assert_int_eq(u2fs_get_registration_credential(reg, record), U2FS_OK);
+  ck_assert_int_eq(fwrite(record, 1, sizeof(record), f), sizeof(record));
+  ck_assert_int_eq(u2fs_credential_encode(record, auth_keyHandle,
+                                          sizeof(auth_keyHandle),
+                                          src_userkey_dat, 0, 0), U2FS_OK);
+  ck_assert_int_eq(fwrite(record, 1, sizeof(record), f), sizeof(record));
+  ck_assert_int_eq(fflush(f), 0);
+
+  ck_assert_int_eq(u2fs_creddb_init(&db, path), U2FS_OK);
+
+  ck_assert_int_eq(u2fs_creddb_lookup(db, "AAAA", &found),
+                   U2FS_FORMAT_ERROR);
+  ck_assert_int_eq(u2fs_creddb_lookup
+                   (db, u2fs_get_registration_keyHandle(reg), &found),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_credential_decode(found, NULL, NULL, &publicKey,
+                                          NULL, NULL), U2FS_OK);
+  ck_assert(memcmp(publicKey, u2fs_get_registration_publicKey(reg),
+                   U2FS_PUBLIC_KEY_LEN) == 0);
+
+  ck_assert_int_eq(u2fs_set_credential
+                   (ctx, db,
+                    "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFl"
+                    "vxA04ULD9IJ-KpSyn733LRbJ-CG573N9jCY1g"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &auth),
+                   U2FS_OK);
+  u2fs_free_auth_res(auth);
+
+  /* A record appended later takes over the key handle. */
+  ck_assert_int_eq(u2fs_get_registration_credential(reg, record), U2FS_OK);
+  record[7] = 42;              /* low byte of the counter */
+  ck_assert_int_eq(fseek(f, 0, SEEK_END), 0);
+  ck_assert_int_eq(fwrite(record, 1, sizeof(record), f), sizeof(record));
+  ck_assert_int_eq(u2fs_credentials_header(header, 3), U2FS_OK);
+  ck_assert_int_eq(fseek(f, 0, SEEK_SET), 0);
+  ck_assert_int_eq(fwrite(header, 1, sizeof(header), f), sizeof(header));
+  ck_assert_int_eq(fclose(f), 0);
+
+  ck_assert_int_eq(u2fs_creddb_refresh(db), U2FS_OK);
+  ck_assert_int_eq(u2fs_creddb_lookup
+                   (db, u2fs_get_registration_keyHandle(reg), &found),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_credential_decode(found, NULL, NULL, NULL,
+                                          &counter, NULL), U2FS_OK);
+  ck_assert_int_eq(counter, 42);
+
+  unlink(path);
+  u2fs_creddb_done(db);
+  u2fs_free_reg_res(reg);
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(stats)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_auth_res_t *res;
+  u2fs_stats_t stats, total;
+  int i;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  memset(&stats, 0, sizeof(stats));
+  memset(&total, 0, sizeof(total));
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_stats(NULL, &stats), U2FS_MEMORY_ERROR);
+  ck_assert_int_eq(u2fs_set_stats(ctx, &stats), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 1);
+
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_OK);
+  u2fs_free_auth_res(res);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_JSON], 2);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_BASE64], 2);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 2);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_HASH], 1);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_VERIFY], 1);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_ATTESTATION], 0);
+  ck_assert(stats.nsec[U2FS_STAGE_VERIFY] > 0);
+  ck_assert_int_eq(stats.results[0], 1);
+  ck_assert_int_eq(sizeof(stats.calls) / sizeof(stats.calls[0]), 16);
+  ck_assert_int_eq(sizeof(stats.nsec) / sizeof(stats.nsec[0]), 16);
+  ck_assert_int_eq(sizeof(stats.results) / sizeof(stats.results[0]), 32);
+  ck_assert(U2FS_STAGE_COUNT <= U2FS_STATS_STAGES);
+  ck_assert(-U2FS_KEYHANDLE_ERROR < U2FS_STATS_RESULTS);
+
+  /* A failure stops the timings at the stage that rejected it. */
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_JSON], 4);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_HASH], 1);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_VERIFY], 1);
+  ck_assert_int_eq(stats.results[0], 1);
+  ck_assert_int_eq(stats.results[-U2FS_CHALLENGE_ERROR], 1);
+
+  /* Detached, nothing is counted. */
+  ck_assert_int_eq(u2fs_set_stats(ctx, NULL), U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(stats.results[-U2FS_CHALLENGE_ERROR], 1);
+
+  u2fs_stats_add(&total, &stats);
+  u2fs_stats_add(&total, &stats);
+  for (i = 0; i < U2FS_STAGE_COUNT; i++) {
+    ck_assert(total.calls[i] == 2 * stats.calls[i]);
+    ck_assert(total.nsec[i] == 2 * stats.nsec[i]);
+    ck_assert(u2fs_stats_stage_name(i) != NULL);
+  }
+  ck_assert_int_eq(total.results[-U2FS_CHALLENGE_ERROR], 2);
+
+  ck_assert_str_eq(u2fs_stats_stage_name(U2FS_STAGE_JSON), "json");
+  ck_assert_str_eq(u2fs_stats_stage_name(U2FS_STAGE_VERIFY), "verify");
+  ck_assert(u2fs_stats_stage_name(U2FS_STAGE_COUNT) == NULL);
+
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(registration_truncated)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_reg_res_t *res;
+  u2fs_stats_t stats;
+  char response[2048];
+  size_t n;
+  u2fs_rc rc;
+
+  const char *reg_data =
+      "BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6IfwezrndHvQi7QQtYA2qAg4NrebN"
+      "kSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7"
+      "xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9wa_qzLLTAr6IcwggIbMIIBBaADAgEC"
+      "AgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwKgYDVQQDEyNZdWJpY28gVTJGIFJvb3Qg"
+      "Q0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0xNDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAw"
+      "MDAwMFowKjEoMCYGA1UEAwwfWXViaWNvIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTcz"
+      "MzBZMBMGByqGSM49AgEGCCqGSM49AwEHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvE"
+      "NxDMDLmfd-0ACG0Fu7wR4ZTjKd9KAuidySpfona5csGmlM0Te_Zu35h_wwujEjAQ"
+      "MA4GCisGAQQBgsQKAQIEADALBgkqhkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD"
+      "6UyT4cKyJZGVhWdtPgj_mWepT3Tu9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AX"
+      "gM8A0YaXPwlT4s0RUTY9Y8aAQzQZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj"
+      "6cOnHEqnOr2Cv75FuiQXX7QkGQxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ru"
+      "GWi0YfXBTuqEJ6H666vvMN4BZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwA"
+      "FT9JJrkO2BfsB-wfBrTiHr0AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7"
+      "fM4wRQIhAN3c-VHubCCkUtZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoa"
+      "md9S-cYBosRKso_XGAPzAedzpuE2tEjp1g";
+
+  const char *client_data =
+      "eyAiY2hhbGxlbmdlIjogIllTMTludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnox"
+      "eXFZZW85WUpmQnciLCAib3JpZ2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNv"
+      "bSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=";
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_stats(ctx, &stats), U2FS_OK);
+
+  /* Cut off anywhere, the message must be rejected without overruns. */
+  for (n = 1; n < strlen(reg_data); n++) {
+    snprintf(response, sizeof(response),
+             "{ \"registrationData\": \"%.*s\", \"clientData\": \"%s\" }",
+             (int) n, reg_data, client_data);
+
+    ck_assert_int_eq(u2fs_set_challenge
+                     (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                     U2FS_OK);
+    memset(&stats, 0, sizeof(stats));
+    rc = u2fs_registration_verify(ctx, response, &res);
+    ck_assert_int_ne(rc, U2FS_OK);
+
+    /* Up to the end of the certificate nothing is decoded. */
+    if (n < 899) {
+      ck_assert(rc == U2FS_FORMAT_ERROR || rc == U2FS_BASE64_ERROR);
+      ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 0);
+    }
+  }
+
+  u2fs_done(ctx);
+  u2fs_global_done();
+
+}
+
+END_TEST START_TEST(prefilter)
+{
+
+  u2fs_ctx_t *ctx;
+  u2fs_auth_res_t *res;
+  u2fs_stats_t stats;
+
+  char *auth_response =
+      "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+  /* Counter and user presence, but no room for a signature. */
+  char *short_response =
+      "{ \"signatureData\": \"AQAAACYwRAIg\", \"clientData\": \"eyAiY2\
+    hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9aOXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3\
+    RvME9qVG8iLCAib3JpZ2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsIC\
+    J0eXAiOiAibmF2aWdhdG9yLmlkLmdldEFzc2VydGlvbiIgfQ==\", "
+      "\"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\" }";
+
+  unsigned char src_userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  memset(&stats, 0, sizeof(stats));
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_appid(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_origin(ctx, "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_set_publicKey(ctx, src_userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_set_stats(ctx, &stats), U2FS_OK);
+
+  /* A response for another key handle is turned away first. */
+  ck_assert_int_eq(u2fs_set_keyHandle(ctx, "kAbb2p57pxHg2mY8y_Kgc"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_KEYHANDLE_ERROR);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_BASE64], 0);
+
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, short_response, &res),
+                   U2FS_FORMAT_ERROR);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 0);
+
+  /* Whitespace within the response does not matter. */
+  ck_assert_int_eq(u2fs_set_keyHandle
+                   (ctx, "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFl"
+                    "vxA04ULD9IJ-KpSyn733LRbJ-CG573N9jCY1g"), U2FS_OK);
+
+  /* A wrong challenge never gets to the signature. */
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 0);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_VERIFY], 0);
+
+  ck_assert_int_eq(u2fs_set_challenge
+                   (ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                   U2FS_OK);
+  ck_assert_int_eq(u2fs_authentication_verify(ctx, auth_response, &res),
+                   U2FS_OK);
+  ck_assert_int_eq(stats.calls[U2FS_STAGE_DECODE], 1);
+  u2fs_free_auth_res(res);
+
+  ck_assert_str_eq(u2fs_strerror_name(U2FS_KEYHANDLE_ERROR),
+                   "U2FS_KEYHANDLE_ERROR");
+
+  u2fs_done(ctx);
+  u2fs_global_done();
+}
+
 END_TEST Suite *u2fs_suite(void)
 {
   Suite *s;
@@ -475,14 +1919,33 @@ END_TEST Suite *u2fs_suite(void)
   tcase_add_test(tc_core, set_challenge);
   tcase_add_test(tc_core, set_keyhandle);
   tcase_add_test(tc_core, set_publicKey);
+  tcase_add_test(tc_core, compressed_publicKey);
   tcase_add_test(tc_core, set_origin);
   tcase_add_test(tc_core, set_appid);
   tcase_add_test(tc_core, registration_verify_ok);
   tcase_add_test(tc_core, registration_challenge_error);
   tcase_add_test(tc_core, registration_origin_error);
+  tcase_add_test(tc_core, registration_truncated);
   tcase_add_test(tc_core, authentication_verify_ok);
   tcase_add_test(tc_core, authentication_verify_challenge_error);
   tcase_add_test(tc_core, authentication_verify_signature_error);
+  tcase_add_test(tc_core, authentication_verify_batch);
+  tcase_add_test(tc_core, authentication_verify_buf);
+  tcase_add_test(tc_core, reset);
+  tcase_add_test(tc_core, ctx_cache);
+  tcase_add_test(tc_core, challenge_json);
+  tcase_add_test(tc_core, set_allocator);
+  tcase_add_test(tc_core, rp_shared);
+  tcase_add_test(tc_core, pubkey_shared);
+  tcase_add_test(tc_core, challenge_store);
+  tcase_add_test(tc_core, generate_challenges);
+  tcase_add_test(tc_core, counters);
+  tcase_add_test(tc_core, certcache);
+  tcase_add_test(tc_core, truststore);
+  tcase_add_test(tc_core, credential);
+  tcase_add_test(tc_core, creddb);
+  tcase_add_test(tc_core, stats);
+  tcase_add_test(tc_core, prefilter);
   suite_add_tcase(s, tc_core);
 
   return s;
@@ -1 +1,6 @@
+#ifdef U2FS_CRYPTO_EVP
+#include "../u2f-server/openssl-evp.c"
+#else
+#include "../u2f-server/openssl-eckey.c"
+#endif
 #include "../u2f-server/openssl.c"
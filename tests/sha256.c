@@ -0,0 +1 @@
+#include "../u2f-server/sha256.c"
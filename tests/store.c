@@ -0,0 +1 @@
+#include "../u2f-server/store.c"
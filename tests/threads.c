@@ -0,0 +1,490 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Stress test: many threads initializing the library and verifying
+ * concurrently, sharing one relying party and one public key.
+ */
+
+#include <u2f-server/u2f-server.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#define THREADS 16
+#define ITERATIONS 200
+
+static const char *reg_response =
+    "{ \"registrationData\": \"BQRcbdE4PHGRaJUTK9hY4GrX_jZa5eWgjJK6\
+    IfwezrndHvQi7QQtYA2qAg4NrebNkSCoOwJ0V1PzLlP1Wr_Oku_0QKfeNR0Ei4_\
+    I40GCo5xjm4Q7hnZwzXQ5f5vjtnx7xIqCZ-z7GOGExeouBXxaMgleYpX7xMR6Y9\
+    wa_qzLLTAr6IcwggIbMIIBBaADAgECAgR1o_Z1MAsGCSqGSIb3DQEBCzAuMSwwK\
+    gYDVQQDEyNZdWJpY28gVTJGIFJvb3QgQ0EgU2VyaWFsIDQ1NzIwMDYzMTAgFw0x\
+    NDA4MDEwMDAwMDBaGA8yMDUwMDkwNDAwMDAwMFowKjEoMCYGA1UEAwwfWXViaWN\
+    vIFUyRiBFRSBTZXJpYWwgMTk3MzY3OTczMzBZMBMGByqGSM49AgEGCCqGSM49Aw\
+    EHA0IABBmjfkNqa2mXzVh2ZxuES5coCvvENxDMDLmfd-0ACG0Fu7wR4ZTjKd9KA\
+    uidySpfona5csGmlM0Te_Zu35h_wwujEjAQMA4GCisGAQQBgsQKAQIEADALBgkq\
+    hkiG9w0BAQsDggEBAb0tuI0-CzSxBg4cAlyD6UyT4cKyJZGVhWdtPgj_mWepT3T\
+    u9jXtdgA5F3jfZtTc2eGxuS-PPvqRAkZd40AXgM8A0YaXPwlT4s0RUTY9Y8aAQz\
+    QZeAHuZk3lKKd_LUCg5077dzdt90lC5eVTEduj6cOnHEqnOr2Cv75FuiQXX7QkG\
+    QxtoD-otgvhZ2Fjk29o7Iy9ik7ewHGXOfoVw_ruGWi0YfXBTuqEJ6H666vvMN4B\
+    ZWHtzhC0k5ceQslB9Xdntky-GQgDqNkkBf32GKwAFT9JJrkO2BfsB-wfBrTiHr0\
+    AABYNTNKTceA5dtR3UVpI492VUWQbY3YmWUUfKTI7fM4wRQIhAN3c-VHubCCkUt\
+    ZXfWL1aiEXU1qWRiM_ayKmWLUafyFbAiARTwlVocoamd9S-cYBosRKso_XGAPzA\
+    edzpuE2tEjp1g==\", \"clientData\": \"eyAiY2hhbGxlbmdlIjogIllTMT\
+    ludV9ZWWpnczI5WndrU3dRb2JyNzhPaURXRnoxeXFZZW85WUpmQnciLCAib3JpZ\
+    2luIjogImh0dHA6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdh\
+    dG9yLmlkLmZpbmlzaEVucm9sbG1lbnQiIH0=\" }";
+
+static const char *auth_response =
+    "{ \"signatureData\": \"AQAAACYwRAIgXUFB4phCuqcc0-a9obD8S_eMuM\
+    JbTC0_VrWizmwHadECIAXb_GaAEIuAJv806eUvMjc2Qi-ii5IMbNw2YU2t39Wp\
+    \", \"clientData\": \"eyAiY2hhbGxlbmdlIjogInYzMUlLQkZkTGtkTl9a\
+    OXRYZkF4eWR1cG9mQ2Y4OWs2QTRhN3RvME9qVG8iLCAib3JpZ2luIjogImh0dH\
+    A6XC9cL2RlbW8ueXViaWNvLmNvbSIsICJ0eXAiOiAibmF2aWdhdG9yLmlkLmdl\
+    dEFzc2VydGlvbiIgfQ==\", \"keyHandle\": \"kAbb2p57pxHg2mY8y_Kgc\
+    dc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-KpSyn733LRbJ-CG573N9jC\
+    Y1g\" }";
+
+static const unsigned char userkey_dat[] = {
+  0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+  0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+  0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+  0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+  0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+  0x4c, 0x37, 0x97, 0x83, 0xcb
+};
+
+static const char *keyHandle =
+    "kAbb2p57pxHg2mY8y_Kgcdc7jnnAoncJm8vOgqfigyWTvPGFlvxA04ULD9IJ-"
+    "KpSyn733LRbJ-CG573N9jCY1g";
+
+static u2fs_rp_t *rp;
+static u2fs_pubkey_t *pubkey;
+
+static void *worker(void *arg)
+{
+  size_t *failures = arg;
+  char buf[U2FS_AUTH_BUFSIZE(1024)];
+  u2fs_auth_res_t *auth_res;
+  u2fs_reg_res_t *reg_res;
+  u2fs_ctx_t *ctx;
+  uint32_t counter;
+  char *challenge;
+  int i;
+
+  if (u2fs_global_init(0) != U2FS_OK) {
+    (*failures)++;
+    return NULL;
+  }
+
+  for (i = 0; i < ITERATIONS; i++) {
+    if (u2fs_init(&ctx) != U2FS_OK) {
+      (*failures)++;
+      continue;
+    }
+
+    if (u2fs_set_rp(ctx, rp) != U2FS_OK
+        || u2fs_set_pubkey(ctx, pubkey) != U2FS_OK)
+      (*failures)++;
+
+    switch (i % 4) {
+    case 0:
+      if (u2fs_set_challenge(ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw")
+          != U2FS_OK
+          || u2fs_registration_verify(ctx, reg_response, &reg_res) != U2FS_OK)
+        (*failures)++;
+      else
+        u2fs_free_reg_res(reg_res);
+      break;
+
+    case 1:
+      if (u2fs_registration_challenge(ctx, &challenge) != U2FS_OK)
+        (*failures)++;
+      else
+        free(challenge);
+      break;
+
+    case 2:
+      if (u2fs_set_challenge(ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo")
+          != U2FS_OK
+          || u2fs_authentication_verify_buf(ctx, auth_response, buf,
+                                            sizeof(buf),
+                                            &auth_res) != U2FS_OK
+          || u2fs_get_authentication_result(auth_res, NULL, &counter,
+                                            NULL) != U2FS_OK
+          || counter != 38)
+        (*failures)++;
+      break;
+
+    default:
+      if (u2fs_set_challenge(ctx, "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo")
+          != U2FS_OK
+          || u2fs_authentication_verify(ctx, auth_response, &auth_res)
+          != U2FS_OK)
+        (*failures)++;
+      else
+        u2fs_free_auth_res(auth_res);
+      break;
+    }
+
+    u2fs_done(ctx);
+  }
+
+  u2fs_global_done();
+
+  return NULL;
+}
+
+/* Verify through cached contexts; each thread gets its own back. */
+static void *cached(void *arg)
+{
+  size_t *failures = arg;
+  char buf[U2FS_AUTH_BUFSIZE(1024)];
+  u2fs_auth_res_t *auth_res;
+  u2fs_ctx_t *ctx, *last = NULL;
+  int i;
+
+  for (i = 0; i < ITERATIONS; i++) {
+    if (u2fs_ctx_acquire(&ctx) != U2FS_OK) {
+      (*failures)++;
+      continue;
+    }
+    if (last != NULL && ctx != last)
+      (*failures)++;
+
+    if (u2fs_set_rp(ctx, rp) != U2FS_OK
+        || u2fs_set_pubkey(ctx, pubkey) != U2FS_OK
+        || u2fs_set_challenge(ctx,
+                              "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo")
+        != U2FS_OK
+        || u2fs_authentication_verify_buf(ctx, auth_response, buf,
+                                          sizeof(buf), &auth_res) != U2FS_OK)
+      (*failures)++;
+
+    u2fs_ctx_release(ctx);
+    last = ctx;
+  }
+
+  return NULL;
+}
+
+/* Verify the same response once; only one thread may see it pass. */
+static void *replay(void *arg)
+{
+  u2fs_counters_t *counters = arg;
+  char buf[U2FS_AUTH_BUFSIZE(1024)];
+  u2fs_auth_res_t *res;
+  u2fs_ctx_t *ctx;
+  u2fs_rc rc;
+
+  if (u2fs_init(&ctx) != U2FS_OK)
+    return (void *) (intptr_t) U2FS_MEMORY_ERROR;
+
+  rc = u2fs_set_rp(ctx, rp);
+  if (rc == U2FS_OK)
+    rc = u2fs_set_pubkey(ctx, pubkey);
+  if (rc == U2FS_OK)
+    rc = u2fs_set_keyHandle(ctx, keyHandle);
+  if (rc == U2FS_OK)
+    rc = u2fs_set_challenge(ctx,
+                            "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo");
+  if (rc == U2FS_OK)
+    rc = u2fs_set_counters(ctx, counters);
+  if (rc == U2FS_OK)
+    rc = u2fs_authentication_verify_buf(ctx, auth_response, buf,
+                                        sizeof(buf), &res);
+
+  u2fs_done(ctx);
+
+  return (void *) (intptr_t) rc;
+}
+
+START_TEST(concurrent_verify)
+{
+
+  pthread_t threads[THREADS];
+  size_t failures[THREADS];
+  int i;
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, userkey_dat), U2FS_OK);
+
+  for (i = 0; i < THREADS; i++) {
+    failures[i] = 0;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, worker,
+                                    &failures[i]), 0);
+  }
+
+  for (i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+    ck_assert_int_eq(failures[i], 0);
+  }
+
+  u2fs_pubkey_done(pubkey);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(concurrent_global_init)
+{
+
+  pthread_t threads[THREADS];
+  size_t failures[THREADS];
+  int i;
+
+  /* Every thread initializes and tears down the library on its own. */
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, userkey_dat), U2FS_OK);
+
+  for (i = 0; i < THREADS; i++) {
+    failures[i] = 0;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, worker,
+                                    &failures[i]), 0);
+  }
+
+  for (i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+    ck_assert_int_eq(failures[i], 0);
+  }
+
+  u2fs_pubkey_done(pubkey);
+  u2fs_rp_done(rp);
+}
+
+END_TEST START_TEST(concurrent_counters)
+{
+
+  pthread_t threads[THREADS];
+  u2fs_counters_t *counters;
+  void *rc;
+  int i, round, ok;
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, userkey_dat), U2FS_OK);
+
+  for (round = 0; round < 20; round++) {
+    ck_assert_int_eq(u2fs_counters_init(&counters, 4), U2FS_OK);
+    ck_assert_int_eq(u2fs_counters_restore(counters, keyHandle, 37),
+                     U2FS_OK);
+
+    for (i = 0; i < THREADS; i++)
+      ck_assert_int_eq(pthread_create(&threads[i], NULL, replay, counters),
+                       0);
+
+    for (ok = 0, i = 0; i < THREADS; i++) {
+      ck_assert_int_eq(pthread_join(threads[i], &rc), 0);
+      if ((intptr_t) rc == U2FS_OK)
+        ok++;
+      else
+        ck_assert_int_eq((intptr_t) rc, U2FS_COUNTER_ERROR);
+    }
+    ck_assert_int_eq(ok, 1);
+
+    u2fs_counters_done(counters);
+  }
+
+  u2fs_pubkey_done(pubkey);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+}
+
+END_TEST
+
+/* Completion state shared by the callbacks of the pool test. */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t done_ok, done_failed;
+
+static void auth_done(u2fs_ctx_t * ctx, u2fs_rc rc, u2fs_auth_res_t * res,
+                      void *data)
+{
+  uint32_t counter = 0;
+
+  if (rc == U2FS_OK)
+    u2fs_get_authentication_result(res, NULL, &counter, NULL);
+
+  pthread_mutex_lock(&done_lock);
+  if (rc == U2FS_OK && counter == 38 && data == ctx)
+    done_ok++;
+  else if (rc != U2FS_OK && res == NULL)
+    done_failed++;
+  pthread_mutex_unlock(&done_lock);
+
+  u2fs_free_auth_res(res);
+  u2fs_done(ctx);
+}
+
+static void reg_done(u2fs_ctx_t * ctx, u2fs_rc rc, u2fs_reg_res_t * res,
+                     void *data)
+{
+  (void) data;
+
+  pthread_mutex_lock(&done_lock);
+  if (rc == U2FS_OK && res != NULL)
+    done_ok++;
+  else
+    done_failed++;
+  pthread_mutex_unlock(&done_lock);
+
+  u2fs_free_reg_res(res);
+  u2fs_done(ctx);
+}
+
+START_TEST(pool_verify)
+{
+
+  u2fs_pool_t *pool;
+  u2fs_ctx_t *ctx;
+  char response[2048];
+  int i;
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, userkey_dat), U2FS_OK);
+  ck_assert_int_eq(u2fs_pool_init(&pool, 4), U2FS_OK);
+
+  done_ok = done_failed = 0;
+  for (i = 0; i < ITERATIONS; i++) {
+    ck_assert_int_eq(u2fs_init(&ctx), U2FS_OK);
+    ck_assert_int_eq(u2fs_set_rp(ctx, rp), U2FS_OK);
+    ck_assert_int_eq(u2fs_set_pubkey(ctx, pubkey), U2FS_OK);
+
+    if (i % 8 == 0) {
+      ck_assert_int_eq(u2fs_set_challenge
+                       (ctx, "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw"),
+                       U2FS_OK);
+      ck_assert_int_eq(u2fs_registration_verify_async
+                       (pool, ctx, reg_response, reg_done, NULL), U2FS_OK);
+      continue;
+    }
+
+    /* Every fourth one has the wrong challenge and must fail. */
+    ck_assert_int_eq(u2fs_set_challenge
+                     (ctx, i % 4 == 1 ?
+                      "YS19nu_YYjgs29ZwkSwQobr78OiDWFz1yqYeo9YJfBw" :
+                      "v31IKBFdLkdN_Z9tXfAxydupofCf89k6A4a7to0OjTo"),
+                     U2FS_OK);
+
+    /* The response is copied; the buffer may be reused at once. */
+    strcpy(response, auth_response);
+    ck_assert_int_eq(u2fs_authentication_verify_async
+                     (pool, ctx, response, auth_done, ctx), U2FS_OK);
+    memset(response, 0, sizeof(response));
+  }
+
+  ck_assert_int_eq(u2fs_authentication_verify_async
+                   (pool, NULL, auth_response, auth_done, NULL),
+                   U2FS_MEMORY_ERROR);
+
+  /* Queued verifications all complete before the pool goes away. */
+  u2fs_pool_done(pool);
+  ck_assert_int_eq(done_ok, ITERATIONS - ITERATIONS / 4);
+  ck_assert_int_eq(done_failed, ITERATIONS / 4);
+
+  u2fs_pubkey_done(pubkey);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+}
+
+END_TEST START_TEST(ctx_cache)
+{
+
+  pthread_t threads[THREADS];
+  size_t failures[THREADS];
+  int i;
+
+  ck_assert_int_eq(u2fs_global_init(0), U2FS_OK);
+  ck_assert_int_eq(u2fs_rp_init(&rp, "http://demo.yubico.com",
+                                "http://demo.yubico.com"), U2FS_OK);
+  ck_assert_int_eq(u2fs_pubkey_init(&pubkey, userkey_dat), U2FS_OK);
+
+  for (i = 0; i < THREADS; i++) {
+    failures[i] = 0;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, cached,
+                                    &failures[i]), 0);
+  }
+
+  for (i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+    ck_assert_int_eq(failures[i], 0);
+  }
+
+  u2fs_pubkey_done(pubkey);
+  u2fs_rp_done(rp);
+  u2fs_global_done();
+}
+
+END_TEST Suite *u2fs_threads_suite(void)
+{
+  Suite *s;
+  TCase *tc_threads;
+
+  s = suite_create("u2fs_threads");
+
+  tc_threads = tcase_create("Threads");
+  tcase_set_timeout(tc_threads, 60);
+
+  tcase_add_test(tc_threads, concurrent_verify);
+  tcase_add_test(tc_threads, concurrent_global_init);
+  tcase_add_test(tc_threads, concurrent_counters);
+  tcase_add_test(tc_threads, pool_verify);
+  tcase_add_test(tc_threads, ctx_cache);
+  suite_add_tcase(s, tc_threads);
+
+  return s;
+}
+
+int main(void)
+{
+
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = u2fs_threads_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
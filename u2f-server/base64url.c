@@ -0,0 +1,523 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Strict base64url codec.  Decoding accepts the URL-safe alphabet,
+ * ignores ASCII whitespace and allows trailing '=' padding when it is
+ * of the right length.  The unused low bits of a final partial group
+ * must be zero, so every byte string has exactly one encoding;
+ * anything else is rejected.  Runs of clean input
+ * are decoded with SSSE3 or AVX2 when the CPU has them, the rest with
+ * the table-driven scalar code.
+ */
+
+#include "base64url.h"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64URL_X86 1
+#include <immintrin.h>
+#endif
+
+#define B64_INVALID 0x80
+#define B64_SPACE 0x81
+#define B64_PAD 0x82
+
+static const unsigned char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static const unsigned char decoding[256] = {
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x81, 0x81, 0x80,
+  0x80, 0x81, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x81, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80,
+  0x80, 0x82, 0x80, 0x80, 0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+  0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+  0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x3f,
+  0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+  0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+  0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80
+};
+
+/*
+ * Vector kernels decode whole blocks of alphabet characters and stop
+ * at the first block holding anything else.  They return the number
+ * of input characters consumed; each 4 of them yield 3 output bytes.
+ */
+typedef size_t(*decode_func) (const char *data, size_t len,
+                              unsigned char *output, size_t size);
+
+static decode_func decode_fast;
+
+#ifdef BASE64URL_X86
+__attribute__ ((target("ssse3")))
+static size_t decode_ssse3(const char *data, size_t len,
+                           unsigned char *output, size_t size)
+{
+  const __m128i pack1 = _mm_set1_epi32(0x01400140);
+  const __m128i pack2 = _mm_set1_epi32(0x00011000);
+  const __m128i shuf = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                     14, 13, 12, -1, -1, -1, -1);
+  size_t i = 0, o = 0;
+
+  while (len - i >= 16 && size - o >= 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x40)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8(0x5b)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x60)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8(0x7b)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x2f)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8(0x3a)));
+    __m128i dash = _mm_cmpeq_epi8(c, _mm_set1_epi8('-'));
+    __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+    __m128i valid =
+        _mm_or_si128(_mm_or_si128(upper, lower),
+                     _mm_or_si128(_mm_or_si128(digit, dash), under));
+    __m128i offset;
+
+    if (_mm_movemask_epi8(valid) != 0xffff)
+      break;
+
+    offset = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)),
+                          _mm_and_si128(lower, _mm_set1_epi8(-71)));
+    offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(4)));
+    offset = _mm_or_si128(offset, _mm_and_si128(dash, _mm_set1_epi8(17)));
+    offset = _mm_or_si128(offset, _mm_and_si128(under, _mm_set1_epi8(-32)));
+
+    c = _mm_add_epi8(c, offset);
+    c = _mm_maddubs_epi16(c, pack1);
+    c = _mm_madd_epi16(c, pack2);
+    c = _mm_shuffle_epi8(c, shuf);
+
+    _mm_storeu_si128((__m128i *) (output + o), c);
+    i += 16;
+    o += 12;
+  }
+
+  return i;
+}
+
+__attribute__ ((target("avx2")))
+static size_t decode_avx2(const char *data, size_t len,
+                          unsigned char *output, size_t size)
+{
+  const __m256i pack1 = _mm256_set1_epi32(0x01400140);
+  const __m256i pack2 = _mm256_set1_epi32(0x00011000);
+  const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                        14, 13, 12, -1, -1, -1, -1,
+                                        2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                        14, 13, 12, -1, -1, -1, -1);
+  const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t i = 0, o = 0;
+
+  while (len - i >= 32 && size - o >= 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i upper =
+        _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(0x40)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(0x5b), c));
+    __m256i lower =
+        _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(0x60)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7b), c));
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(0x2f)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(0x3a), c));
+    __m256i dash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-'));
+    __m256i under = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+    __m256i valid =
+        _mm256_or_si256(_mm256_or_si256(upper, lower),
+                        _mm256_or_si256(_mm256_or_si256(digit, dash), under));
+    __m256i offset;
+
+    if (_mm256_movemask_epi8(valid) != -1)
+      break;
+
+    offset = _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-65)),
+                             _mm256_and_si256(lower, _mm256_set1_epi8(-71)));
+    offset = _mm256_or_si256(offset,
+                             _mm256_and_si256(digit, _mm256_set1_epi8(4)));
+    offset = _mm256_or_si256(offset,
+                             _mm256_and_si256(dash, _mm256_set1_epi8(17)));
+    offset = _mm256_or_si256(offset,
+                             _mm256_and_si256(under, _mm256_set1_epi8(-32)));
+
+    c = _mm256_add_epi8(c, offset);
+    c = _mm256_maddubs_epi16(c, pack1);
+    c = _mm256_madd_epi16(c, pack2);
+    c = _mm256_shuffle_epi8(c, shuf);
+    c = _mm256_permutevar8x32_epi32(c, perm);
+
+    _mm256_storeu_si256((__m256i *) (output + o), c);
+    i += 32;
+    o += 24;
+  }
+
+  return i;
+}
+#endif
+
+/*
+ * Pick the vector kernel for this CPU.  Called from u2fs_global_init(),
+ * until then only the scalar code is used.
+ */
+void base64url_init(void)
+{
+#ifdef BASE64URL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    decode_fast = decode_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    decode_fast = decode_ssse3;
+#endif
+}
+
+/*
+ * Encode @len bytes of @data to @output without padding, followed by a
+ * NUL.  @output must hold BASE64URL_ENCODED_LEN(@len) + 1 characters.
+ * Returns the encoded length.
+ */
+size_t base64url_encode(const unsigned char *data, size_t len, char *output)
+{
+  char *p = output;
+  uint32_t v;
+
+  for (; len >= 3; len -= 3, data += 3) {
+    v = (uint32_t) data[0] << 16 | (uint32_t) data[1] << 8 | data[2];
+    *p++ = alphabet[v >> 18];
+    *p++ = alphabet[(v >> 12) & 0x3f];
+    *p++ = alphabet[(v >> 6) & 0x3f];
+    *p++ = alphabet[v & 0x3f];
+  }
+
+  if (len > 0) {
+    v = (uint32_t) data[0] << 16;
+    if (len > 1)
+      v |= (uint32_t) data[1] << 8;
+    *p++ = alphabet[v >> 18];
+    *p++ = alphabet[(v >> 12) & 0x3f];
+    if (len > 1)
+      *p++ = alphabet[(v >> 6) & 0x3f];
+  }
+
+  *p = '\0';
+
+  return p - output;
+}
+
+static u2fs_rc
+decode_scalar(const unsigned char *data, size_t len, unsigned char *output,
+              size_t size, size_t * output_len)
+{
+  const unsigned char *end = data + len;
+  uint32_t acc = 0;
+  size_t o = 0;
+  int n = 0;
+  int pad = 0;
+  unsigned char v;
+
+  while (data < end) {
+    /* Four alphabet characters in a row, the common case. */
+    if (n == 0 && pad == 0 && end - data >= 4 && size - o >= 3
+        && ((decoding[data[0]] | decoding[data[1]] |
+             decoding[data[2]] | decoding[data[3]]) & B64_INVALID) == 0) {
+      acc = (uint32_t) decoding[data[0]] << 18
+          | (uint32_t) decoding[data[1]] << 12
+          | (uint32_t) decoding[data[2]] << 6 | decoding[data[3]];
+      output[o++] = acc >> 16;
+      output[o++] = acc >> 8;
+      output[o++] = acc;
+      data += 4;
+      continue;
+    }
+
+    v = decoding[*data++];
+    if (v == B64_SPACE)
+      continue;
+    if (v == B64_PAD) {
+      pad++;
+      continue;
+    }
+    if (v == B64_INVALID || pad)
+      return U2FS_BASE64_ERROR;
+
+    acc = acc << 6 | v;
+    if (++n == 4) {
+      if (size - o < 3)
+        return U2FS_MEMORY_ERROR;
+      output[o++] = acc >> 16;
+      output[o++] = acc >> 8;
+      output[o++] = acc;
+      acc = 0;
+      n = 0;
+    }
+  }
+
+  if (n == 1 || (pad && (n == 0 || pad != 4 - n)))
+    return U2FS_BASE64_ERROR;
+
+  /* Leftover bits would let "AB" decode like "AA". */
+  if ((n == 2 && (acc & 0xf) != 0) || (n == 3 && (acc & 0x3) != 0))
+    return U2FS_BASE64_ERROR;
+
+  if (size - o < (size_t) (n ? n - 1 : 0))
+    return U2FS_MEMORY_ERROR;
+
+  if (n == 2)
+    output[o++] = acc >> 4;
+  else if (n == 3) {
+    output[o++] = acc >> 10;
+    output[o++] = acc >> 2;
+  }
+
+  *output_len = o;
+
+  return U2FS_OK;
+}
+
+/*
+ * Decode @len characters of @data into @output.  On input
+ * @output_len is the size of @output, at most @len * 3 / 4 + 2 bytes
+ * are needed; on success it is set to the decoded length.
+ */
+u2fs_rc base64url_decode(const char *data, size_t len,
+                         unsigned char *output, size_t * output_len)
+{
+  size_t consumed = 0;
+  size_t n;
+  u2fs_rc rc;
+
+  if (decode_fast)
+    consumed = decode_fast(data, len, output, *output_len);
+
+  rc = decode_scalar((const unsigned char *) data + consumed,
+                     len - consumed, output + consumed / 4 * 3,
+                     *output_len - consumed / 4 * 3, &n);
+  if (rc != U2FS_OK)
+    return rc;
+
+  *output_len = consumed / 4 * 3 + n;
+
+  return U2FS_OK;
+}
+
+/*
+ * Compare the encodings @a and @b character by character, skipping
+ * the whitespace and padding that base64url_decode() skips, so two
+ * spellings of the same data compare equal without decoding either.
+ * A mismatch does not end the loop early; only the lengths show in
+ * the running time.
+ */
+int base64url_equal(const char *a, size_t alen, const char *b, size_t blen)
+{
+  size_t i = 0, j = 0;
+  unsigned char diff = 0;
+
+  for (;;) {
+    while (i < alen && decoding[(unsigned char) a[i]] > B64_INVALID)
+      i++;
+    while (j < blen && decoding[(unsigned char) b[j]] > B64_INVALID)
+      j++;
+
+    if (i == alen || j == blen)
+      return diff == 0 && i == alen && j == blen;
+    diff |= a[i++] ^ b[j++];
+  }
+}
+
+#ifdef MAKE_CHECK
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+START_TEST(test_roundtrip)
+{
+
+  unsigned char data[200], decoded[200];
+  char encoded[BASE64URL_ENCODED_LEN(200) + 1];
+  size_t len, i, n;
+
+  base64url_init();
+  srand(1);
+
+  for (len = 0; len <= sizeof(data); len++) {
+    for (i = 0; i < len; i++)
+      data[i] = rand();
+
+    n = base64url_encode(data, len, encoded);
+    ck_assert_int_eq(n, BASE64URL_ENCODED_LEN(len));
+    ck_assert_int_eq(strlen(encoded), n);
+
+    n = sizeof(decoded);
+    ck_assert_int_eq(base64url_decode(encoded, strlen(encoded), decoded,
+                                      &n), U2FS_OK);
+    ck_assert_int_eq(n, len);
+    ck_assert(memcmp(data, decoded, len) == 0);
+  }
+
+}
+
+END_TEST START_TEST(test_kernels)
+{
+
+  unsigned char data[300], decoded[300];
+  char encoded[BASE64URL_ENCODED_LEN(300) + 1];
+  size_t len, n, i, bad, consumed;
+  decode_func kernels[2] = { NULL, NULL };
+  int k;
+
+#ifdef BASE64URL_X86
+  if (__builtin_cpu_supports("ssse3"))
+    kernels[0] = decode_ssse3;
+  if (__builtin_cpu_supports("avx2"))
+    kernels[1] = decode_avx2;
+#endif
+
+  srand(2);
+
+  for (len = 0; len <= sizeof(data); len += 3) {
+    for (i = 0; i < len; i++)
+      data[i] = rand();
+    n = base64url_encode(data, len, encoded);
+
+    for (k = 0; k < 2; k++) {
+      if (kernels[k] == NULL)
+        continue;
+
+      consumed = kernels[k] (encoded, n, decoded, sizeof(decoded));
+      ck_assert_int_eq(consumed % 16, 0);
+      ck_assert(consumed <= n);
+      ck_assert(n - consumed < 32
+                || sizeof(decoded) - consumed / 4 * 3 < 32);
+      ck_assert(memcmp(decoded, data, consumed / 4 * 3) == 0);
+    }
+
+    /* The kernels must stop before anything outside the alphabet. */
+    if (n == 0)
+      continue;
+    bad = rand() % n;
+    encoded[bad] = "+/= \n\x80"[rand() % 6];
+
+    for (k = 0; k < 2; k++)
+      if (kernels[k] != NULL)
+        ck_assert(kernels[k] (encoded, n, decoded, sizeof(decoded)) <= bad);
+  }
+
+}
+
+END_TEST START_TEST(test_strict)
+{
+
+  static const char *const good[] = {
+    "", "Zm8", "Zm8=", "Zm9v", "Zg==", " Zm 9v\n", "Zg= =", "-_-_"
+  };
+  static const char *const bad[] = {
+    "Z", "Zm8==", "Zg=", "Z===", "=", "Zm=9v", "Zm9v+", "Zm/9", "Zm9v\x80",
+    "AB", "AAB", "Zh", "Zh==", "Zm9", "Zm9=",
+    "Zm9vZm9vZm9vZm9vZm9vZm9vZm9vZm9vZh"
+  };
+  unsigned char buf[32];
+  size_t i, n;
+
+  for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+    n = sizeof(buf);
+    ck_assert_int_eq(base64url_decode(good[i], strlen(good[i]), buf, &n),
+                     U2FS_OK);
+  }
+
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    n = sizeof(buf);
+    ck_assert_int_eq(base64url_decode(bad[i], strlen(bad[i]), buf, &n),
+                     U2FS_BASE64_ERROR);
+  }
+
+  n = 2;
+  ck_assert_int_eq(base64url_decode("Zm9v", 4, buf, &n), U2FS_MEMORY_ERROR);
+
+}
+
+END_TEST START_TEST(test_equal)
+{
+
+  ck_assert(base64url_equal("Zm9v", 4, "Zm9v", 4));
+  ck_assert(base64url_equal(" Zm\n9v ", 7, "Zm9v", 4));
+  ck_assert(base64url_equal("Zg==", 4, "Zg", 2));
+  ck_assert(base64url_equal("", 0, " ", 1));
+  ck_assert(!base64url_equal("Zm9v", 4, "Zm9w", 4));
+  ck_assert(!base64url_equal("Zm9v", 4, "Zm9", 3));
+  ck_assert(!base64url_equal("Zm9", 3, "Zm9v", 4));
+
+}
+
+END_TEST Suite *u2fs_base64url_suite(void)
+{
+  Suite *s;
+  TCase *tc_b64;
+
+  s = suite_create("u2fs_base64url");
+
+  tc_b64 = tcase_create("Base64url");
+
+  tcase_add_test(tc_b64, test_roundtrip);
+  tcase_add_test(tc_b64, test_kernels);
+  tcase_add_test(tc_b64, test_strict);
+  tcase_add_test(tc_b64, test_equal);
+  suite_add_tcase(s, tc_b64);
+
+  return s;
+}
+
+int main(void)
+{
+
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = u2fs_base64url_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+#endif
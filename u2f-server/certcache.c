@@ -0,0 +1,262 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * LRU cache of decoded attestation certificates, keyed by the SHA-256
+ * of their DER encoding.  Devices of one batch share a certificate, so
+ * repeat registrations skip the ASN.1 parsing and key extraction.
+ * Certificates and keys are reference counted objects and handed out
+ * as new references.
+ */
+
+#include "internal.h"
+#include "certcache.h"
+#include "crypto.h"
+#include "sha256.h"
+
+#include <pthread.h>
+#include <string.h>
+
+struct cert_entry {
+  unsigned char digest[_SHA256_LEN];
+  u2fs_X509_t *cert;
+  u2fs_EC_KEY_t *key;
+  struct cert_entry *next;
+  struct cert_entry *lru_prev;
+  struct cert_entry *lru_next;
+};
+
+struct u2fs_certcache {
+  pthread_mutex_t lock;
+  size_t size;
+  size_t count;
+  size_t nbuckets;
+  struct cert_entry **buckets;
+  struct cert_entry *lru_head;
+  struct cert_entry *lru_tail;
+};
+
+static struct cert_entry **bucket(u2fs_certcache_t * cache,
+                                  const unsigned char *digest)
+{
+  size_t h;
+
+  /* The digest is uniformly distributed already. */
+  memcpy(&h, digest, sizeof(h));
+
+  return &cache->buckets[h & (cache->nbuckets - 1)];
+}
+
+static void lru_unlink(u2fs_certcache_t * cache, struct cert_entry *e)
+{
+  if (e->lru_prev != NULL)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    cache->lru_head = e->lru_next;
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache->lru_tail = e->lru_prev;
+}
+
+static void lru_push(u2fs_certcache_t * cache, struct cert_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL)
+    cache->lru_head->lru_prev = e;
+  else
+    cache->lru_tail = e;
+  cache->lru_head = e;
+}
+
+static void entry_free(struct cert_entry *e)
+{
+  free_cert(e->cert);
+  free_key(e->key);
+  u2fs_free(e);
+}
+
+static void evict(u2fs_certcache_t * cache)
+{
+  struct cert_entry *e = cache->lru_tail, **p;
+
+  for (p = bucket(cache, e->digest); *p != e; p = &(*p)->next);
+  *p = e->next;
+  lru_unlink(cache, e);
+  cache->count--;
+
+  entry_free(e);
+}
+
+/* Hand out references to the contents of @e.  Called locked. */
+static void entry_get(struct cert_entry *e, u2fs_X509_t ** cert,
+                      u2fs_EC_KEY_t ** key)
+{
+  *cert = ref_cert(e->cert);
+  *key = ref_key(e->key);
+}
+
+static struct cert_entry *lookup(u2fs_certcache_t * cache,
+                                 const unsigned char *digest)
+{
+  struct cert_entry *e;
+
+  for (e = *bucket(cache, digest); e != NULL; e = e->next)
+    if (memcmp(e->digest, digest, sizeof(e->digest)) == 0)
+      return e;
+
+  return NULL;
+}
+
+/*
+ * Decode the certificate @der of @len bytes and extract its public
+ * key, using the cache where possible.  The caller owns both results.
+ */
+u2fs_rc certcache_get(u2fs_certcache_t * cache, const unsigned char *der,
+                      size_t len, u2fs_X509_t ** cert,
+                      u2fs_EC_KEY_t ** key)
+{
+  unsigned char digest[_SHA256_LEN];
+  struct cert_entry *e, *fresh;
+  u2fs_rc rc;
+
+  sha256_digest(der, len, digest);
+
+  pthread_mutex_lock(&cache->lock);
+  e = lookup(cache, digest);
+  if (e != NULL) {
+    lru_unlink(cache, e);
+    lru_push(cache, e);
+    entry_get(e, cert, key);
+    pthread_mutex_unlock(&cache->lock);
+    return U2FS_OK;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  fresh = u2fs_calloc(1, sizeof(*fresh));
+  if (fresh == NULL)
+    return U2FS_MEMORY_ERROR;
+  memcpy(fresh->digest, digest, sizeof(digest));
+
+  rc = decode_X509(der, len, &fresh->cert);
+  if (rc == U2FS_OK)
+    rc = extract_EC_KEY_from_X509(fresh->cert, &fresh->key);
+  if (rc != U2FS_OK) {
+    free_cert(fresh->cert);
+    free_key(fresh->key);
+    u2fs_free(fresh);
+    return rc;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+
+  /* Another thread may have added the same certificate meanwhile. */
+  e = lookup(cache, digest);
+  if (e == NULL) {
+    if (cache->count == cache->size)
+      evict(cache);
+    fresh->next = *bucket(cache, digest);
+    *bucket(cache, digest) = fresh;
+    lru_push(cache, fresh);
+    cache->count++;
+    e = fresh;
+    fresh = NULL;
+  }
+  entry_get(e, cert, key);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  if (fresh != NULL)
+    entry_free(fresh);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_certcache_init:
+ * @cache: pointer to output variable holding a certificate cache handle.
+ * @size: maximum number of attestation certificates kept.
+ *
+ * Create a cache of the @size most recently seen attestation
+ * certificates.  Once attached to a context with u2fs_set_certcache(),
+ * registrations using a certificate from the cache skip its decoding.
+ * The cache is thread safe and may be shared by any number of
+ * contexts.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_certcache_init(u2fs_certcache_t ** cache, size_t size)
+{
+  size_t nbuckets;
+
+  if (cache == NULL || size == 0 || size > ((size_t) - 1) / 4)
+    return U2FS_MEMORY_ERROR;
+
+  for (nbuckets = 1; nbuckets < size; nbuckets *= 2);
+
+  *cache = u2fs_calloc(1, sizeof(**cache));
+  if (*cache == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*cache)->buckets = u2fs_calloc(nbuckets, sizeof(*(*cache)->buckets));
+  if ((*cache)->buckets == NULL) {
+    u2fs_free(*cache);
+    *cache = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  pthread_mutex_init(&(*cache)->lock, NULL);
+  (*cache)->size = size;
+  (*cache)->nbuckets = nbuckets;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_certcache_done:
+ * @cache: a certificate cache handle, from u2fs_certcache_init()
+ *
+ * Deallocate resources associated with @cache.  Registration results
+ * obtained through the cache stay valid.  No context referring to
+ * @cache may be used afterwards.
+ */
+void u2fs_certcache_done(u2fs_certcache_t * cache)
+{
+  if (cache == NULL)
+    return;
+
+  while (cache->count > 0)
+    evict(cache);
+
+  pthread_mutex_destroy(&cache->lock);
+  u2fs_free(cache->buckets);
+  u2fs_free(cache);
+}
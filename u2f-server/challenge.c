@@ -0,0 +1,143 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Challenges are drawn from a per-thread pool that is refilled with a
+ * single DRBG call and encoded in one go, so issuing one costs a copy
+ * instead of a locked RAND_bytes() call.  The pool of the forking
+ * thread is discarded in the child, which must not hand out the same
+ * challenges as its parent.
+ */
+
+#include "internal.h"
+#include "challenge.h"
+#include "crypto.h"
+#include "base64url.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define POOL_CHALLENGES 64
+
+struct challenge_pool {
+  size_t left;
+  char challenges[POOL_CHALLENGES][U2FS_CHALLENGE_B64U_LEN + 1];
+};
+
+static U2FS_THREAD_LOCAL struct challenge_pool pool;
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+static void pool_discard(void)
+{
+  cleanse_bytes(&pool, sizeof(pool));
+}
+
+static void pool_setup(void)
+{
+  pthread_atfork(NULL, NULL, pool_discard);
+}
+
+/* Called by u2fs_global_init(). */
+void challenge_setup(void)
+{
+  pthread_once(&setup_once, pool_setup);
+}
+
+static u2fs_rc pool_refill(void)
+{
+  unsigned char raw[POOL_CHALLENGES * U2FS_CHALLENGE_RAW_LEN];
+  size_t i;
+  u2fs_rc rc;
+
+  rc = set_random_bytes((char *) raw, sizeof(raw));
+  if (rc != U2FS_OK)
+    return rc;
+
+  for (i = 0; i < POOL_CHALLENGES; i++)
+    base64url_encode(raw + i * U2FS_CHALLENGE_RAW_LEN,
+                     U2FS_CHALLENGE_RAW_LEN, pool.challenges[i]);
+  cleanse_bytes(raw, sizeof(raw));
+
+  pool.left = POOL_CHALLENGES;
+
+  return U2FS_OK;
+}
+
+/*
+ * Write a fresh, NUL terminated challenge to @challenge, which must
+ * hold U2FS_CHALLENGE_B64U_LEN + 1 characters.
+ */
+u2fs_rc challenge_next(char *challenge)
+{
+  char *next;
+  u2fs_rc rc;
+
+  if (pool.left == 0) {
+    rc = pool_refill();
+    if (rc != U2FS_OK)
+      return rc;
+  }
+
+  next = pool.challenges[POOL_CHALLENGES - pool.left--];
+  memcpy(challenge, next, U2FS_CHALLENGE_B64U_LEN + 1);
+  cleanse_bytes(next, U2FS_CHALLENGE_B64U_LEN + 1);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_generate_challenges:
+ * @challenges: output buffer of @count * (%U2FS_CHALLENGE_B64U_LEN + 1) bytes.
+ * @count: number of challenges to generate.
+ *
+ * Fill @challenges with @count fresh random challenges, each a
+ * %U2FS_CHALLENGE_B64U_LEN character websafe Base64 string followed by
+ * a NUL, back to back.  They can be passed to u2fs_set_challenge()
+ * later, for example to prepare for a burst of logins.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_generate_challenges(char *challenges, size_t count)
+{
+  u2fs_rc rc;
+  size_t i;
+
+  if (challenges == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  for (i = 0; i < count; i++) {
+    rc = challenge_next(challenges + i * (U2FS_CHALLENGE_B64U_LEN + 1));
+    if (rc != U2FS_OK)
+      return rc;
+  }
+
+  return U2FS_OK;
+}
@@ -33,9 +33,15 @@
 #include <unistd.h>
 #include <json.h>
 #include "crypto.h"
-#include "b64/cencode.h"
-#include "b64/cdecode.h"
+#include "base64url.h"
 #include "sha256.h"
+#include "scan.h"
+#include "store.h"
+#include "challenge.h"
+#include "counter.h"
+#include "certcache.h"
+#include "truststore.h"
+#include "stats.h"
 
 #ifdef HAVE_JSON_OBJECT_OBJECT_GET_EX
 #define u2fs_json_object_object_get(obj, key, value) json_object_object_get_ex(obj, key, &value)
@@ -44,36 +50,394 @@ typedef int json_bool;
 #define u2fs_json_object_object_get(obj, key, value) (value = json_object_object_get(obj, key)) == NULL ? (json_bool)FALSE : (json_bool)TRUE
 #endif
 
-static u2fs_rc encode_b64u(const char *data, size_t data_len, char *output)
+/* Bounds of a DER encoded P-256 ECDSA signature. */
+#define ECDSA_SIG_MIN_LEN 8
+#define ECDSA_SIG_MAX_LEN 72
+
+/*
+ * Scratch space for the intermediate (decoded) data of a verification.
+ * A single buffer is carved up with scratch_alloc() and released in
+ * one go, so a batch of verifications can share it.
+ */
+struct u2fs_scratch {
+  char *buf;
+  size_t size;
+  size_t used;
+};
+
+/*
+ * Every field is copied out of the response once and decoded once;
+ * base64 decoding never expands, so this is always enough.
+ */
+#define SCRATCH_LEN(response_len) U2FS_AUTH_BUFSIZE(response_len)
+
+/* Alignment suitable for the result structures. */
+#define SCRATCH_ALIGN 16
+
+static u2fs_rc scratch_init(struct u2fs_scratch *scratch, size_t size)
 {
-  base64_encodestate b64;
-  int cnt;
+  scratch->buf = u2fs_malloc(size);
+  if (scratch->buf == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  scratch->size = size;
+  scratch->used = 0;
+
+  return U2FS_OK;
+}
+
+static void scratch_done(struct u2fs_scratch *scratch)
+{
+  u2fs_free(scratch->buf);
+  scratch->buf = NULL;
+  scratch->size = 0;
+  scratch->used = 0;
+}
+
+static void *scratch_alloc(struct u2fs_scratch *scratch, size_t len)
+{
+  char *p;
+
+  if (len > scratch->size - scratch->used)
+    return NULL;
 
-  if ((data_len * 4) >= (_B64_BUFSIZE * 3) || output == NULL)	//base64 is 75% efficient (4 characters encode 3 bytes)
+  p = scratch->buf + scratch->used;
+  scratch->used += len;
+
+  return p;
+}
+
+static void *scratch_alloc_aligned(struct u2fs_scratch *scratch, size_t len)
+{
+  size_t pad = (SCRATCH_ALIGN -
+                (uintptr_t) (scratch->buf + scratch->used) % SCRATCH_ALIGN)
+      % SCRATCH_ALIGN;
+
+  if (pad > scratch->size - scratch->used)
+    return NULL;
+
+  scratch->used += pad;
+
+  return scratch_alloc(scratch, len);
+}
+
+static char *scratch_strdup(struct u2fs_scratch *scratch, const char *str)
+{
+  size_t len = strlen(str);
+  char *p;
+
+  p = scratch_alloc(scratch, len + 1);
+  if (p != NULL)
+    memcpy(p, str, len + 1);
+
+  return p;
+}
+
+static u2fs_rc encode_b64u(const char *data, size_t data_len, char *output)
+{
+  if (BASE64URL_ENCODED_LEN(data_len) >= _B64_BUFSIZE || output == NULL)
     return U2FS_MEMORY_ERROR;
 
-  base64_init_encodestate(&b64);
-  cnt = base64_encode_block(data, data_len, output, &b64);
-  cnt += base64_encode_blockend(output + cnt, &b64);
+  base64url_encode((const unsigned char *) data, data_len, output);
+
+  return U2FS_OK;
+}
+
+/*
+ * Store @challenge in @ctx, both as text for the challenge messages
+ * and as the raw bytes responses are compared against.
+ */
+static u2fs_rc store_challenge(u2fs_ctx_t * ctx, const char *challenge)
+{
+  unsigned char raw[U2FS_CHALLENGE_RAW_LEN + 2];
+  size_t len = sizeof(raw);
+
+  if (base64url_decode(challenge, U2FS_CHALLENGE_B64U_LEN, raw, &len)
+      != U2FS_OK || len != U2FS_CHALLENGE_RAW_LEN)
+    return U2FS_CHALLENGE_ERROR;
 
-  output[cnt] = '\0';
+  memcpy(ctx->challenge, challenge, U2FS_CHALLENGE_B64U_LEN);
+  ctx->challenge[U2FS_CHALLENGE_B64U_LEN] = '\0';
+  memcpy(ctx->challenge_raw, raw, U2FS_CHALLENGE_RAW_LEN);
 
   return U2FS_OK;
 }
 
-static u2fs_rc gen_challenge(u2fs_ctx_t *ctx)
+/*
+ * Make sure @ctx has a challenge, and remember it in the context's
+ * challenge store if there is one.
+ */
+static u2fs_rc gen_challenge(u2fs_ctx_t *ctx, enum store_kind kind)
 {
-  char buf[U2FS_CHALLENGE_RAW_LEN];
+  char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
   u2fs_rc rc;
 
-  if (ctx->challenge[0] != '\0')
+  if (ctx->challenge[0] == '\0') {
+    rc = challenge_next(challenge);
+    if (rc == U2FS_OK)
+      rc = store_challenge(ctx, challenge);
+    cleanse_bytes(challenge, sizeof(challenge));
+    if (rc != U2FS_OK)
+      return rc;
+  }
+
+  if (ctx->store != NULL)
+    return store_put(ctx->store, ctx->challenge, kind);
+
+  return U2FS_OK;
+}
+
+static const char *ctx_origin(const u2fs_ctx_t * ctx)
+{
+  return ctx->rp ? ctx->rp->origin : ctx->origin;
+}
+
+static size_t ctx_origin_len(const u2fs_ctx_t * ctx)
+{
+  return ctx->rp ? ctx->rp->origin_len : ctx->origin_len;
+}
+
+static const char *ctx_appid(const u2fs_ctx_t * ctx)
+{
+  return ctx->rp ? ctx->rp->appid : ctx->appid;
+}
+
+static const unsigned char *ctx_application_parameter(const u2fs_ctx_t *
+                                                      ctx)
+{
+  return ctx->rp ? ctx->rp->application_parameter :
+      ctx->application_parameter;
+}
+
+static u2fs_EC_KEY_t *ctx_key(const u2fs_ctx_t * ctx)
+{
+  return ctx->pubkey ? ctx->pubkey->key : ctx->key;
+}
+
+static void hash_appid(const char *appid, unsigned char *output)
+{
+  sha256_digest((const unsigned char *) appid, strlen(appid), output);
+}
+
+/*
+ * Copy the settings of a shared relying party into @ctx itself, so
+ * they can be modified without affecting the other users of it.
+ */
+static u2fs_rc detach_rp(u2fs_ctx_t * ctx)
+{
+  const u2fs_rp_t *rp = ctx->rp;
+
+  if (rp == NULL)
     return U2FS_OK;
 
-  rc = set_random_bytes(buf, U2FS_CHALLENGE_RAW_LEN);
-  if (rc != U2FS_OK)
-    return rc;
+  ctx->origin = u2fs_strdup(rp->origin);
+  ctx->appid = u2fs_strdup(rp->appid);
+  if (ctx->origin == NULL || ctx->appid == NULL) {
+    u2fs_free(ctx->origin);
+    ctx->origin = NULL;
+    u2fs_free(ctx->appid);
+    ctx->appid = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+  ctx->origin_len = rp->origin_len;
+  memcpy(ctx->application_parameter, rp->application_parameter,
+         U2FS_HASH_LEN);
+  ctx->rp = NULL;
 
-  return encode_b64u(buf, U2FS_CHALLENGE_RAW_LEN, ctx->challenge);
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_rp_init:
+ * @rp: pointer to output variable holding a relying party handle.
+ * @origin: the origin of the relying party
+ * @appid: the appid of the relying party
+ *
+ * Create an immutable relying party description, holding @origin,
+ * @appid and the application parameter derived from @appid.  Once
+ * created it is never modified by the library, so a single handle
+ * can be shared by any number of contexts (see u2fs_set_rp()), also
+ * from different threads.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_rp_init(u2fs_rp_t ** rp, const char *origin, const char *appid)
+{
+  if (rp == NULL || origin == NULL || appid == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  *rp = u2fs_calloc(1, sizeof(**rp));
+  if (*rp == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*rp)->origin = u2fs_strdup(origin);
+  (*rp)->appid = u2fs_strdup(appid);
+  if ((*rp)->origin == NULL || (*rp)->appid == NULL) {
+    u2fs_rp_done(*rp);
+    *rp = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  (*rp)->origin_len = strlen(origin);
+  hash_appid((*rp)->appid, (*rp)->application_parameter);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_rp_done:
+ * @rp: a relying party handle, from u2fs_rp_init()
+ *
+ * Deallocate resources associated with @rp.  No context referring to
+ * @rp may be used afterwards.
+ */
+void u2fs_rp_done(u2fs_rp_t * rp)
+{
+  if (rp == NULL)
+    return;
+
+  u2fs_free(rp->origin);
+  rp->origin = NULL;
+  u2fs_free(rp->appid);
+  rp->appid = NULL;
+  u2fs_free(rp);
+}
+
+/**
+ * u2fs_set_rp:
+ * @ctx: a context handle, from u2fs_init()
+ * @rp: a relying party handle, from u2fs_rp_init()
+ *
+ * Make @ctx use the origin and appid of @rp.  The context only keeps
+ * a reference: @rp must stay alive for as long as @ctx uses it.  Any
+ * origin or appid previously stored within @ctx is released, and a
+ * later call to u2fs_set_origin() or u2fs_set_appid() takes a private
+ * copy of the settings again.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_rp(u2fs_ctx_t * ctx, const u2fs_rp_t * rp)
+{
+  if (ctx == NULL || rp == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  u2fs_free(ctx->origin);
+  ctx->origin = NULL;
+  u2fs_free(ctx->appid);
+  ctx->appid = NULL;
+
+  ctx->rp = rp;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_set_store:
+ * @ctx: a context handle, from u2fs_init()
+ * @store: a challenge store handle, from u2fs_store_init(), or %NULL.
+ * @flags: zero or %U2FS_STORE_ANY.
+ *
+ * Make @ctx remember the challenges it hands out in @store, and only
+ * accept responses to challenges found there.  A verified challenge is
+ * removed from @store.  The context only keeps a reference: @store
+ * must stay alive for as long as @ctx uses it.  Passing %NULL detaches
+ * the store.
+ *
+ * With %U2FS_STORE_ANY a context with no challenge set accepts a
+ * response to any outstanding challenge in @store, so the context
+ * verifying a response need not be the one that issued it.  Stored
+ * challenges are not tied to a user or key handle: this mode enforces
+ * single use, but a challenge handed out to one user satisfies the
+ * verification of another.  Bind the challenge to the session yourself
+ * before relying on it.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_store(u2fs_ctx_t * ctx, u2fs_store_t * store,
+                       u2fs_storeflags flags)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ctx->store = store;
+  ctx->store_flags = flags;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_set_counters:
+ * @ctx: a context handle, from u2fs_init()
+ * @counters: a counter table handle, from u2fs_counters_init(), or %NULL.
+ *
+ * Make authentications verified with @ctx check their signature
+ * counter against @counters, keyed by the key handle set with
+ * u2fs_set_keyHandle().  A response whose counter is not larger than
+ * the last one recorded fails with %U2FS_COUNTER_ERROR; otherwise the
+ * new counter is recorded.  The context only keeps a reference:
+ * @counters must stay alive for as long as @ctx uses it.  Passing
+ * %NULL detaches the table.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_counters(u2fs_ctx_t * ctx, u2fs_counters_t * counters)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ctx->counters = counters;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_set_certcache:
+ * @ctx: a context handle, from u2fs_init()
+ * @cache: a certificate cache handle, from u2fs_certcache_init(), or %NULL.
+ *
+ * Make registrations verified with @ctx look up attestation
+ * certificates in @cache.  The context only keeps a reference: @cache
+ * must stay alive for as long as @ctx uses it.  Passing %NULL detaches
+ * the cache.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_certcache(u2fs_ctx_t * ctx, u2fs_certcache_t * cache)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ctx->certcache = cache;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_set_truststore:
+ * @ctx: a context handle, from u2fs_init()
+ * @trust: a trust store handle, from u2fs_truststore_init(), or %NULL.
+ *
+ * Make registrations verified with @ctx require an attestation
+ * certificate that chains to @trust.  The context only keeps a
+ * reference: @trust must stay alive for as long as @ctx uses it.
+ * Passing %NULL detaches the trust store.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_truststore(u2fs_ctx_t * ctx, u2fs_truststore_t * trust)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ctx->truststore = trust;
+
+  return U2FS_OK;
 }
 
 /**
@@ -87,7 +451,7 @@ static u2fs_rc gen_challenge(u2fs_ctx_t *ctx)
  */
 u2fs_rc u2fs_init(u2fs_ctx_t ** ctx)
 {
-  *ctx = calloc(1, sizeof(**ctx));
+  *ctx = u2fs_calloc(1, sizeof(**ctx));
   if (*ctx == NULL)
     return U2FS_MEMORY_ERROR;
 
@@ -105,15 +469,47 @@ void u2fs_done(u2fs_ctx_t * ctx)
   if (ctx == NULL)
     return;
 
-  free(ctx->keyHandle);
+  cleanse_bytes(ctx->keyHandle_buf, ctx->keyHandle_size);
+  u2fs_free(ctx->keyHandle_buf);
+  ctx->keyHandle_buf = NULL;
   ctx->keyHandle = NULL;
   free_key(ctx->key);
   ctx->key = NULL;
-  free(ctx->origin);
+  u2fs_free(ctx->origin);
   ctx->origin = NULL;
-  free(ctx->appid);
+  u2fs_free(ctx->appid);
   ctx->appid = NULL;
-  free(ctx);
+  u2fs_free(ctx);
+}
+
+/**
+ * u2fs_reset:
+ * @ctx: a context handle, from u2fs_init()
+ *
+ * Clear the per-request state of @ctx: the challenge, the key handle
+ * and the user public key.  The relying party settings, the handles
+ * attached with u2fs_set_store() and the like, and the memory used
+ * for the key handle are kept, so one context can serve any number of
+ * requests.  Keys attached with u2fs_set_pubkey() and verification with
+ * u2fs_authentication_verify_buf() then need no allocation at all.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_reset(u2fs_ctx_t * ctx)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  cleanse_bytes(ctx->challenge, sizeof(ctx->challenge));
+  cleanse_bytes(ctx->challenge_raw, sizeof(ctx->challenge_raw));
+  cleanse_bytes(ctx->keyHandle_buf, ctx->keyHandle_size);
+  ctx->keyHandle = NULL;
+  free_key(ctx->key);
+  ctx->key = NULL;
+  ctx->pubkey = NULL;
+
+  return U2FS_OK;
 }
 
 /**
@@ -125,27 +521,9 @@ void u2fs_done(u2fs_ctx_t * ctx)
 void u2fs_free_reg_res(u2fs_reg_res_t * result)
 {
   if (result != NULL) {
-    if (result->keyHandle) {
-      free(result->keyHandle);
-      result->keyHandle = NULL;
-    }
-    if (result->publicKey) {
-      free(result->publicKey);
-      result->publicKey = NULL;
-    }
-    if (result->attestation_certificate_PEM) {
-      free(result->attestation_certificate_PEM);
-      result->attestation_certificate_PEM = NULL;
-    }
-    if (result->user_public_key) {
-      free_key(result->user_public_key);
-      result->user_public_key = NULL;
-    }
-    if (result->attestation_certificate) {
-      free_cert(result->attestation_certificate);
-      result->attestation_certificate = NULL;
-    }
-    free(result);
+    u2fs_free(result->keyHandle);
+    u2fs_free(result->attestation_certificate_PEM);
+    u2fs_free(result);
   }
 }
 
@@ -162,7 +540,7 @@ void u2fs_free_auth_res(u2fs_auth_res_t * result)
     result->counter = 0;
     result->user_presence = 0;
   }
-  free(result);
+  u2fs_free(result);
 }
 
 /**
@@ -174,7 +552,8 @@ void u2fs_free_auth_res(u2fs_auth_res_t * result)
  * present, it is cleared and the memory is released.
  *
  * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
- * an #u2fs_rc error code.
+ * an #u2fs_rc error code, %U2FS_CHALLENGE_ERROR if @challenge does not
+ * decode to %U2FS_CHALLENGE_RAW_LEN bytes.
  */
 u2fs_rc u2fs_set_challenge(u2fs_ctx_t * ctx, const char *challenge)
 {
@@ -184,9 +563,7 @@ u2fs_rc u2fs_set_challenge(u2fs_ctx_t * ctx, const char *challenge)
   if (strlen(challenge) != U2FS_CHALLENGE_B64U_LEN)
     return U2FS_CHALLENGE_ERROR;
 
-  strncpy(ctx->challenge, challenge, U2FS_CHALLENGE_B64U_LEN);
-
-  return U2FS_OK;
+  return store_challenge(ctx, challenge);
 }
 
 /**
@@ -194,25 +571,34 @@ u2fs_rc u2fs_set_challenge(u2fs_ctx_t * ctx, const char *challenge)
  * @ctx: a context handle, from u2fs_init()
  * @keyHandle: a registered key-handle in websafe Base64 form, to use for signing, as returned by the U2F registration.
  *
- * Stores a given @keyHandle within @ctx. If a value is already present, it is cleared and the memory is released.
+ * Stores a given @keyHandle within @ctx. If a value is already present, it is replaced, reusing its memory when large enough.
  *
  * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
  * an #u2fs_rc error code.
  */
 u2fs_rc u2fs_set_keyHandle(u2fs_ctx_t * ctx, const char *keyHandle)
 {
+  size_t len;
+  char *buf;
+
   if (ctx == NULL || keyHandle == NULL)
     return U2FS_MEMORY_ERROR;
 
-  if (ctx->keyHandle != NULL) {
-    free(ctx->keyHandle);
-    ctx->keyHandle = NULL;
+  ctx->keyHandle = NULL;
+  cleanse_bytes(ctx->keyHandle_buf, ctx->keyHandle_size);
+
+  len = strlen(keyHandle) + 1;
+  if (len > ctx->keyHandle_size) {
+    buf = u2fs_malloc(len);
+    if (buf == NULL)
+      return U2FS_MEMORY_ERROR;
+    u2fs_free(ctx->keyHandle_buf);
+    ctx->keyHandle_buf = buf;
+    ctx->keyHandle_size = len;
   }
 
-  ctx->keyHandle = strndup(keyHandle, strlen(keyHandle));
-
-  if (ctx->keyHandle == NULL)
-    return U2FS_MEMORY_ERROR;
+  memcpy(ctx->keyHandle_buf, keyHandle, len);
+  ctx->keyHandle = ctx->keyHandle_buf;
 
   return U2FS_OK;
 }
@@ -232,12 +618,15 @@ u2fs_rc
 u2fs_set_publicKey(u2fs_ctx_t * ctx, const unsigned char *publicKey)
 {
   u2fs_EC_KEY_t *user_key;
+  uint64_t t;
   u2fs_rc rc;
 
   if (ctx == NULL || publicKey == NULL)
     return U2FS_MEMORY_ERROR;
 
+  t = stats_begin(ctx->stats);
   rc = decode_user_key(publicKey, &user_key);
+  stats_end(ctx->stats, U2FS_STAGE_DECODE, t);
   if (rc != U2FS_OK)
     return rc;
 
@@ -245,26 +634,211 @@ u2fs_set_publicKey(u2fs_ctx_t * ctx, const unsigned char *publicKey)
     free_key(ctx->key);
 
   ctx->key = user_key;
+  ctx->pubkey = NULL;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_compress_publicKey:
+ * @publicKey: a 65-byte raw EC public key as returned from registration.
+ * @output: buffer of %U2FS_COMPRESSED_KEY_LEN bytes to hold the result.
+ *
+ * Write the compressed form of @publicKey, which holds the same key
+ * in about half the space, to @output.  Only the encoding is changed;
+ * the point itself is validated when the key is used.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc
+u2fs_compress_publicKey(const unsigned char *publicKey,
+                        unsigned char *output)
+{
+  if (publicKey == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (publicKey[0] != 0x04)
+    return U2FS_FORMAT_ERROR;
+
+  output[0] = 0x02 | (publicKey[U2FS_PUBLIC_KEY_LEN - 1] & 0x01);
+  memcpy(output + 1, publicKey + 1, U2FS_COMPRESSED_KEY_LEN - 1);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_decompress_publicKey:
+ * @compressed: a key as written by u2fs_compress_publicKey().
+ * @output: buffer of %U2FS_PUBLIC_KEY_LEN bytes to hold the result.
+ *
+ * Recover the 65-byte public key accepted by u2fs_set_publicKey() and
+ * u2fs_pubkey_init() from its compressed form.  Keys that do not
+ * describe a point on the curve are rejected.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc
+u2fs_decompress_publicKey(const unsigned char *compressed,
+                          unsigned char *output)
+{
+  if (compressed == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (compressed[0] != 0x02 && compressed[0] != 0x03)
+    return U2FS_FORMAT_ERROR;
+
+  return decompress_user_key(compressed, output);
+}
+
+/**
+ * u2fs_pubkey_init:
+ * @key: pointer to output variable holding a public key handle.
+ * @publicKey: a 65-byte raw EC public key as returned from registration.
+ *
+ * Decode @publicKey once into a handle that can be kept around, for
+ * example in a credential cache, and attached to any number of
+ * contexts with u2fs_set_pubkey().  The handle is not modified by the
+ * library after creation and may be shared between threads.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_pubkey_init(u2fs_pubkey_t ** key,
+                         const unsigned char *publicKey)
+{
+  u2fs_rc rc;
+
+  if (key == NULL || publicKey == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  *key = u2fs_calloc(1, sizeof(**key));
+  if (*key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = decode_user_key(publicKey, &(*key)->key);
+  if (rc != U2FS_OK) {
+    u2fs_free(*key);
+    *key = NULL;
+    return rc;
+  }
+
+  memcpy((*key)->publicKey, publicKey, U2FS_PUBLIC_KEY_LEN);
 
   return U2FS_OK;
 }
 
+/**
+ * u2fs_pubkey_done:
+ * @key: a public key handle, from u2fs_pubkey_init()
+ *
+ * Deallocate resources associated with @key.  No context referring to
+ * @key may be used afterwards.
+ */
+void u2fs_pubkey_done(u2fs_pubkey_t * key)
+{
+  if (key == NULL)
+    return;
+
+  free_key(key->key);
+  key->key = NULL;
+  u2fs_free(key);
+}
+
+/**
+ * u2fs_set_pubkey:
+ * @ctx: a context handle, from u2fs_init()
+ * @key: a public key handle, from u2fs_pubkey_init()
+ *
+ * Make @ctx verify authentications against @key, without decoding it
+ * again.  The context only keeps a reference: @key must stay alive
+ * for as long as @ctx uses it.  A key previously stored within @ctx by
+ * u2fs_set_publicKey() is released.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_pubkey(u2fs_ctx_t * ctx, const u2fs_pubkey_t * key)
+{
+  if (ctx == NULL || key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (ctx->key != NULL) {
+    free_key(ctx->key);
+    ctx->key = NULL;
+  }
+
+  ctx->pubkey = key;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_set_credential:
+ * @ctx: a context handle, from u2fs_init()
+ * @db: a credential database handle, from u2fs_creddb_init()
+ * @keyHandle: a registered key-handle in websafe Base64 form.
+ *
+ * Look @keyHandle up in @db and store it within @ctx along with the
+ * user public key registered for it, as u2fs_set_keyHandle() and
+ * u2fs_set_publicKey() would.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code; %U2FS_FORMAT_ERROR if @db holds no such
+ * key-handle.
+ */
+u2fs_rc u2fs_set_credential(u2fs_ctx_t * ctx, const u2fs_creddb_t * db,
+                            const char *keyHandle)
+{
+  const unsigned char *record;
+  const unsigned char *publicKey;
+  u2fs_rc rc;
+
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = u2fs_creddb_lookup(db, keyHandle, &record);
+  if (rc != U2FS_OK)
+    return rc;
+
+  rc = u2fs_credential_decode(record, NULL, NULL, &publicKey, NULL, NULL);
+  if (rc != U2FS_OK)
+    return rc;
+
+  rc = u2fs_set_publicKey(ctx, publicKey);
+  if (rc != U2FS_OK)
+    return rc;
+
+  return u2fs_set_keyHandle(ctx, keyHandle);
+}
+
 /**
  * u2fs_get_registration_keyHandle:
  * @result: a registration result obtained from u2fs_registration_verify()
  *
  * Get the Base64 keyHandle obtained during the U2F registration
  * operation.  The memory is allocated by the library, and must not be
- * deallocated by the caller.
+ * deallocated by the caller.  The encoding is computed on the first
+ * call, so a @result must not be queried from several threads at once.
  *
  * Returns: On success the pointer to the buffer containing the keyHandle
  * is returned, and on errors NULL.
  */
 const char *u2fs_get_registration_keyHandle(u2fs_reg_res_t * result)
 {
+  char buf[_B64_BUFSIZE];
+
   if (result == NULL)
     return NULL;
 
+  if (result->keyHandle == NULL) {
+    if (encode_b64u((const char *) result->keyHandle_raw,
+                    result->keyHandle_len, buf) != U2FS_OK)
+      return NULL;
+    result->keyHandle = u2fs_strdup(buf);
+  }
+
   return result->keyHandle;
 }
 
@@ -285,7 +859,7 @@ const char *u2fs_get_registration_publicKey(u2fs_reg_res_t * result)
   if (result == NULL)
     return NULL;
 
-  return result->publicKey;
+  return (const char *) result->publicKey;
 }
 
 /**
@@ -294,7 +868,9 @@ const char *u2fs_get_registration_publicKey(u2fs_reg_res_t * result)
  *
  * Extract the X509 attestation certificate (PEM format) obtained during the U2F
  * registration operation.  The memory is allocated by the library,
- * and must not be deallocated by the caller.
+ * and must not be deallocated by the caller.  The encoding is computed
+ * on the first call, so a @result must not be queried from several
+ * threads at once.
  *
  * Returns: On success the pointer to the buffer containing the attestation
  * certificate is returned, and on errors NULL.
@@ -304,7 +880,13 @@ const char *u2fs_get_registration_attestation(u2fs_reg_res_t * result)
   if (result == NULL)
     return NULL;
 
-  return (void*)result->attestation_certificate_PEM;
+  if (result->attestation_certificate_PEM == NULL
+      && dump_X509_der(result->attestation_certificate,
+                       result->attestation_certificate_len,
+                       &result->attestation_certificate_PEM) != U2FS_OK)
+    return NULL;
+
+  return result->attestation_certificate_PEM;
 }
 
 /**
@@ -356,17 +938,24 @@ u2fs_rc u2fs_get_authentication_result(u2fs_auth_res_t * result,
  */
 u2fs_rc u2fs_set_origin(u2fs_ctx_t * ctx, const char *origin)
 {
+  u2fs_rc rc;
+
   if (ctx == NULL || origin == NULL)
     return U2FS_MEMORY_ERROR;
 
+  rc = detach_rp(ctx);
+  if (rc != U2FS_OK)
+    return rc;
+
   if (ctx->origin != NULL) {
-    free(ctx->origin);
+    u2fs_free(ctx->origin);
     ctx->origin = NULL;
   }
 
-  ctx->origin = strdup(origin);
+  ctx->origin = u2fs_strdup(origin);
   if (ctx->origin == NULL)
     return U2FS_MEMORY_ERROR;
+  ctx->origin_len = strlen(origin);
 
   return U2FS_OK;
 }
@@ -377,70 +966,208 @@ u2fs_rc u2fs_set_origin(u2fs_ctx_t * ctx, const char *origin)
  * @appid: the appid of a registration request
  *
  * Stores @appid within @ctx. If a value is already present, it is cleared and the memory is released.
+ * The application parameter (SHA-256 of @appid) is computed here once
+ * and reused by every registration and authentication on @ctx.
  *
  * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
  * a #u2fs_rc error code.
  */
 u2fs_rc u2fs_set_appid(u2fs_ctx_t * ctx, const char *appid)
 {
+  u2fs_rc rc;
+
   if (ctx == NULL || appid == NULL)
     return U2FS_MEMORY_ERROR;
 
+  rc = detach_rp(ctx);
+  if (rc != U2FS_OK)
+    return rc;
+
   if (ctx->appid != NULL) {
-    free(ctx->appid);
+    u2fs_free(ctx->appid);
     ctx->appid = NULL;
   }
 
-  ctx->appid = strdup(appid);
+  ctx->appid = u2fs_strdup(appid);
   if (ctx->appid == NULL)
     return U2FS_MEMORY_ERROR;
 
+  hash_appid(ctx->appid, ctx->application_parameter);
+
   return U2FS_OK;
 }
 
-static int registration_challenge_json(const char *challenge,
-                                       const char *appid, char **output)
+/*
+ * Challenge messages are written straight from a template, producing
+ * the same output as json-c's default serialization.  Only the appId
+ * and keyHandle can need escaping; the challenge is base64url.
+ */
+#define REG_TEMPLATE_0 "{ \"challenge\": \""
+#define REG_TEMPLATE_1 "\", \"version\": \"" U2F_VERSION "\", \"appId\": \""
+#define AUTH_TEMPLATE_0 "{ \"keyHandle\": \""
+#define AUTH_TEMPLATE_1 "\", \"version\": \"" U2F_VERSION "\", \"challenge\": \""
+#define AUTH_TEMPLATE_2 "\", \"appId\": \""
+#define TEMPLATE_END "\" }"
+
+static size_t json_escaped_len(const char *str)
+{
+  const unsigned char *p;
+  size_t len = 0;
+
+  for (p = (const unsigned char *) str; *p; p++) {
+    if (*p < 0x20 && strchr("\b\f\n\r\t", *p) == NULL)
+      len += 6;
+    else if (*p < 0x20 || *p == '"' || *p == '\\' || *p == '/')
+      len += 2;
+    else
+      len++;
+  }
+
+  return len;
+}
+
+static char *json_escape(char *out, const char *str)
 {
-  u2fs_rc rc = U2FS_JSON_ERROR;
-  struct json_object *json_challenge = NULL;
-  struct json_object *json_version = NULL;
-  struct json_object *json_appid = NULL;
-  struct json_object *json_output = NULL;
-  const char *json_string = NULL;
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) str; *p; p++) {
+    switch (*p) {
+    case '\b':
+      *out++ = '\\';
+      *out++ = 'b';
+      break;
+    case '\f':
+      *out++ = '\\';
+      *out++ = 'f';
+      break;
+    case '\n':
+      *out++ = '\\';
+      *out++ = 'n';
+      break;
+    case '\r':
+      *out++ = '\\';
+      *out++ = 'r';
+      break;
+    case '\t':
+      *out++ = '\\';
+      *out++ = 't';
+      break;
+    case '"':
+    case '\\':
+    case '/':
+      *out++ = '\\';
+      *out++ = *p;
+      break;
+    default:
+      if (*p < 0x20) {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[*p >> 4];
+        out[5] = hex[*p & 0xf];
+        out += 6;
+      } else
+        *out++ = *p;
+      break;
+    }
+  }
 
-  rc = U2FS_JSON_ERROR;
+  return out;
+}
 
-  json_challenge = json_object_new_string(challenge);
-  if (json_challenge == NULL)
-    goto done;
-  json_version = json_object_new_string(U2F_VERSION);
-  if (json_version == NULL)
-    goto done;
-  json_appid = json_object_new_string(appid);
-  if (json_appid == NULL)
-    goto done;
+#define PUT(p, lit) (memcpy(p, lit, sizeof(lit) - 1), (p) + sizeof(lit) - 1)
 
-  json_output = json_object_new_object();
-  if (json_output == NULL)
-    goto done;
+static u2fs_rc registration_challenge_json(const char *challenge,
+                                           const char *appid, char *buf,
+                                           size_t * buflen)
+{
+  size_t needed;
+  char *p;
+
+  if (appid == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  needed = sizeof(REG_TEMPLATE_0 REG_TEMPLATE_1 TEMPLATE_END)
+      + strlen(challenge) + json_escaped_len(appid);
+  if (buf == NULL || *buflen < needed) {
+    *buflen = needed;
+    return U2FS_MEMORY_ERROR;
+  }
 
-  json_object_object_add(json_output, "challenge", json_object_get(json_challenge));
-  json_object_object_add(json_output, "version", json_object_get(json_version));
-  json_object_object_add(json_output, "appId", json_object_get(json_appid));
+  p = PUT(buf, REG_TEMPLATE_0);
+  p = (char *) memcpy(p, challenge, strlen(challenge)) + strlen(challenge);
+  p = PUT(p, REG_TEMPLATE_1);
+  p = json_escape(p, appid);
+  p = PUT(p, TEMPLATE_END);
+  *p = '\0';
 
-  json_string = json_object_to_json_string(json_output);
-  if (json_string == NULL)
-    rc = U2FS_JSON_ERROR;
-  else if ((*output = strdup(json_string)) == NULL)
-    rc = U2FS_MEMORY_ERROR;
+  *buflen = p - buf;
+
+  return U2FS_OK;
+}
+
+static u2fs_rc authentication_challenge_json(const char *challenge,
+                                             const char *keyHandle,
+                                             const char *appid, char *buf,
+                                             size_t * buflen)
+{
+  size_t needed;
+  char *p;
+
+  if (appid == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  needed = sizeof(AUTH_TEMPLATE_0 AUTH_TEMPLATE_1 AUTH_TEMPLATE_2
+                  TEMPLATE_END) + json_escaped_len(keyHandle) + strlen(challenge)
+      + json_escaped_len(appid);
+  if (buf == NULL || *buflen < needed) {
+    *buflen = needed;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  p = PUT(buf, AUTH_TEMPLATE_0);
+  p = json_escape(p, keyHandle);
+  p = PUT(p, AUTH_TEMPLATE_1);
+  p = (char *) memcpy(p, challenge, strlen(challenge)) + strlen(challenge);
+  p = PUT(p, AUTH_TEMPLATE_2);
+  p = json_escape(p, appid);
+  p = PUT(p, TEMPLATE_END);
+  *p = '\0';
+
+  *buflen = p - buf;
+
+  return U2FS_OK;
+}
+
+/* Size the message, then allocate and write it. */
+static u2fs_rc challenge_json_alloc(u2fs_ctx_t * ctx, int authentication,
+                                    char **output)
+{
+  size_t len = 0;
+  u2fs_rc rc;
+
+  if (authentication)
+    rc = authentication_challenge_json(ctx->challenge, ctx->keyHandle,
+                                       ctx_appid(ctx), NULL, &len);
   else
-    rc = U2FS_OK;
+    rc = registration_challenge_json(ctx->challenge, ctx_appid(ctx),
+                                     NULL, &len);
+  if (len == 0)
+    return rc;
 
-done:
-    json_object_put(json_output);
-    json_object_put(json_challenge);
-    json_object_put(json_version);
-    json_object_put(json_appid);
+  *output = u2fs_malloc(len);
+  if (*output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (authentication)
+    rc = authentication_challenge_json(ctx->challenge, ctx->keyHandle,
+                                       ctx_appid(ctx), *output, &len);
+  else
+    rc = registration_challenge_json(ctx->challenge, ctx_appid(ctx),
+                                     *output, &len);
+  if (rc != U2FS_OK) {
+    u2fs_free(*output);
+    *output = NULL;
+  }
 
   return rc;
 }
@@ -458,88 +1185,215 @@ done:
  */
 u2fs_rc u2fs_registration_challenge(u2fs_ctx_t * ctx, char **output)
 {
-  u2fs_rc rc = gen_challenge(ctx);
+  u2fs_rc rc = gen_challenge(ctx, STORE_REGISTRATION);
+  if (rc != U2FS_OK)
+    return rc;
+
+  return challenge_json_alloc(ctx, 0, output);
+}
+
+/**
+ * u2fs_registration_challenge_buf:
+ * @ctx: a context handle, from u2fs_init()
+ * @buf: output buffer for the JSON data of RegistrationData.
+ * @buflen: on input the size of @buf, on output the length of the
+ *   string written, excluding the terminating NUL.
+ *
+ * Like u2fs_registration_challenge(), but write the message to @buf
+ * instead of allocating it.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.  If @buf is too small %U2FS_MEMORY_ERROR is
+ * returned and @buflen is set to the size needed.
+ */
+u2fs_rc u2fs_registration_challenge_buf(u2fs_ctx_t * ctx, char *buf,
+                                        size_t * buflen)
+{
+  u2fs_rc rc;
+
+  if (ctx == NULL || buflen == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = gen_challenge(ctx, STORE_REGISTRATION);
   if (rc != U2FS_OK)
     return rc;
 
-  return registration_challenge_json(ctx->challenge, ctx->appid, output);
+  return registration_challenge_json(ctx->challenge, ctx_appid(ctx), buf,
+                                     buflen);
 }
 
+/*
+ * Extract the string members @keys of the JSON object @json.  The
+ * U2F scanner is tried first and yields spans into @json itself; only
+ * values with escapes are copied to @scratch.  Messages it does not
+ * handle are parsed by json-c, whose strings are copied to @scratch.
+ */
 static u2fs_rc
-parse_clientData(const char *clientData, char **challenge, char **origin)
+parse_json2(const char *json, size_t len, const char *const *keys,
+            struct u2fs_span *values, size_t count,
+            struct u2fs_scratch *scratch)
 {
-  struct json_object *jo = json_tokener_parse(clientData);
+  struct json_object *jo;
   struct json_object *k;
   const char *p;
+  char *copy;
+  size_t i;
+
+  if (scan_object(json, len, keys, values, count) == SCAN_OK) {
+    for (i = 0; i < count; i++) {
+      if (values[i].ptr == NULL)
+        return U2FS_JSON_ERROR;
+
+      if (values[i].escaped) {
+        copy = scratch_alloc(scratch, values[i].len);
+        if (copy == NULL)
+          return U2FS_MEMORY_ERROR;
+        values[i].len = scan_unescape(&values[i], copy);
+        values[i].ptr = copy;
+        values[i].escaped = 0;
+      }
+    }
 
-  if (clientData == NULL || challenge == NULL || origin == NULL)
-    return U2FS_MEMORY_ERROR;
+    return U2FS_OK;
+  }
 
+  jo = json_tokener_parse(json);
   if (jo == NULL)
     return U2FS_JSON_ERROR;
 
-  if (u2fs_json_object_object_get(jo, "challenge", k) == FALSE)
-    return U2FS_JSON_ERROR;
+  for (i = 0; i < count; i++) {
+    if (u2fs_json_object_object_get(jo, keys[i], k) == FALSE
+        || (p = json_object_get_string(k)) == NULL) {
+      json_object_put(jo);
+      return U2FS_JSON_ERROR;
+    }
 
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
+    values[i].ptr = copy = scratch_strdup(scratch, p);
+    if (copy == NULL) {
+      json_object_put(jo);
+      return U2FS_MEMORY_ERROR;
+    }
+    values[i].len = strlen(copy);
+    values[i].escaped = 0;
+  }
 
-  *challenge = strdup(p);
-  if (*challenge == NULL)
-    return U2FS_MEMORY_ERROR;
+  json_object_put(jo);
 
-  if (u2fs_json_object_object_get(jo, "origin", k) == FALSE)
-    return U2FS_JSON_ERROR;
+  return U2FS_OK;
+}
 
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
+static u2fs_rc
+parse_json(const char *json, size_t len, const char *const *keys,
+           struct u2fs_span *values, size_t count,
+           struct u2fs_scratch *scratch, u2fs_stats_t * stats)
+{
+  uint64_t t = stats_begin(stats);
+  u2fs_rc rc;
 
-  *origin = strdup(p);
-  if (*origin == NULL)
-    return U2FS_JSON_ERROR;
+  rc = parse_json2(json, len, keys, values, count, scratch);
+  stats_end(stats, U2FS_STAGE_JSON, t);
 
-  json_object_put(jo);
+  return rc;
+}
+
+/* The origin is public, only its length is kept to skip a strlen(). */
+static int origin_eq(const u2fs_ctx_t * ctx, const struct u2fs_span *origin)
+{
+  const char *str = ctx_origin(ctx);
+
+  return str != NULL && ctx_origin_len(ctx) == origin->len
+      && memcmp(str, origin->ptr, origin->len) == 0;
+}
+
+/*
+ * Check the challenge of a response against the one set in @ctx.  With
+ * a store attached with U2FS_STORE_ANY and no challenge set, any
+ * well-formed challenge passes here and is looked up by
+ * consume_challenge().
+ */
+static u2fs_rc check_challenge(const u2fs_ctx_t * ctx,
+                               const struct u2fs_span *challenge)
+{
+  unsigned char raw[U2FS_CHALLENGE_RAW_LEN + 2];
+  size_t len = sizeof(raw);
+
+  if (ctx->challenge[0] == '\0') {
+    if (ctx->store == NULL || !(ctx->store_flags & U2FS_STORE_ANY)
+        || challenge->len != U2FS_CHALLENGE_B64U_LEN)
+      return U2FS_CHALLENGE_ERROR;
+    return U2FS_OK;
+  }
+
+  /*
+   * Compared as bytes in constant time, so the response cannot be
+   * used to learn the challenge a byte at a time.
+   */
+  if (base64url_decode(challenge->ptr, challenge->len, raw, &len)
+      != U2FS_OK || len != U2FS_CHALLENGE_RAW_LEN
+      || !equal_bytes(raw, ctx->challenge_raw, U2FS_CHALLENGE_RAW_LEN))
+    return U2FS_CHALLENGE_ERROR;
 
   return U2FS_OK;
+}
+
+/*
+ * Take the challenge of a verified response out of the challenge
+ * store, so it cannot be used again.
+ */
+static u2fs_rc consume_challenge(const u2fs_ctx_t * ctx,
+                                 const struct u2fs_span *challenge,
+                                 enum store_kind kind)
+{
+  if (ctx->store == NULL)
+    return U2FS_OK;
+
+  return store_consume(ctx->store, challenge->ptr, challenge->len, kind);
+}
+
+static u2fs_rc
+parse_clientData(const char *clientData, size_t len,
+                 struct u2fs_scratch *scratch,
+                 struct u2fs_span *challenge, struct u2fs_span *origin,
+                 u2fs_stats_t * stats)
+{
+  static const char *const keys[] = { "challenge", "origin" };
+  struct u2fs_span values[2];
+  u2fs_rc rc;
+
+  if (clientData == NULL || challenge == NULL || origin == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = parse_json(clientData, len, keys, values, 2, scratch, stats);
+  if (rc != U2FS_OK)
+    return rc;
+
+  *challenge = values[0];
+  *origin = values[1];
 
+  return U2FS_OK;
 }
 
 /**
  * JSON decode
  */
 static u2fs_rc
-parse_registration_response(const char *response, char **registrationData,
-                            char **clientData)
+parse_registration_response(const char *response,
+                            struct u2fs_scratch *scratch,
+                            struct u2fs_span *registrationData,
+                            struct u2fs_span *clientData,
+                            u2fs_stats_t * stats)
 {
-  struct json_object *jo;
-  struct json_object *k;
-  const char *p;
-
-  jo = json_tokener_parse(response);
-  if (jo == NULL)
-    return U2FS_JSON_ERROR;
-
-  if (u2fs_json_object_object_get(jo, "registrationData", k) == FALSE)
-    return U2FS_JSON_ERROR;
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
-  *registrationData = strdup(p);
-  if (*registrationData == NULL)
-    return U2FS_MEMORY_ERROR;
+  static const char *const keys[] = { "registrationData", "clientData" };
+  struct u2fs_span values[2];
+  u2fs_rc rc;
 
-  if (u2fs_json_object_object_get(jo, "clientData", k) == FALSE)
-    return U2FS_JSON_ERROR;
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
-  *clientData = strdup(p);
-  if (*clientData == NULL)
-    return U2FS_MEMORY_ERROR;
+  rc = parse_json(response, strlen(response), keys, values, 2, scratch,
+                  stats);
+  if (rc != U2FS_OK)
+    return rc;
 
-  json_object_put(jo);
+  *registrationData = values[0];
+  *clientData = values[1];
 
   return U2FS_OK;
 }
@@ -555,15 +1409,126 @@ static void dumpHex(const unsigned char *data, int offs, int len)
   fprintf(stderr, "\n");
 }
 
+/*
+ * The fields of a registrationData message.  Each one points into the
+ * decoded buffer, so nothing is copied until a result is returned.
+ */
+struct u2fs_reg_data {
+  const unsigned char *public_key;
+  const unsigned char *key_handle;
+  size_t key_handle_len;
+  const unsigned char *certificate;
+  size_t certificate_len;
+  const unsigned char *signature;
+  size_t signature_len;
+};
+
+/*
+ * Length of the DER element at DATA, including its header, or 0 if the
+ * header is malformed or runs past LEN.  Only the definite forms an
+ * attestation certificate can use are accepted.
+ */
+static size_t der_element_len(const unsigned char *data, size_t len)
+{
+  size_t header, body;
+
+  if (len < 2 || data[0] != 0x30)
+    return 0;
+
+  if (data[1] < 0x80) {
+    header = 2;
+    body = data[1];
+  } else if (data[1] == 0x81 && len >= 3) {
+    header = 3;
+    body = data[2];
+  } else if (data[1] == 0x82 && len >= 4) {
+    header = 4;
+    body = ((size_t) data[2] << 8) | data[3];
+  } else
+    return 0;
+
+  if (body > len - header)
+    return 0;
+
+  return header + body;
+}
+
+/*
+ * Copy the DER INTEGER at *P, which must end by END, right-aligned
+ * into the U2FS_ECDSA_RAW_LEN / 2 bytes at OUT and advance *P past it.
+ * Only minimal encodings of non-negative values are accepted.
+ */
+static int
+der_integer(const unsigned char **p, const unsigned char *end,
+            unsigned char *out)
+{
+  const size_t width = U2FS_ECDSA_RAW_LEN / 2;
+  const unsigned char *q = *p;
+  size_t len;
+
+  if (end - q < 2 || q[0] != 0x02)
+    return 0;
+
+  len = q[1];
+  q += 2;
+  if (len == 0 || len > (size_t) (end - q) || (q[0] & 0x80))
+    return 0;
+
+  if (q[0] == 0x00 && len > 1) {
+    if ((q[1] & 0x80) == 0)
+      return 0;
+    q++;
+    len--;
+  }
+
+  if (len > width)
+    return 0;
+
+  memset(out, 0, width - len);
+  memcpy(out + width - len, q, len);
+  *p = q + len;
+
+  return 1;
+}
+
+/*
+ * Decode an ECDSA signature, a DER SEQUENCE of r and s, into the
+ * fixed-width form taken by verify_ECDSA_raw().  Parsing it here needs
+ * no allocation; bytes following the SEQUENCE are ignored.
+ */
+static u2fs_rc
+decode_signature(const unsigned char *der, size_t len, unsigned char *sig)
+{
+  const unsigned char *p, *end;
+
+  if (len < 2 || der[0] != 0x30 || der[1] > len - 2) {
+    if (debug)
+      fprintf(stderr, "Signature is not a SEQUENCE\n");
+    return U2FS_FORMAT_ERROR;
+  }
+
+  p = der + 2;
+  end = p + der[1];
+
+  if (!der_integer(&p, end, sig)
+      || !der_integer(&p, end, sig + U2FS_ECDSA_RAW_LEN / 2) || p != end) {
+    if (debug)
+      fprintf(stderr, "Unable to decode signature\n");
+    return U2FS_FORMAT_ERROR;
+  }
+
+  return U2FS_OK;
+}
+
 /**
- * Parse and validate the registration response.
+ * Split registrationData into its fields in one pass.  Every length is
+ * checked against the buffer before it is used; decoding the signature
+ * and the keys is left until the cheap checks on the response have
+ * passed.
  */
 static u2fs_rc
 parse_registrationData2(const unsigned char *data, size_t len,
-                        unsigned char **user_public_key,
-                        size_t * keyHandle_len, char **keyHandle,
-                        u2fs_X509_t ** attestation_certificate,
-                        u2fs_ECDSA_t ** signature)
+                        struct u2fs_reg_data *reg)
 {
   /*
      +-------------------------------------------------------------------+
@@ -577,11 +1542,9 @@ parse_registrationData2(const unsigned char *data, size_t len,
      signature
    */
 
-  int offset = 0;
-  size_t attestation_certificate_len;
-  u2fs_rc rc;
+  size_t offset = 0;
 
-  if (len <= 1 + 65 + 1 + 64) {
+  if (len <= 1 + U2FS_PUBLIC_KEY_LEN + 1 + ECDSA_SIG_MIN_LEN) {
     if (debug)
       fprintf(stderr, "Length mismatch\n");
     return U2FS_FORMAT_ERROR;
@@ -593,154 +1556,180 @@ parse_registrationData2(const unsigned char *data, size_t len,
     return U2FS_FORMAT_ERROR;
   }
 
-  *user_public_key = calloc(sizeof(unsigned char), U2FS_PUBLIC_KEY_LEN);
-
-  if (*user_public_key == NULL) {
-    if (debug)
-      fprintf(stderr, "Memory error\n");
-    return U2FS_MEMORY_ERROR;
-  }
-
-  memcpy(*user_public_key, data + offset, U2FS_PUBLIC_KEY_LEN);
-
+  reg->public_key = data + offset;
   offset += U2FS_PUBLIC_KEY_LEN;
 
-  *keyHandle_len = data[offset++];
-
-  *keyHandle = calloc(sizeof(char), *keyHandle_len);
-  if (*keyHandle == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  memcpy(*keyHandle, data + offset, *keyHandle_len);
-
-  if (*keyHandle == NULL) {
+  reg->key_handle_len = data[offset++];
+  if (reg->key_handle_len > len - offset) {
     if (debug)
-      fprintf(stderr, "Memory error\n");
-
-    free(*user_public_key);
-
-    keyHandle_len = 0;
-    *user_public_key = NULL;
-
-    return U2FS_MEMORY_ERROR;
+      fprintf(stderr, "Key handle length mismatch\n");
+    return U2FS_FORMAT_ERROR;
   }
 
   if (debug)
-    fprintf(stderr, "Key handle length: %d\n", (int) *keyHandle_len);
+    fprintf(stderr, "Key handle length: %d\n", (int) reg->key_handle_len);
 
-  offset += *keyHandle_len;
+  reg->key_handle = data + offset;
+  offset += reg->key_handle_len;
 
-  // Skip over offset and offset+1 (0x30, 0x82 respecitvely)
-  // Length is big-endian encoded in offset+3 and offset+4
-  attestation_certificate_len =
-      (data[offset + 2] << 8) + data[offset + 3] + 4;
-
-  rc = decode_X509(data + offset, attestation_certificate_len,
-                   attestation_certificate);
-
-  if (rc != U2FS_OK) {
-    return rc;
+  reg->certificate_len = der_element_len(data + offset, len - offset);
+  if (reg->certificate_len == 0) {
+    if (debug)
+      fprintf(stderr, "Certificate length mismatch\n");
+    return U2FS_FORMAT_ERROR;
   }
 
-  if (debug)
-    dumpCert(*attestation_certificate);
-
-  offset += attestation_certificate_len;
-
-  size_t signature_len = len - offset;
-  rc = decode_ECDSA(data + offset, signature_len, signature);
-
-  if (rc != U2FS_OK) {
-    free(*user_public_key);
-    free(*keyHandle);
-
-    *user_public_key = NULL;
-    *keyHandle_len = 0;
-    *keyHandle = NULL;
+  reg->certificate = data + offset;
+  offset += reg->certificate_len;
 
+  reg->signature_len = len - offset;
+  if (reg->signature_len < ECDSA_SIG_MIN_LEN
+      || reg->signature_len > ECDSA_SIG_MAX_LEN) {
     if (debug)
-      fprintf(stderr, "Unable to decode signature\n");
+      fprintf(stderr, "Signature length mismatch\n");
+    return U2FS_FORMAT_ERROR;
+  }
 
-    return rc;
+  /* A DER SEQUENCE of the two integers. */
+  if (data[offset] != 0x30) {
+    if (debug)
+      fprintf(stderr, "Signature is not a SEQUENCE\n");
+    return U2FS_FORMAT_ERROR;
   }
 
+  reg->signature = data + offset;
+
   return U2FS_OK;
 }
 
-static u2fs_rc parse_registrationData(const char *registrationData,
-                                      unsigned char **user_public_key,
-                                      size_t * keyHandle_len,
-                                      char **keyHandle,
-                                      u2fs_X509_t **
-                                      attestation_certificate,
-                                      u2fs_ECDSA_t ** signature)
+static u2fs_rc parse_registrationData(const struct u2fs_span
+                                      *registrationData,
+                                      struct u2fs_scratch *scratch,
+                                      struct u2fs_reg_data *reg,
+                                      u2fs_stats_t * stats)
 {
-  base64_decodestate b64;
-  size_t registrationData_len = strlen(registrationData);
+  size_t data_len = registrationData->len + 1;
   unsigned char *data;
-  int data_len;
+  uint64_t t;
   u2fs_rc rc;
 
-  data = malloc(registrationData_len + 1);
+  data = scratch_alloc(scratch, data_len);
   if (data == NULL)
     return U2FS_MEMORY_ERROR;
 
-  data[registrationData_len] = '\0';
-
-  base64_init_decodestate(&b64);
-  data_len =
-      base64_decode_block(registrationData, registrationData_len,
-                          (char *) data, &b64);
+  t = stats_begin(stats);
+  rc = base64url_decode(registrationData->ptr, registrationData->len, data,
+                        &data_len);
+  stats_end(stats, U2FS_STAGE_BASE64, t);
+  if (rc != U2FS_OK)
+    return rc;
 
   if (debug) {
     fprintf(stderr, "registrationData Hex: ");
     dumpHex((unsigned char *) data, 0, data_len);
   }
 
-  rc = parse_registrationData2(data, data_len,
-                               user_public_key, keyHandle_len, keyHandle,
-                               attestation_certificate, signature);
-
-  free(data);
-  data = NULL;
-
-  return rc;
+  return parse_registrationData2(data, data_len, reg);
 }
 
-static u2fs_rc decode_clientData(const char *clientData, char **output)
+static u2fs_rc decode_clientData(const struct u2fs_span *clientData,
+                                 struct u2fs_scratch *scratch,
+                                 char **output, size_t * output_len,
+                                 u2fs_stats_t * stats)
 {
-  base64_decodestate b64;
-  size_t clientData_len = strlen(clientData);
+  size_t data_len = clientData->len;
   char *data;
-  u2fs_rc rc = 0;
+  uint64_t t;
+  u2fs_rc rc;
 
   if (output == NULL)
     return U2FS_MEMORY_ERROR;
 
-  data = calloc(sizeof(char), clientData_len);
+  data = scratch_alloc(scratch, data_len + 1);
   if (data == NULL)
     return U2FS_MEMORY_ERROR;
 
-  base64_init_decodestate(&b64);
-  base64_decode_block(clientData, clientData_len, data, &b64);
+  t = stats_begin(stats);
+  rc = base64url_decode(clientData->ptr, clientData->len,
+                        (unsigned char *) data, &data_len);
+  stats_end(stats, U2FS_STAGE_BASE64, t);
+  if (rc != U2FS_OK)
+    return rc;
+  data[data_len] = '\0';
 
   if (debug) {
     fprintf(stderr, "clientData: %s\n", data);
   }
 
-  *output = strndup(data, strlen(data));
+  *output = data;
+  *output_len = data_len;
 
-  free(data);
-  data = NULL;
+  return U2FS_OK;
+}
 
-  if (*output == NULL) {
-    fprintf(stderr, "Memory Error\n");
-    return U2FS_MEMORY_ERROR;
+/*
+ * Decode the attestation certificate @der and extract its public key,
+ * through the context's certificate cache if there is one.
+ */
+static u2fs_rc load_attestation(const u2fs_ctx_t * ctx,
+                                const unsigned char *der, size_t len,
+                                u2fs_X509_t ** cert, u2fs_EC_KEY_t ** key)
+{
+  uint64_t t = stats_begin(ctx->stats);
+  u2fs_rc rc;
+
+  if (ctx->certcache != NULL)
+    rc = certcache_get(ctx->certcache, der, len, cert, key);
+  else {
+    rc = decode_X509(der, len, cert);
+    if (rc == U2FS_OK) {
+      rc = extract_EC_KEY_from_X509(*cert, key);
+      if (rc != U2FS_OK) {
+        free_cert(*cert);
+        *cert = NULL;
+      }
+    }
   }
+  stats_end(ctx->stats, U2FS_STAGE_DECODE, t);
+
+  if (rc == U2FS_OK && debug)
+    dumpCert(*cert);
 
   return rc;
 }
 
+/*
+ * Package the verified registration into a result holding only the
+ * raw key handle, public key and certificate bytes.
+ */
+static u2fs_rc new_reg_res(const unsigned char *keyHandle,
+                           size_t keyHandle_len,
+                           const unsigned char *user_public_key,
+                           const unsigned char *certificate,
+                           size_t certificate_len,
+                           u2fs_reg_res_t ** output)
+{
+  u2fs_reg_res_t *res;
+
+  res = u2fs_calloc(1, sizeof(*res) + keyHandle_len + certificate_len);
+  if (res == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  res->keyHandle_raw = (unsigned char *) (res + 1);
+  res->keyHandle_len = keyHandle_len;
+  memcpy(res->keyHandle_raw, keyHandle, keyHandle_len);
+
+  res->attestation_certificate = res->keyHandle_raw + keyHandle_len;
+  res->attestation_certificate_len = certificate_len;
+  memcpy(res->attestation_certificate, certificate, certificate_len);
+
+  memcpy(res->publicKey, user_public_key, U2FS_PUBLIC_KEY_LEN);
+
+  *output = res;
+
+  return U2FS_OK;
+}
+
 /**
  * u2fs_registration_verify:
  * @ctx: a context handle, from u2fs_init().
@@ -750,298 +1739,164 @@ static u2fs_rc decode_clientData(const char *clientData, char **output)
  * Get a U2F registration response and check its validity.
  *
  * Returns: On success %U2FS_OK (integer 0) is returned and @output is filled up with the user public key, the key handle and the attestation certificate. On errors
- * a #u2fs_rc error code.
+ * a #u2fs_rc error code.  The textual encodings of @output are only
+ * computed when asked for through its getters.
  */
 u2fs_rc u2fs_registration_verify(u2fs_ctx_t * ctx, const char *response,
                                  u2fs_reg_res_t ** output)
 {
-  char *registrationData;
-  char *clientData;
+  struct u2fs_span registrationData;
+  struct u2fs_span clientData;
   char *clientData_decoded;
-  unsigned char *user_public_key;
-  size_t keyHandle_len;
-  char *keyHandle;
-  char *origin;
-  char *challenge;
-  char buf[_B64_BUFSIZE];
+  size_t clientData_decoded_len;
+  struct u2fs_reg_data reg;
+  struct u2fs_span origin;
+  struct u2fs_span challenge;
   unsigned char c = 0;
+  struct u2fs_scratch scratch;
   u2fs_X509_t *attestation_certificate;
-  u2fs_ECDSA_t *signature;
+  unsigned char signature[U2FS_ECDSA_RAW_LEN];
+  u2fs_EC_KEY_t *user_key;
   u2fs_EC_KEY_t *key;
+  uint64_t t;
   u2fs_rc rc;
 
   if (ctx == NULL || response == NULL || output == NULL)
     return U2FS_MEMORY_ERROR;
 
+  rc = scratch_init(&scratch, SCRATCH_LEN(strlen(response)));
+  if (rc != U2FS_OK)
+    return stats_result(ctx->stats, rc);
+
   key = NULL;
   clientData_decoded = NULL;
-  challenge = NULL;
-  origin = NULL;
   attestation_certificate = NULL;
-  user_public_key = NULL;
-  signature = NULL;
-  registrationData = NULL;
-  clientData = NULL;
-  keyHandle = NULL;
   *output = NULL;
 
-  rc = parse_registration_response(response, &registrationData,
-                                   &clientData);
+  rc = parse_registration_response(response, &scratch, &registrationData,
+                                   &clientData, ctx->stats);
   if (rc != U2FS_OK)
-    goto failure;
+    goto done;
 
   if (debug) {
-    fprintf(stderr, "registrationData: %s\n", registrationData);
-    fprintf(stderr, "clientData: %s\n", clientData);
+    fprintf(stderr, "registrationData: %.*s\n",
+            (int) registrationData.len, registrationData.ptr);
+    fprintf(stderr, "clientData: %.*s\n", (int) clientData.len,
+            clientData.ptr);
   }
 
-  rc = parse_registrationData(registrationData, &user_public_key,
-                              &keyHandle_len, &keyHandle,
-                              &attestation_certificate, &signature);
+  rc = parse_registrationData(&registrationData, &scratch, &reg,
+                              ctx->stats);
   if (rc != U2FS_OK)
-    goto failure;
+    goto done;
 
-  rc = extract_EC_KEY_from_X509(attestation_certificate, &key);
+  rc = decode_clientData(&clientData, &scratch, &clientData_decoded,
+                         &clientData_decoded_len, ctx->stats);
 
   if (rc != U2FS_OK)
-    goto failure;
-
-  //TODO Add certificate validation
+    goto done;
 
-  rc = decode_clientData(clientData, &clientData_decoded);
+  rc = parse_clientData(clientData_decoded, clientData_decoded_len,
+                        &scratch, &challenge, &origin,
+                        ctx->stats);
 
   if (rc != U2FS_OK)
-    goto failure;
-
-  rc = parse_clientData(clientData_decoded, &challenge, &origin);
+    goto done;
 
+  rc = check_challenge(ctx, &challenge);
   if (rc != U2FS_OK)
-    goto failure;
+    goto done;
 
+  if (!origin_eq(ctx, &origin)) {
+    rc = U2FS_ORIGIN_ERROR;
+    goto done;
+  }
 
-  rc = gen_challenge(ctx);
+  /* Only certificates of responses to our challenge are decoded. */
+  rc = load_attestation(ctx, reg.certificate, reg.certificate_len,
+                        &attestation_certificate, &key);
   if (rc != U2FS_OK)
-    goto failure;
+    goto done;
 
-  if (strcmp(ctx->challenge, challenge) != 0) {
-    rc = U2FS_CHALLENGE_ERROR;
-    goto failure;
+  if (ctx->truststore != NULL) {
+    t = stats_begin(ctx->stats);
+    rc = truststore_verify(ctx->truststore, reg.certificate,
+                           reg.certificate_len, attestation_certificate);
+    stats_end(ctx->stats, U2FS_STAGE_ATTESTATION, t);
+    if (rc != U2FS_OK)
+      goto done;
   }
 
-  if (strcmp(ctx->origin, origin) != 0) {
-    rc = U2FS_ORIGIN_ERROR;
-    goto failure;
+  /* Reject a public key that is not a point on the curve. */
+  t = stats_begin(ctx->stats);
+  rc = decode_user_key(reg.public_key, &user_key);
+  if (rc == U2FS_OK) {
+    free_key(user_key);
+    rc = decode_signature(reg.signature, reg.signature_len, signature);
   }
+  stats_end(ctx->stats, U2FS_STAGE_DECODE, t);
+  if (rc != U2FS_OK)
+    goto done;
 
   struct sha256_state sha_ctx;
-  char challenge_parameter[U2FS_HASH_LEN],
-      application_parameter[U2FS_HASH_LEN];
-
-  sha256_init(&sha_ctx);
-  sha256_process(&sha_ctx, (unsigned char *) ctx->appid,
-                 strlen(ctx->appid));
-  sha256_done(&sha_ctx, (unsigned char *) application_parameter);
+  char challenge_parameter[U2FS_HASH_LEN];
 
-  sha256_init(&sha_ctx);
-  sha256_process(&sha_ctx, (unsigned char *) clientData_decoded,
-                 strlen(clientData_decoded));
-  sha256_done(&sha_ctx, (unsigned char *) challenge_parameter);
+  t = stats_begin(ctx->stats);
+  sha256_digest((unsigned char *) clientData_decoded,
+                clientData_decoded_len, (unsigned char *) challenge_parameter);
 
   unsigned char dgst[U2FS_HASH_LEN];
   sha256_init(&sha_ctx);
   sha256_process(&sha_ctx, &c, 1);
-  sha256_process(&sha_ctx, (unsigned char *) application_parameter,
+  sha256_process(&sha_ctx, ctx_application_parameter(ctx),
                  U2FS_HASH_LEN);
   sha256_process(&sha_ctx, (unsigned char *) challenge_parameter,
                  U2FS_HASH_LEN);
-  sha256_process(&sha_ctx, (unsigned char *) keyHandle, keyHandle_len);
-  sha256_process(&sha_ctx, user_public_key, U2FS_PUBLIC_KEY_LEN);
+  sha256_process(&sha_ctx, reg.key_handle, reg.key_handle_len);
+  sha256_process(&sha_ctx, reg.public_key, U2FS_PUBLIC_KEY_LEN);
   sha256_done(&sha_ctx, dgst);
+  stats_end(ctx->stats, U2FS_STAGE_HASH, t);
 
-  rc = verify_ECDSA(dgst, U2FS_HASH_LEN, signature, key);
-
-  if (rc != U2FS_OK)
-    goto failure;
-
-  free_sig(signature);
-  signature = NULL;
-
-  *output = calloc(1, sizeof(**output));
-  if (*output == NULL) {
-    rc = U2FS_MEMORY_ERROR;
-    goto failure;
-  }
-
-  rc = encode_b64u(keyHandle, keyHandle_len, buf);
-  if (rc != U2FS_OK)
-    goto failure;
-
-  u2fs_EC_KEY_t *key_ptr;
-  (*output)->keyHandle = strndup(buf, strlen(buf));
+  t = stats_begin(ctx->stats);
+  rc = verify_ECDSA_raw(dgst, U2FS_HASH_LEN, signature, key);
+  stats_end(ctx->stats, U2FS_STAGE_VERIFY, t);
 
-  rc = decode_user_key(user_public_key, &key_ptr);
   if (rc != U2FS_OK)
-    goto failure;
-
-  (*output)->attestation_certificate = dup_cert(attestation_certificate);
-
-  rc = dump_user_key(key_ptr, &(*output)->publicKey);
-  if (rc != U2FS_OK)
-    goto failure;
+    goto done;
 
-  rc = dump_X509_cert(attestation_certificate, &(*output)->attestation_certificate_PEM);
+  rc = consume_challenge(ctx, &challenge, STORE_REGISTRATION);
   if (rc != U2FS_OK)
-    goto failure;
-
-  if ((*output)->keyHandle == NULL
-      || (*output)->publicKey == NULL
-      || (*output)->attestation_certificate == NULL) {
-    rc = U2FS_MEMORY_ERROR;
-    goto failure;
-  }
-
-  free_key(key);
-  key = NULL;
-
-  free_cert(attestation_certificate);
-  attestation_certificate = NULL;
-
-  free(clientData_decoded);
-  clientData_decoded = NULL;
-
-  free(challenge);
-  challenge = NULL;
-
-  free(origin);
-  origin = NULL;
-
-  free(user_public_key);
-  user_public_key = NULL;
-
-  free(registrationData);
-  registrationData = NULL;
-
-  free(clientData);
-  clientData = NULL;
-
-  free(keyHandle);
-  keyHandle = NULL;
+    goto done;
 
-  return U2FS_OK;
+  rc = new_reg_res(reg.key_handle, reg.key_handle_len, reg.public_key,
+                   reg.certificate, reg.certificate_len, output);
 
-failure:
+done:
   if (key) {
     free_key(key);
     key = NULL;
   }
 
-  if (clientData_decoded) {
-    free(clientData_decoded);
-    clientData_decoded = NULL;
-  }
-
-  if (challenge) {
-    free(challenge);
-    challenge = NULL;
-  }
-
-  if (origin) {
-    free(origin);
-    origin = NULL;
-  }
-
   if (attestation_certificate) {
     free_cert(attestation_certificate);
     attestation_certificate = NULL;
   }
 
-  if (user_public_key) {
-    free(user_public_key);
-    user_public_key = NULL;
-  }
-
-  if (signature) {
-    free_sig(signature);
-    signature = NULL;
-  }
-
-  if (registrationData) {
-    free(registrationData);
-    registrationData = NULL;
-  }
-
-  if (clientData) {
-    free(clientData);
-    clientData = NULL;
-  }
-
-  if (keyHandle) {
-    free(keyHandle);
-    keyHandle = NULL;
-  }
-
-  return rc;
-}
-
-static int authentication_challenge_json(const char *challenge,
-                                         const char *keyHandle,
-                                         const char *appid, char **output)
-{
-  u2fs_rc rc = U2FS_JSON_ERROR;
-  struct json_object *json_challenge = NULL;
-  struct json_object *json_key = NULL;
-  struct json_object *json_version = NULL;
-  struct json_object *json_appid = NULL;
-  struct json_object *json_output = NULL;
-  const char *json_string = NULL;
-
-  rc = U2FS_JSON_ERROR;
-
-  json_key = json_object_new_string(keyHandle);
-  if (json_key == NULL)
-    goto done;
-  json_version = json_object_new_string(U2F_VERSION);
-  if (json_version == NULL)
-    goto done;
-  json_challenge = json_object_new_string(challenge);
-  if (json_challenge == NULL)
-    goto done;
-  json_appid = json_object_new_string(appid);
-  if (json_appid == NULL)
-    goto done;
-
-  json_output = json_object_new_object();
-  if (json_output == NULL)
-    goto done;
-
-  json_object_object_add(json_output, "keyHandle", json_object_get(json_key));
-  json_object_object_add(json_output, "version", json_object_get(json_version));
-  json_object_object_add(json_output, "challenge", json_object_get(json_challenge));
-  json_object_object_add(json_output, "appId", json_object_get(json_appid));
-
-  json_string = json_object_to_json_string(json_output);
+  scratch_done(&scratch);
 
-  if (json_string == NULL)
-    rc = U2FS_JSON_ERROR;
-  else if ((*output = strdup(json_string)) == NULL)
-    rc = U2FS_MEMORY_ERROR;
-  else
-    rc = U2FS_OK;
-
-done:
-    json_object_put(json_output);
-    json_object_put(json_challenge);
-    json_object_put(json_key);
-    json_object_put(json_version);
-    json_object_put(json_appid);
-
-  return rc;
+  return stats_result(ctx->stats, rc);
 }
 
+/*
+ * Split signatureData into its fields.  Only the framing of the
+ * signature is checked; decoding the DER is left until the cheap
+ * checks on the response have passed.
+ */
 static u2fs_rc
 parse_signatureData2(const unsigned char *data, size_t len,
                      uint8_t * user_presence, uint32_t * counter,
-                     u2fs_ECDSA_t ** signature)
+                     const unsigned char **signature,
+                     size_t * signature_len)
 {
   /*
      +-----------------------------------+
@@ -1053,9 +1908,9 @@ parse_signatureData2(const unsigned char *data, size_t len,
    */
 
   int offset = 0;
-  u2fs_rc rc;
 
-  if (len <= 1 + U2FS_COUNTER_LEN) {
+  if (len < 1 + U2FS_COUNTER_LEN + ECDSA_SIG_MIN_LEN
+      || len > 1 + U2FS_COUNTER_LEN + ECDSA_SIG_MAX_LEN) {
     if (debug)
       fprintf(stderr, "Length mismatch\n");
     return U2FS_FORMAT_ERROR;
@@ -1073,207 +1928,185 @@ parse_signatureData2(const unsigned char *data, size_t len,
 
   offset += U2FS_COUNTER_LEN;
 
-  size_t signature_len = len - offset;
-  rc = decode_ECDSA(data + offset, signature_len, signature);
-
-  if (rc != U2FS_OK) {
-    return rc;
+  /* A DER SEQUENCE of the two integers. */
+  if (data[offset] != 0x30) {
+    if (debug)
+      fprintf(stderr, "Signature is not a SEQUENCE\n");
+    return U2FS_FORMAT_ERROR;
   }
 
+  *signature = data + offset;
+  *signature_len = len - offset;
+
   return U2FS_OK;
 }
 
 static u2fs_rc
-parse_signatureData(const char *signatureData, uint8_t * user_presence,
-                    uint32_t * counter, u2fs_ECDSA_t ** signature)
+parse_signatureData(const struct u2fs_span *signatureData,
+                    struct u2fs_scratch *scratch,
+                    uint8_t * user_presence, uint32_t * counter,
+                    const unsigned char **signature,
+                    size_t * signature_len, u2fs_stats_t * stats)
 {
 
-  base64_decodestate b64;
-  size_t signatureData_len = strlen(signatureData);
+  size_t data_len = signatureData->len + 1;
   unsigned char *data;
-  int data_len;
+  uint64_t t;
   u2fs_rc rc;
 
-  data = malloc(signatureData_len + 1);
+  data = scratch_alloc(scratch, data_len);
   if (data == NULL)
     return U2FS_MEMORY_ERROR;
 
-  data[signatureData_len] = '\0';
-
-  base64_init_decodestate(&b64);
-  data_len =
-      base64_decode_block(signatureData, signatureData_len, (char *) data,
-                          &b64);
+  t = stats_begin(stats);
+  rc = base64url_decode(signatureData->ptr, signatureData->len, data,
+                        &data_len);
+  stats_end(stats, U2FS_STAGE_BASE64, t);
+  if (rc != U2FS_OK)
+    return rc;
 
   if (debug) {
     fprintf(stderr, "signatureData Hex: ");
     dumpHex((unsigned char *) data, 0, data_len);
   }
 
-  rc = parse_signatureData2(data, data_len, user_presence, counter,
-                            signature);
-
-  free(data);
-  data = NULL;
-
-  return rc;
+  return parse_signatureData2(data, data_len, user_presence, counter,
+                              signature, signature_len);
 }
 
 static u2fs_rc
-parse_authentication_response(const char *response, char **signatureData,
-                              char **clientData, char **keyHandle)
+parse_authentication_response(const char *response,
+                              struct u2fs_scratch *scratch,
+                              struct u2fs_span *signatureData,
+                              struct u2fs_span *clientData,
+                              struct u2fs_span *keyHandle,
+                              u2fs_stats_t * stats)
 {
-  struct json_object *jo;
-  struct json_object *k;
-  const char *p;
-
-  jo = json_tokener_parse(response);
-  if (jo == NULL)
-    return U2FS_JSON_ERROR;
-
-  if (u2fs_json_object_object_get(jo, "signatureData", k) == FALSE)
-    return U2FS_JSON_ERROR;
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
-  *signatureData = strdup(p);
-  if (*signatureData == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  if (u2fs_json_object_object_get(jo, "clientData", k) == FALSE)
-    return U2FS_JSON_ERROR;
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
-  *clientData = strdup(p);
-  if (*clientData == NULL)
-    return U2FS_MEMORY_ERROR;
+  static const char *const keys[] =
+      { "signatureData", "clientData", "keyHandle" };
+  struct u2fs_span values[3];
+  u2fs_rc rc;
 
-  if (u2fs_json_object_object_get(jo, "keyHandle", k) == FALSE)
-    return U2FS_JSON_ERROR;
-  p = json_object_get_string(k);
-  if (p == NULL)
-    return U2FS_JSON_ERROR;
-  *keyHandle = strdup(p);
-  if (*keyHandle == NULL)
-    return U2FS_MEMORY_ERROR;
+  rc = parse_json(response, strlen(response), keys, values, 3, scratch,
+                  stats);
+  if (rc != U2FS_OK)
+    return rc;
 
-  json_object_put(jo);
+  *signatureData = values[0];
+  *clientData = values[1];
+  *keyHandle = values[2];
 
   return U2FS_OK;
 }
 
-/**
- * u2fs_authentication_verify:
- * @ctx: a context handle, from u2fs_init()
- * @response: pointer to output string with JSON data.
- * @output: pointer to output structure containing the relevant data for a well formed request. Memory should be free'd.
- *
- * Get a U2F authentication response and check its validity.
- *
- * Returns: On a successful verification %U2FS_OK (integer 0) is returned and @output is filled with the authentication result (same as the returned value), the counter received from the token and the user presence information. On errors
- * a #u2fs_rc error code is returned.
- */
-u2fs_rc u2fs_authentication_verify(u2fs_ctx_t * ctx, const char *response,
-                                   u2fs_auth_res_t ** output)
+static u2fs_rc authentication_verify(u2fs_ctx_t * ctx, const char *response,
+                                     struct u2fs_scratch *scratch,
+                                     u2fs_auth_res_t * output)
 {
-  char *signatureData;
-  char *clientData;
+  struct u2fs_span signatureData;
+  struct u2fs_span clientData;
   char *clientData_decoded;
-  char *keyHandle;
-  char *challenge;
-  char *origin;
+  size_t clientData_decoded_len;
+  struct u2fs_span keyHandle;
+  struct u2fs_span challenge;
+  struct u2fs_span origin;
   uint8_t user_presence;
   uint32_t counter_num;
   uint32_t counter;
-  u2fs_ECDSA_t *signature;
+  const unsigned char *signature_der;
+  size_t signature_der_len;
+  unsigned char signature[U2FS_ECDSA_RAW_LEN];
+  uint64_t t;
   u2fs_rc rc;
 
-  if (ctx == NULL || response == NULL || output == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  signatureData = NULL;
-  clientData = NULL;
-  clientData_decoded = NULL;
-  keyHandle = NULL;
-  challenge = NULL;
-  origin = NULL;
-  signature = NULL;
-  *output = NULL;
-
-  rc = parse_authentication_response(response, &signatureData,
-                                     &clientData, &keyHandle);
+  rc = parse_authentication_response(response, scratch, &signatureData,
+                                     &clientData, &keyHandle, ctx->stats);
   if (rc != U2FS_OK)
     goto failure;
 
   if (debug) {
-    fprintf(stderr, "signatureData: %s\n", signatureData);
-    fprintf(stderr, "clientData: %s\n", clientData);
-    fprintf(stderr, "keyHandle: %s\n", keyHandle);
+    fprintf(stderr, "signatureData: %.*s\n", (int) signatureData.len,
+            signatureData.ptr);
+    fprintf(stderr, "clientData: %.*s\n", (int) clientData.len,
+            clientData.ptr);
+    fprintf(stderr, "keyHandle: %.*s\n", (int) keyHandle.len,
+            keyHandle.ptr);
+  }
+
+  /*
+   * Everything up to the origin check is cheap and allocation free,
+   * so junk and replayed responses are turned away before any ASN.1
+   * or elliptic curve work.
+   */
+  if (ctx->keyHandle != NULL
+      && !base64url_equal(keyHandle.ptr, keyHandle.len, ctx->keyHandle,
+                          strlen(ctx->keyHandle))) {
+    rc = U2FS_KEYHANDLE_ERROR;
+    goto failure;
   }
 
-  rc = parse_signatureData(signatureData, &user_presence,
-                           &counter, &signature);
+  rc = parse_signatureData(&signatureData, scratch, &user_presence,
+                           &counter, &signature_der, &signature_der_len,
+                           ctx->stats);
   if (rc != U2FS_OK)
     goto failure;
 
-  rc = decode_clientData(clientData, &clientData_decoded);
+  rc = decode_clientData(&clientData, scratch, &clientData_decoded,
+                         &clientData_decoded_len, ctx->stats);
 
   if (rc != U2FS_OK)
     goto failure;
 
-  rc = parse_clientData(clientData_decoded, &challenge, &origin);
+  rc = parse_clientData(clientData_decoded, clientData_decoded_len,
+                        scratch, &challenge, &origin,
+                        ctx->stats);
 
   if (rc != U2FS_OK)
     goto failure;
 
-  if (strcmp(ctx->challenge, challenge) != 0) {
-    rc = U2FS_CHALLENGE_ERROR;
+  rc = check_challenge(ctx, &challenge);
+  if (rc != U2FS_OK)
     goto failure;
-  }
 
-  if (strcmp(ctx->origin, origin) != 0) {
+  if (!origin_eq(ctx, &origin)) {
     rc = U2FS_ORIGIN_ERROR;
     goto failure;
   }
 
-  struct sha256_state sha_ctx;
-  char challenge_parameter[U2FS_HASH_LEN],
-      application_parameter[U2FS_HASH_LEN];
+  t = stats_begin(ctx->stats);
+  rc = decode_signature(signature_der, signature_der_len, signature);
+  stats_end(ctx->stats, U2FS_STAGE_DECODE, t);
+  if (rc != U2FS_OK)
+    goto failure;
 
-  sha256_init(&sha_ctx);
-  sha256_process(&sha_ctx, (unsigned char *) ctx->appid,
-                 strlen(ctx->appid));
-  sha256_done(&sha_ctx, (unsigned char *) application_parameter);
+  struct sha256_state sha_ctx;
+  char challenge_parameter[U2FS_HASH_LEN];
 
-  sha256_init(&sha_ctx);
-  sha256_process(&sha_ctx, (unsigned char *) clientData_decoded,
-                 strlen(clientData_decoded));
-  sha256_done(&sha_ctx, (unsigned char *) challenge_parameter);
+  t = stats_begin(ctx->stats);
+  sha256_digest((unsigned char *) clientData_decoded,
+                clientData_decoded_len, (unsigned char *) challenge_parameter);
 
   unsigned char dgst[U2FS_HASH_LEN];
   sha256_init(&sha_ctx);
-  sha256_process(&sha_ctx, (unsigned char *) application_parameter,
+  sha256_process(&sha_ctx, ctx_application_parameter(ctx),
                  U2FS_HASH_LEN);
   sha256_process(&sha_ctx, (unsigned char *) &user_presence, 1);
   sha256_process(&sha_ctx, (unsigned char *) &counter, U2FS_COUNTER_LEN);
   sha256_process(&sha_ctx, (unsigned char *) challenge_parameter,
                  U2FS_HASH_LEN);
   sha256_done(&sha_ctx, dgst);
+  stats_end(ctx->stats, U2FS_STAGE_HASH, t);
 
-  rc = verify_ECDSA(dgst, U2FS_HASH_LEN, signature, ctx->key);
+  t = stats_begin(ctx->stats);
+  rc = verify_ECDSA_raw(dgst, U2FS_HASH_LEN, signature, ctx_key(ctx));
+  stats_end(ctx->stats, U2FS_STAGE_VERIFY, t);
 
   if (rc != U2FS_OK)
     goto failure;
 
-  free_sig(signature);
-  signature = NULL;
-
-  *output = calloc(1, sizeof(**output));
-  if (*output == NULL) {
-    rc = U2FS_MEMORY_ERROR;
+  rc = consume_challenge(ctx, &challenge, STORE_AUTHENTICATION);
+  if (rc != U2FS_OK)
     goto failure;
-  }
 
   counter_num = 0;
   counter_num |= (counter & 0xFF000000) >> 24;
@@ -1281,67 +2114,194 @@ u2fs_rc u2fs_authentication_verify(u2fs_ctx_t * ctx, const char *response,
   counter_num |= (counter & 0x0000FF00) << 8;
   counter_num |= (counter & 0x000000FF) << 24;
 
-  (*output)->verified = U2FS_OK;
-  (*output)->user_presence = user_presence;
-  (*output)->counter = counter_num;
+  if (ctx->counters != NULL) {
+    if (ctx->keyHandle == NULL) {
+      rc = U2FS_MEMORY_ERROR;
+      goto failure;
+    }
+
+    rc = counter_update(ctx->counters, ctx->keyHandle, counter_num);
+    if (rc != U2FS_OK)
+      goto failure;
+  }
+
+  output->verified = U2FS_OK;
+  output->user_presence = user_presence;
+  output->counter = counter_num;
 
-  free(origin);
-  origin = NULL;
+  return stats_result(ctx->stats, U2FS_OK);
 
-  free(challenge);
-  challenge = NULL;
+failure:
+  return stats_result(ctx->stats, rc);
+}
+
+/**
+ * u2fs_authentication_verify_buf:
+ * @ctx: a context handle, from u2fs_init()
+ * @response: pointer to output string with JSON data.
+ * @buf: caller-supplied working memory, for example on the stack.
+ * @buflen: size of @buf, %U2FS_AUTH_BUFSIZE(strlen(@response)) is always enough.
+ * @output: pointer to output structure, placed within @buf.
+ *
+ * Get a U2F authentication response and check its validity, like
+ * u2fs_authentication_verify(), but keeping all intermediate data and
+ * the result within @buf instead of allocating them.  The result is
+ * owned by the caller and stays valid for as long as @buf does; it
+ * must not be passed to u2fs_free_auth_res().
+ *
+ * Returns: On a successful verification %U2FS_OK (integer 0) is returned and @output is filled as by u2fs_authentication_verify(). On errors
+ * a #u2fs_rc error code is returned, %U2FS_MEMORY_ERROR if @buf is too small.
+ */
+u2fs_rc u2fs_authentication_verify_buf(u2fs_ctx_t * ctx,
+                                       const char *response, void *buf,
+                                       size_t buflen,
+                                       u2fs_auth_res_t ** output)
+{
+  struct u2fs_scratch scratch;
+  u2fs_auth_res_t *res;
+  u2fs_rc rc;
+
+  if (ctx == NULL || response == NULL || buf == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
 
-  free(keyHandle);
-  keyHandle = NULL;
+  *output = NULL;
 
-  free(signatureData);
-  signatureData = NULL;
+  scratch.buf = buf;
+  scratch.size = buflen;
+  scratch.used = 0;
 
-  free(clientData);
-  clientData = NULL;
+  res = scratch_alloc_aligned(&scratch, sizeof(*res));
+  if (res == NULL)
+    return U2FS_MEMORY_ERROR;
 
-  free(clientData_decoded);
-  clientData_decoded = NULL;
+  rc = authentication_verify(ctx, response, &scratch, res);
+  if (rc != U2FS_OK)
+    return rc;
+
+  *output = res;
 
   return U2FS_OK;
+}
 
-failure:
-  if (clientData_decoded) {
-    free(clientData_decoded);
-    clientData_decoded = NULL;
-  }
+/**
+ * u2fs_authentication_verify:
+ * @ctx: a context handle, from u2fs_init()
+ * @response: pointer to output string with JSON data.
+ * @output: pointer to output structure containing the relevant data for a well formed request. Memory should be free'd.
+ *
+ * Get a U2F authentication response and check its validity.
+ *
+ * Returns: On a successful verification %U2FS_OK (integer 0) is returned and @output is filled with the authentication result (same as the returned value), the counter received from the token and the user presence information. On errors
+ * a #u2fs_rc error code is returned.
+ */
+u2fs_rc u2fs_authentication_verify(u2fs_ctx_t * ctx, const char *response,
+                                   u2fs_auth_res_t ** output)
+{
+  char stackbuf[_SCRATCH_BUFSIZE];
+  char *buf = stackbuf;
+  size_t buflen;
+  u2fs_auth_res_t *res;
+  u2fs_rc rc;
 
-  if (challenge) {
-    free(challenge);
-    challenge = NULL;
-  }
+  if (ctx == NULL || response == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
 
-  if (origin) {
-    free(origin);
-    origin = NULL;
-  }
+  *output = NULL;
 
-  if (signature) {
-    free_sig(signature);
-    signature = NULL;
+  buflen = U2FS_AUTH_BUFSIZE(strlen(response));
+  if (buflen > sizeof(stackbuf)) {
+    buf = u2fs_malloc(buflen);
+    if (buf == NULL)
+      return U2FS_MEMORY_ERROR;
+  } else
+    buflen = sizeof(stackbuf);
+
+  rc = u2fs_authentication_verify_buf(ctx, response, buf, buflen, &res);
+  if (rc == U2FS_OK) {
+    *output = u2fs_malloc(sizeof(**output));
+    if (*output == NULL)
+      rc = U2FS_MEMORY_ERROR;
+    else
+      **output = *res;
   }
 
-  if (signatureData) {
-    free(signatureData);
-    signatureData = NULL;
-  }
+  if (buf != stackbuf)
+    u2fs_free(buf);
+
+  return rc;
+}
+
+/**
+ * u2fs_authentication_verify_batch:
+ * @ctx: array of @count context handles, from u2fs_init()
+ * @responses: array of @count U2F authentication responses (JSON data)
+ * @count: number of entries in @ctx, @responses, @outputs and @rcs
+ * @outputs: array of @count output pointers, each filled in as by
+ *   u2fs_authentication_verify().  Memory should be free'd.
+ * @rcs: optional array of @count results, may be NULL.
+ *
+ * Verify @count U2F authentication responses in one call.  Entry @i
+ * of @responses is checked against @ctx[@i] exactly as
+ * u2fs_authentication_verify() would, but the intermediate buffers
+ * are allocated once and shared by the whole batch.  The individual
+ * result of each verification is stored in @rcs[@i], and @outputs[@i]
+ * is left NULL for entries that failed.
+ *
+ * Returns: %U2FS_OK (integer 0) if every response was verified
+ * successfully, otherwise the #u2fs_rc error code of the first entry
+ * that failed.
+ */
+u2fs_rc u2fs_authentication_verify_batch(u2fs_ctx_t ** ctx,
+                                         const char **responses,
+                                         size_t count,
+                                         u2fs_auth_res_t ** outputs,
+                                         u2fs_rc * rcs)
+{
+  struct u2fs_scratch scratch;
+  u2fs_auth_res_t res;
+  size_t max_len = 0;
+  size_t i;
+  u2fs_rc rc;
+  u2fs_rc first = U2FS_OK;
+
+  if (ctx == NULL || responses == NULL || outputs == NULL)
+    return U2FS_MEMORY_ERROR;
 
-  if (clientData) {
-    free(clientData);
-    clientData = NULL;
+  for (i = 0; i < count; i++) {
+    outputs[i] = NULL;
+    if (responses[i] != NULL && strlen(responses[i]) > max_len)
+      max_len = strlen(responses[i]);
   }
 
-  if (keyHandle) {
-    free(keyHandle);
-    keyHandle = NULL;
+  rc = scratch_init(&scratch, SCRATCH_LEN(max_len));
+  if (rc != U2FS_OK)
+    return rc;
+
+  for (i = 0; i < count; i++) {
+    scratch.used = 0;
+
+    if (ctx[i] == NULL || responses[i] == NULL)
+      rc = U2FS_MEMORY_ERROR;
+    else
+      rc = authentication_verify(ctx[i], responses[i], &scratch, &res);
+
+    if (rc == U2FS_OK) {
+      outputs[i] = u2fs_malloc(sizeof(*outputs[i]));
+      if (outputs[i] == NULL)
+        rc = U2FS_MEMORY_ERROR;
+      else
+        *outputs[i] = res;
+    }
+
+    if (rcs)
+      rcs[i] = rc;
+    if (rc != U2FS_OK && first == U2FS_OK)
+      first = rc;
   }
 
-  return rc;
+  scratch_done(&scratch);
+
+  return first;
 }
 
 /**
@@ -1362,10 +2322,39 @@ u2fs_rc u2fs_authentication_challenge(u2fs_ctx_t * ctx, char **output)
   if (ctx->keyHandle == NULL)
     return U2FS_MEMORY_ERROR;
 
-  rc = gen_challenge(ctx);
+  rc = gen_challenge(ctx, STORE_AUTHENTICATION);
+  if (rc != U2FS_OK)
+    return rc;
+
+  return challenge_json_alloc(ctx, 1, output);
+}
+
+/**
+ * u2fs_authentication_challenge_buf:
+ * @ctx: a context handle, from u2fs_init()
+ * @buf: output buffer for the JSON data of AuthenticationData.
+ * @buflen: on input the size of @buf, on output the length of the
+ *   string written, excluding the terminating NUL.
+ *
+ * Like u2fs_authentication_challenge(), but write the message to @buf
+ * instead of allocating it.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.  If @buf is too small %U2FS_MEMORY_ERROR is
+ * returned and @buflen is set to the size needed.
+ */
+u2fs_rc u2fs_authentication_challenge_buf(u2fs_ctx_t * ctx, char *buf,
+                                          size_t * buflen)
+{
+  u2fs_rc rc;
+
+  if (ctx == NULL || ctx->keyHandle == NULL || buflen == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = gen_challenge(ctx, STORE_AUTHENTICATION);
   if (rc != U2FS_OK)
     return rc;
 
-  return authentication_challenge_json(ctx->challenge,
-                                       ctx->keyHandle, ctx->appid, output);
+  return authentication_challenge_json(ctx->challenge, ctx->keyHandle,
+                                       ctx_appid(ctx), buf, buflen);
 }
@@ -0,0 +1,272 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Table of the last signature counter seen per key handle.
+ *
+ * The table is a fixed size open addressing hash table of entry
+ * pointers.  Entries are only ever added, by compare-and-swap into an
+ * empty slot, and never move or go away before the table does, so
+ * lookups and counter updates need no lock.  A counter only moves up,
+ * again by compare-and-swap, so of two concurrent verifications with
+ * the same counter value exactly one succeeds.
+ */
+
+#include "internal.h"
+#include "counter.h"
+
+#include <stdint.h>
+#include <string.h>
+
+struct counter_entry {
+  uint32_t hash;
+  uint32_t counter;
+  size_t len;
+  char keyHandle[];
+};
+
+struct u2fs_counters {
+  size_t nslots;
+  struct counter_entry **slots;
+};
+
+static uint32_t counter_hash(const char *keyHandle, size_t len)
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) keyHandle[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+/*
+ * Find the entry for @keyHandle, adding it with @counter if there is
+ * none.  *@added tells which of the two happened.
+ */
+static u2fs_rc counter_entry(u2fs_counters_t * counters,
+                             const char *keyHandle, uint32_t counter,
+                             struct counter_entry **entry, int *added)
+{
+  struct counter_entry *e, *fresh = NULL;
+  size_t len = strlen(keyHandle);
+  uint32_t hash = counter_hash(keyHandle, len);
+  size_t i, n;
+
+  *added = 0;
+
+  for (i = hash & (counters->nslots - 1), n = 0; n < counters->nslots;
+       i = (i + 1) & (counters->nslots - 1), n++) {
+    e = __atomic_load_n(&counters->slots[i], __ATOMIC_ACQUIRE);
+
+    if (e == NULL) {
+      if (fresh == NULL) {
+        fresh = u2fs_malloc(sizeof(*fresh) + len + 1);
+        if (fresh == NULL)
+          return U2FS_MEMORY_ERROR;
+        fresh->hash = hash;
+        fresh->counter = counter;
+        fresh->len = len;
+        memcpy(fresh->keyHandle, keyHandle, len + 1);
+      }
+
+      if (__atomic_compare_exchange_n(&counters->slots[i], &e, fresh, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        *entry = fresh;
+        *added = 1;
+        return U2FS_OK;
+      }
+      /* Lost the slot; e is now whoever won it. */
+    }
+
+    if (e->hash == hash && e->len == len
+        && memcmp(e->keyHandle, keyHandle, len) == 0) {
+      u2fs_free(fresh);
+      *entry = e;
+      return U2FS_OK;
+    }
+  }
+
+  u2fs_free(fresh);
+
+  return U2FS_MEMORY_ERROR;
+}
+
+/*
+ * Record @counter for @keyHandle, which must be larger than any
+ * counter recorded for it before.
+ */
+u2fs_rc counter_update(u2fs_counters_t * counters, const char *keyHandle,
+                       uint32_t counter)
+{
+  struct counter_entry *e;
+  uint32_t old;
+  int added;
+  u2fs_rc rc;
+
+  rc = counter_entry(counters, keyHandle, counter, &e, &added);
+  if (rc != U2FS_OK || added)
+    return rc;
+
+  old = __atomic_load_n(&e->counter, __ATOMIC_ACQUIRE);
+  do {
+    if (counter <= old)
+      return U2FS_COUNTER_ERROR;
+  } while (!__atomic_compare_exchange_n(&e->counter, &old, counter, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_counters_init:
+ * @counters: pointer to output variable holding a counter table handle.
+ * @size: maximum number of key handles tracked.
+ *
+ * Create a table remembering the last signature counter of up to
+ * @size credentials.  Once attached to a context with
+ * u2fs_set_counters(), an authentication only verifies if its counter
+ * is larger than the one last seen for the context's key handle,
+ * which guards against cloned devices and replayed responses.  The
+ * table is thread safe and may be shared by any number of contexts.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_counters_init(u2fs_counters_t ** counters, size_t size)
+{
+  size_t nslots;
+
+  if (counters == NULL || size == 0 || size > ((size_t) - 1) / 4)
+    return U2FS_MEMORY_ERROR;
+
+  /* Keep the table at most half full. */
+  for (nslots = 1; nslots < 2 * size; nslots *= 2);
+
+  *counters = u2fs_calloc(1, sizeof(**counters));
+  if (*counters == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*counters)->nslots = nslots;
+  (*counters)->slots = u2fs_calloc(nslots, sizeof(*(*counters)->slots));
+  if ((*counters)->slots == NULL) {
+    u2fs_free(*counters);
+    *counters = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_counters_done:
+ * @counters: a counter table handle, from u2fs_counters_init()
+ *
+ * Deallocate resources associated with @counters.  No context
+ * referring to @counters may be used afterwards.
+ */
+void u2fs_counters_done(u2fs_counters_t * counters)
+{
+  size_t i;
+
+  if (counters == NULL)
+    return;
+
+  for (i = 0; i < counters->nslots; i++)
+    u2fs_free(counters->slots[i]);
+  u2fs_free(counters->slots);
+  u2fs_free(counters);
+}
+
+/**
+ * u2fs_counters_restore:
+ * @counters: a counter table handle, from u2fs_counters_init()
+ * @keyHandle: a registered key handle in websafe Base64 form.
+ * @counter: the last counter value seen for @keyHandle.
+ *
+ * Load a counter saved earlier, for example with
+ * u2fs_counters_snapshot().  A counter already in the table is only
+ * ever raised, never lowered.  This function may be called while the
+ * table is in use.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code, %U2FS_MEMORY_ERROR if the table is full.
+ */
+u2fs_rc u2fs_counters_restore(u2fs_counters_t * counters,
+                              const char *keyHandle, uint32_t counter)
+{
+  u2fs_rc rc;
+
+  if (counters == NULL || keyHandle == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = counter_update(counters, keyHandle, counter);
+  if (rc == U2FS_COUNTER_ERROR)
+    rc = U2FS_OK;
+
+  return rc;
+}
+
+/**
+ * u2fs_counters_snapshot:
+ * @counters: a counter table handle, from u2fs_counters_init()
+ * @func: callback invoked once per key handle in the table.
+ * @data: opaque pointer passed to @func.
+ *
+ * Call @func with every key handle and its last counter, for example
+ * to persist the table.  The table may be in use meanwhile; each
+ * counter reported is one that was current during the call.  If @func
+ * returns non-zero, the iteration stops.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_counters_snapshot(u2fs_counters_t * counters,
+                               u2fs_counter_func func, void *data)
+{
+  struct counter_entry *e;
+  size_t i;
+
+  if (counters == NULL || func == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  for (i = 0; i < counters->nslots; i++) {
+    e = __atomic_load_n(&counters->slots[i], __ATOMIC_ACQUIRE);
+    if (e == NULL)
+      continue;
+
+    if (func(e->keyHandle, __atomic_load_n(&e->counter, __ATOMIC_ACQUIRE), data))
+      break;
+  }
+
+  return U2FS_OK;
+}
@@ -0,0 +1,305 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Read-only credential database: a file of binary credential records
+ * (see credential.c) mapped into memory, with an open addressing hash
+ * index from raw key handle to record number built on top.  Records
+ * are never copied; lookups hand out pointers into the mapping, which
+ * the page cache shares between every process mapping the same file.
+ */
+
+#include "internal.h"
+#include "base64url.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Record numbers are stored plus one; zero marks an empty slot. */
+struct creddb_slot {
+  uint32_t hash;
+  uint32_t record;
+};
+
+struct u2fs_creddb {
+  int fd;
+  void *map;
+  size_t map_len;
+  const unsigned char *records;
+  size_t count;
+  size_t nslots;
+  struct creddb_slot *slots;
+};
+
+static uint32_t creddb_hash(const unsigned char *keyHandle, size_t len)
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= keyHandle[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static const unsigned char *creddb_record(const u2fs_creddb_t * db,
+                                          uint32_t record)
+{
+  return db->records + (size_t) (record - 1) * U2FS_CREDENTIAL_LEN;
+}
+
+/*
+ * Index record number @n.  A later record for the same key handle
+ * replaces an earlier one, so a re-registration wins.
+ */
+static void creddb_insert(u2fs_creddb_t * db, size_t n)
+{
+  const unsigned char *record = db->records + n * U2FS_CREDENTIAL_LEN;
+  const unsigned char *keyHandle, *other;
+  size_t len, other_len, i;
+  uint32_t hash;
+
+  if (u2fs_credential_decode(record, &keyHandle, &len, NULL, NULL, NULL)
+      != U2FS_OK)
+    return;
+
+  hash = creddb_hash(keyHandle, len);
+
+  for (i = hash & (db->nslots - 1); db->slots[i].record != 0;
+       i = (i + 1) & (db->nslots - 1)) {
+    if (db->slots[i].hash != hash)
+      continue;
+    /* The file is shared; a record may have been rewritten since. */
+    if (u2fs_credential_decode(creddb_record(db, db->slots[i].record),
+                               &other, &other_len, NULL, NULL, NULL)
+        != U2FS_OK)
+      continue;
+    if (other_len == len && memcmp(other, keyHandle, len) == 0)
+      break;
+  }
+
+  db->slots[i].hash = hash;
+  db->slots[i].record = n + 1;
+}
+
+/* Map the file again and index the records added since the last time. */
+static u2fs_rc creddb_load(u2fs_creddb_t * db)
+{
+  const unsigned char *records;
+  size_t count, nslots, first, n;
+  struct creddb_slot *slots;
+  struct stat st;
+  void *map;
+  u2fs_rc rc;
+
+  if (fstat(db->fd, &st) != 0 || st.st_size < 0)
+    return U2FS_MEMORY_ERROR;
+
+  if ((size_t) st.st_size == db->map_len)
+    return U2FS_OK;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, db->fd, 0);
+  if (map == MAP_FAILED)
+    return U2FS_MEMORY_ERROR;
+
+  rc = u2fs_credentials_parse(map, st.st_size, &records, &count);
+  if (rc == U2FS_OK && (count < db->count || count >= UINT32_MAX / 2))
+    rc = U2FS_FORMAT_ERROR;
+  if (rc != U2FS_OK) {
+    munmap(map, st.st_size);
+    return rc;
+  }
+
+  for (nslots = db->nslots ? db->nslots : 16; nslots < 2 * count;
+       nslots *= 2);
+
+  first = db->count;
+  if (nslots != db->nslots) {
+    slots = u2fs_calloc(nslots, sizeof(*slots));
+    if (slots == NULL) {
+      munmap(map, st.st_size);
+      return U2FS_MEMORY_ERROR;
+    }
+    u2fs_free(db->slots);
+    db->slots = slots;
+    db->nslots = nslots;
+    first = 0;
+  }
+
+  if (db->map != NULL)
+    munmap(db->map, db->map_len);
+  db->map = map;
+  db->map_len = st.st_size;
+  db->records = records;
+  db->count = count;
+
+  for (n = first; n < count; n++)
+    creddb_insert(db, n);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_creddb_init:
+ * @db: pointer to output variable holding a credential database handle.
+ * @path: a file of credential records, see u2fs_credentials_parse().
+ *
+ * Map the credential file @path into memory and index its records by
+ * key handle.  The file is only read; append to it, updating its
+ * header, and call u2fs_creddb_refresh() to pick up new records.  The
+ * handle may be shared by any number of contexts and threads as long
+ * as u2fs_creddb_refresh() is not called concurrently with them.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code; %U2FS_FORMAT_ERROR if @path does not hold
+ * credential records.
+ */
+u2fs_rc u2fs_creddb_init(u2fs_creddb_t ** db, const char *path)
+{
+  u2fs_rc rc;
+
+  if (db == NULL || path == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  *db = u2fs_calloc(1, sizeof(**db));
+  if (*db == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*db)->fd = open(path, O_RDONLY);
+  if ((*db)->fd < 0) {
+    u2fs_free(*db);
+    *db = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  rc = creddb_load(*db);
+  if (rc == U2FS_OK && (*db)->map == NULL)
+    rc = U2FS_FORMAT_ERROR;
+  if (rc != U2FS_OK) {
+    u2fs_creddb_done(*db);
+    *db = NULL;
+  }
+
+  return rc;
+}
+
+/**
+ * u2fs_creddb_refresh:
+ * @db: a credential database handle, from u2fs_creddb_init()
+ *
+ * Map the credential file of @db again if it has changed size, and
+ * index the records appended since.  Records obtained from @db before
+ * are no longer valid afterwards.  On errors @db keeps using the
+ * previous mapping, so a refresh racing with a writer can just be
+ * retried.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_creddb_refresh(u2fs_creddb_t * db)
+{
+  if (db == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  return creddb_load(db);
+}
+
+/**
+ * u2fs_creddb_done:
+ * @db: a credential database handle, from u2fs_creddb_init()
+ *
+ * Unmap the credential file and deallocate resources associated with
+ * @db.  No record obtained from @db may be used afterwards.
+ */
+void u2fs_creddb_done(u2fs_creddb_t * db)
+{
+  if (db == NULL)
+    return;
+
+  if (db->map != NULL)
+    munmap(db->map, db->map_len);
+  close(db->fd);
+  u2fs_free(db->slots);
+  u2fs_free(db);
+}
+
+/**
+ * u2fs_creddb_lookup:
+ * @db: a credential database handle, from u2fs_creddb_init()
+ * @keyHandle: a key-handle in websafe Base64 form.
+ * @record: output parameter for a pointer to the credential record.
+ *
+ * Find the credential registered for @keyHandle.  *@record points into
+ * the mapped file, for u2fs_credential_decode(), and stays valid until
+ * the next u2fs_creddb_refresh() or u2fs_creddb_done().
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code; %U2FS_FORMAT_ERROR if no record matches.
+ */
+u2fs_rc u2fs_creddb_lookup(const u2fs_creddb_t * db, const char *keyHandle,
+                           const unsigned char **record)
+{
+  unsigned char raw[U2FS_KEYHANDLE_MAX_LEN + 1];
+  size_t raw_len = sizeof(raw);
+  const unsigned char *other;
+  size_t other_len, i;
+  uint32_t hash;
+  u2fs_rc rc;
+
+  if (db == NULL || keyHandle == NULL || record == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = base64url_decode(keyHandle, strlen(keyHandle), raw, &raw_len);
+  if (rc != U2FS_OK)
+    return rc;
+
+  hash = creddb_hash(raw, raw_len);
+
+  for (i = hash & (db->nslots - 1); db->slots[i].record != 0;
+       i = (i + 1) & (db->nslots - 1)) {
+    if (db->slots[i].hash != hash)
+      continue;
+    *record = creddb_record(db, db->slots[i].record);
+    if (u2fs_credential_decode(*record, &other, &other_len, NULL, NULL,
+                               NULL) != U2FS_OK)
+      continue;
+    if (other_len == raw_len && memcmp(other, raw, raw_len) == 0)
+      return U2FS_OK;
+  }
+
+  *record = NULL;
+
+  return U2FS_FORMAT_ERROR;
+}
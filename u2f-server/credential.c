@@ -0,0 +1,260 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Fixed-size binary credential records, and arrays of them behind a
+ * short header, meant to be written once and mapped straight into
+ * memory.  All integers are big endian.
+ *
+ * Record, U2FS_CREDENTIAL_LEN bytes:
+ *   0   version, U2FS_CREDENTIAL_VERSION
+ *   1   flags, left to the application
+ *   2   key handle length L, 1 to U2FS_KEYHANDLE_MAX_LEN
+ *   3   reserved, zero
+ *   4   signature counter, 32 bits
+ *   8   user public key, an uncompressed P-256 point
+ *   73  raw key handle, L bytes, zero padded
+ *   328 reserved, zero
+ *
+ * Array header, U2FS_CREDENTIAL_HEADER_LEN bytes:
+ *   0   magic "U2FC"
+ *   4   version, U2FS_CREDENTIAL_VERSION
+ *   5   reserved, zero
+ *   8   number of records, 64 bits
+ *
+ * The records follow the header back to back, so with both sizes a
+ * multiple of 16 every record is aligned within a mapped file.
+ */
+
+#include "internal.h"
+
+#include <string.h>
+
+#define RECORD_FLAGS 1
+#define RECORD_KEYHANDLE_LEN 2
+#define RECORD_COUNTER 4
+#define RECORD_PUBLIC_KEY 8
+#define RECORD_KEYHANDLE (RECORD_PUBLIC_KEY + U2FS_PUBLIC_KEY_LEN)
+
+#define HEADER_MAGIC "U2FC"
+#define HEADER_VERSION 4
+#define HEADER_COUNT 8
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+      ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+  put_be32(p, v >> 32);
+  put_be32(p + 4, (uint32_t) v);
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+  return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/**
+ * u2fs_credential_encode:
+ * @record: output buffer of %U2FS_CREDENTIAL_LEN bytes.
+ * @keyHandle: the raw key handle.
+ * @keyHandle_len: length of @keyHandle, at most %U2FS_KEYHANDLE_MAX_LEN.
+ * @publicKey: the %U2FS_PUBLIC_KEY_LEN bytes of the user public key.
+ * @counter: the last signature counter seen for the credential.
+ * @flags: application defined flags.
+ *
+ * Write a binary credential record into @record.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_credential_encode(unsigned char *record,
+                               const unsigned char *keyHandle,
+                               size_t keyHandle_len,
+                               const unsigned char *publicKey,
+                               uint32_t counter, uint8_t flags)
+{
+  if (record == NULL || keyHandle == NULL || publicKey == NULL
+      || keyHandle_len == 0 || keyHandle_len > U2FS_KEYHANDLE_MAX_LEN)
+    return U2FS_MEMORY_ERROR;
+
+  memset(record, 0, U2FS_CREDENTIAL_LEN);
+  record[0] = U2FS_CREDENTIAL_VERSION;
+  record[RECORD_FLAGS] = flags;
+  record[RECORD_KEYHANDLE_LEN] = keyHandle_len;
+  put_be32(record + RECORD_COUNTER, counter);
+  memcpy(record + RECORD_PUBLIC_KEY, publicKey, U2FS_PUBLIC_KEY_LEN);
+  memcpy(record + RECORD_KEYHANDLE, keyHandle, keyHandle_len);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_credential_decode:
+ * @record: a credential record of %U2FS_CREDENTIAL_LEN bytes.
+ * @keyHandle: output parameter for a pointer to the raw key handle.
+ * @keyHandle_len: output parameter for the key handle length.
+ * @publicKey: output parameter for a pointer to the user public key,
+ *   suitable for u2fs_pubkey_init() or u2fs_set_publicKey().
+ * @counter: output parameter for the signature counter.
+ * @flags: output parameter for the application defined flags.
+ *
+ * Unpack a credential record written by u2fs_credential_encode().
+ * The returned pointers point into @record; nothing is copied.  If any
+ * of the output parameters is set to NULL, that parameter will be
+ * ignored.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code; %U2FS_FORMAT_ERROR if @record is malformed or
+ * of an unknown version.
+ */
+u2fs_rc u2fs_credential_decode(const unsigned char *record,
+                               const unsigned char **keyHandle,
+                               size_t * keyHandle_len,
+                               const unsigned char **publicKey,
+                               uint32_t * counter, uint8_t * flags)
+{
+  if (record == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (record[0] != U2FS_CREDENTIAL_VERSION
+      || record[RECORD_KEYHANDLE_LEN] == 0
+      || record[RECORD_PUBLIC_KEY] != 0x04)
+    return U2FS_FORMAT_ERROR;
+
+  if (keyHandle != NULL)
+    *keyHandle = record + RECORD_KEYHANDLE;
+  if (keyHandle_len != NULL)
+    *keyHandle_len = record[RECORD_KEYHANDLE_LEN];
+  if (publicKey != NULL)
+    *publicKey = record + RECORD_PUBLIC_KEY;
+  if (counter != NULL)
+    *counter = get_be32(record + RECORD_COUNTER);
+  if (flags != NULL)
+    *flags = record[RECORD_FLAGS];
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_get_registration_credential:
+ * @result: a registration result obtained from u2fs_registration_verify()
+ * @record: output buffer of %U2FS_CREDENTIAL_LEN bytes.
+ *
+ * Write the credential obtained during the U2F registration operation
+ * into @record, with a zero counter and no flags.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_get_registration_credential(const u2fs_reg_res_t * result,
+                                         unsigned char *record)
+{
+  if (result == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  return u2fs_credential_encode(record, result->keyHandle_raw,
+                                result->keyHandle_len, result->publicKey,
+                                0, 0);
+}
+
+/**
+ * u2fs_credentials_header:
+ * @header: output buffer of %U2FS_CREDENTIAL_HEADER_LEN bytes.
+ * @count: number of records following the header.
+ *
+ * Write the header of an array of @count credential records.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_credentials_header(unsigned char *header, size_t count)
+{
+  if (header == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  memset(header, 0, U2FS_CREDENTIAL_HEADER_LEN);
+  memcpy(header, HEADER_MAGIC, sizeof(HEADER_MAGIC) - 1);
+  header[HEADER_VERSION] = U2FS_CREDENTIAL_VERSION;
+  put_be64(header + HEADER_COUNT, count);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_credentials_parse:
+ * @data: an array of credential records, as written to a file.
+ * @len: length of @data in bytes.
+ * @records: output parameter for a pointer to the first record.
+ * @count: output parameter for the number of records.
+ *
+ * Check the header of the credential array @data, such as a mapped
+ * file, and locate its records.  Record i starts at @records + i *
+ * %U2FS_CREDENTIAL_LEN and can be read with u2fs_credential_decode().
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code; %U2FS_FORMAT_ERROR if the header is wrong or
+ * does not match @len.
+ */
+u2fs_rc u2fs_credentials_parse(const void *data, size_t len,
+                               const unsigned char **records,
+                               size_t * count)
+{
+  const unsigned char *p = data;
+  uint64_t n;
+
+  if (data == NULL || records == NULL || count == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (len < U2FS_CREDENTIAL_HEADER_LEN
+      || memcmp(p, HEADER_MAGIC, sizeof(HEADER_MAGIC) - 1) != 0
+      || p[HEADER_VERSION] != U2FS_CREDENTIAL_VERSION)
+    return U2FS_FORMAT_ERROR;
+
+  n = get_be64(p + HEADER_COUNT);
+  if (n != (len - U2FS_CREDENTIAL_HEADER_LEN) / U2FS_CREDENTIAL_LEN
+      || (len - U2FS_CREDENTIAL_HEADER_LEN) % U2FS_CREDENTIAL_LEN != 0)
+    return U2FS_FORMAT_ERROR;
+
+  *records = p + U2FS_CREDENTIAL_HEADER_LEN;
+  *count = n;
+
+  return U2FS_OK;
+}
@@ -27,42 +27,77 @@
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+ * Interface between the library and its crypto code.  The handle
+ * types of internal.h are opaque to callers: they are created, shared
+ * and released only through these functions.  Unless noted, functions
+ * return U2FS_MEMORY_ERROR for missing arguments, U2FS_CRYPTO_ERROR
+ * for input the backend rejects and U2FS_SIGNATURE_ERROR when a
+ * signature does not verify.  Keys and certificates may be shared
+ * between threads once created.
+ *
+ * openssl.c implements random numbers, X.509 and signature decoding;
+ * keys and signature verification come from the backend chosen with
+ * configure --with-crypto: openssl-eckey.c (EC_KEY, the default) or
+ * openssl-evp.c (EVP_PKEY, OpenSSL 3.0 and later).
+ */
+
 #ifndef U2FS_CRYPTO_H
 #define U2FS_CRYPTO_H
 
 #include "internal.h"
 
+#include <time.h>
+
 #ifdef MAKE_CHECK
-int debug = 1;
+U2FS_ATOMIC int debug = 1;
+struct u2fs_allocator allocator = { malloc, realloc, free };
 #endif
 
 void dumpCert(const u2fs_X509_t * certificate);
 
-void crypto_init(void);
+u2fs_rc crypto_init(void);
 void crypto_release(void);
 
+/* Backend state, set up and torn down by crypto_init()/crypto_release(). */
+u2fs_rc key_init(void);
+void key_release(void);
+
 void free_key(u2fs_EC_KEY_t * key);
 void free_cert(u2fs_X509_t * cert);
 void free_sig(u2fs_ECDSA_t * sig);
 
 
 u2fs_rc set_random_bytes(char *data, size_t len);
+void cleanse_bytes(void *data, size_t len);
+int equal_bytes(const void *a, const void *b, size_t len);
 
 u2fs_rc decode_X509(const unsigned char *data, size_t len,
                     u2fs_X509_t ** cert);
 u2fs_rc decode_ECDSA(const unsigned char *data, size_t len,
                      u2fs_ECDSA_t ** sig);
 u2fs_rc decode_user_key(const unsigned char *data, u2fs_EC_KEY_t ** key);
+u2fs_rc decompress_user_key(const unsigned char *data,
+                            unsigned char *output);
 
 u2fs_rc verify_ECDSA(const unsigned char *dgst, int dgst_len,
                      const u2fs_ECDSA_t * sig, u2fs_EC_KEY_t * eckey);
+u2fs_rc verify_ECDSA_raw(const unsigned char *dgst, int dgst_len,
+                         const unsigned char *sig, u2fs_EC_KEY_t * eckey);
 
 u2fs_rc extract_EC_KEY_from_X509(const u2fs_X509_t * cert,
                                  u2fs_EC_KEY_t ** key);
 u2fs_EC_KEY_t *dup_key(const u2fs_EC_KEY_t * key);
-u2fs_X509_t *dup_cert(const u2fs_X509_t * cert);
+u2fs_X509_t *ref_cert(u2fs_X509_t * cert);
+u2fs_EC_KEY_t *ref_key(u2fs_EC_KEY_t * key);
+
+u2fs_rc load_X509_store(const char *file, const char *dir,
+                        u2fs_X509_STORE_t ** store);
+void free_X509_store(u2fs_X509_STORE_t * store);
+u2fs_rc verify_X509_chain(u2fs_X509_STORE_t * store,
+                          const u2fs_X509_t * cert, time_t * valid_until);
 
 u2fs_rc dump_user_key(const u2fs_EC_KEY_t * key, char **output);
-u2fs_rc dump_X509_cert(const u2fs_X509_t * cert, char **output);
+u2fs_rc dump_X509_der(const unsigned char *der, size_t len, char **output);
 
 #endif
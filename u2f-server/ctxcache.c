@@ -0,0 +1,175 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Contexts kept per thread for u2fs_ctx_acquire().  A cached context
+ * has been through u2fs_reset() and lost everything it borrowed or
+ * was configured with, so only its key handle buffer is left.  The
+ * cache of a thread is released when the thread exits, and that of
+ * the thread calling the last u2fs_global_done() right then.
+ */
+
+#include "ctxcache.h"
+#include "crypto.h"
+
+#include <pthread.h>
+
+#define CTX_CACHE_MAX 8
+
+struct ctx_cache {
+  size_t count;
+  u2fs_ctx_t *ctx[CTX_CACHE_MAX];
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_ready;
+
+static void cache_free(void *data)
+{
+  struct ctx_cache *cache = data;
+
+  while (cache->count > 0)
+    u2fs_done(cache->ctx[--cache->count]);
+  u2fs_free(cache);
+}
+
+static void cache_setup(void)
+{
+  cache_ready = pthread_key_create(&cache_key, cache_free) == 0;
+}
+
+static struct ctx_cache *get_cache(void)
+{
+  pthread_once(&cache_once, cache_setup);
+  if (!cache_ready)
+    return NULL;
+
+  return pthread_getspecific(cache_key);
+}
+
+/*
+ * Drop what u2fs_reset() keeps: the settings and the handles borrowed
+ * from the caller, which the next user of the context knows nothing
+ * about and which may be gone by then.
+ */
+static void ctx_detach(u2fs_ctx_t * ctx)
+{
+  u2fs_free(ctx->origin);
+  ctx->origin = NULL;
+  ctx->origin_len = 0;
+  u2fs_free(ctx->appid);
+  ctx->appid = NULL;
+  memset(ctx->application_parameter, 0,
+         sizeof(ctx->application_parameter));
+  ctx->rp = NULL;
+  ctx->store = NULL;
+  ctx->store_flags = 0;
+  ctx->counters = NULL;
+  ctx->certcache = NULL;
+  ctx->truststore = NULL;
+  ctx->stats = NULL;
+}
+
+/* Release the contexts cached by the calling thread. */
+void ctx_cache_flush(void)
+{
+  struct ctx_cache *cache = get_cache();
+
+  if (cache != NULL) {
+    pthread_setspecific(cache_key, NULL);
+    cache_free(cache);
+  }
+}
+
+/**
+ * u2fs_ctx_acquire:
+ * @ctx: pointer to output variable holding a context handle.
+ *
+ * Like u2fs_init(), but reuse a context the calling thread gave back
+ * with u2fs_ctx_release() when there is one.  Such a context is in the
+ * state u2fs_init() leaves it in, except that it may already hold the
+ * memory for a key handle.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_ctx_acquire(u2fs_ctx_t ** ctx)
+{
+  struct ctx_cache *cache;
+
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  cache = get_cache();
+  if (cache != NULL && cache->count > 0) {
+    *ctx = cache->ctx[--cache->count];
+    return U2FS_OK;
+  }
+
+  return u2fs_init(ctx);
+}
+
+/**
+ * u2fs_ctx_release:
+ * @ctx: a context handle, from u2fs_ctx_acquire() or u2fs_init()
+ *
+ * Reset @ctx with u2fs_reset(), detach its relying party settings,
+ * store, counters, caches and statistics, and keep it for the next
+ * u2fs_ctx_acquire() on the calling thread.  If the thread already
+ * keeps enough contexts, @ctx is released with u2fs_done() instead.
+ * Cached contexts are released when the thread exits, or by the last
+ * u2fs_global_done() for the thread calling it.
+ */
+void u2fs_ctx_release(u2fs_ctx_t * ctx)
+{
+  struct ctx_cache *cache;
+
+  if (ctx == NULL)
+    return;
+
+  u2fs_reset(ctx);
+  ctx_detach(ctx);
+
+  cache = get_cache();
+  if (cache == NULL && cache_ready) {
+    cache = u2fs_calloc(1, sizeof(*cache));
+    if (cache != NULL && pthread_setspecific(cache_key, cache) != 0) {
+      u2fs_free(cache);
+      cache = NULL;
+    }
+  }
+
+  if (cache == NULL || cache->count == CTX_CACHE_MAX) {
+    u2fs_done(ctx);
+    return;
+  }
+
+  cache->ctx[cache->count++] = ctx;
+}
@@ -46,7 +46,10 @@ static const err_t errors[] = {
   ERR(U2FS_ORIGIN_ERROR, "Origin mismatch"),
   ERR(U2FS_CHALLENGE_ERROR, "Challenge error"),
   ERR(U2FS_SIGNATURE_ERROR, "Unable to verify signature"),
-  ERR(U2FS_FORMAT_ERROR, "Format mismatch")
+  ERR(U2FS_FORMAT_ERROR, "Format mismatch"),
+  ERR(U2FS_COUNTER_ERROR, "Signature counter did not increase"),
+  ERR(U2FS_ATTESTATION_ERROR, "Attestation certificate not trusted"),
+  ERR(U2FS_KEYHANDLE_ERROR, "Key handle mismatch")
 };
 
 /**
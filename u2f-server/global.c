@@ -29,38 +29,109 @@
 
 #include "internal.h"
 #include "crypto.h"
+#include "base64url.h"
+#include "sha256.h"
+#include "challenge.h"
+#include "ctxcache.h"
 
-int debug;
+#include <pthread.h>
+
+U2FS_ATOMIC int debug;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int global_refcount;
+
+struct u2fs_allocator allocator = { malloc, realloc, free };
 
 /**
  * u2fs_global_init:
  * @flags: initialization flags, ORed #u2fs_initflags.
  *
- * Initialize the library.  This function is not guaranteed to be
- * thread safe and must be invoked on application startup.
+ * Initialize the library.  This function is thread safe and may be
+ * called more than once, for example by each worker thread; every
+ * successful call must be matched by a call to u2fs_global_done().
+ * The library must be initialized before any other function is used.
+ *
+ * Once initialized, different contexts may be used concurrently from
+ * different threads.  A single #u2fs_ctx_t must not.  Relying party
+ * (#u2fs_rp_t) and public key (#u2fs_pubkey_t) handles are immutable
+ * and may be shared by any number of contexts in any threads.
  *
  * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
  * an #u2fs_rc error code.
  */
 u2fs_rc u2fs_global_init(u2fs_initflags flags)
 {
+  u2fs_rc rc = U2FS_OK;
+
+  pthread_mutex_lock(&global_lock);
+
   if (flags & U2FS_DEBUG)
     debug = 1;
 
-  crypto_init();
+  if (global_refcount == 0) {
+    base64url_init();
+    sha256_setup();
+    challenge_setup();
+    rc = crypto_init();
+  }
 
-  return U2FS_OK;
+  if (rc == U2FS_OK)
+    global_refcount++;
+
+  pthread_mutex_unlock(&global_lock);
+
+  return rc;
 }
 
 /**
  * u2fs_global_done:
  *
  * Release all resources from the library.  Call this function when no
- * further use of the library is needed.
+ * further use of the library is needed, once for every successful
+ * call to u2fs_global_init().  Resources are released by the last one.
  */
 void u2fs_global_done(void)
 {
-  debug = 0;
+  pthread_mutex_lock(&global_lock);
+
+  if (global_refcount > 0 && --global_refcount == 0) {
+    ctx_cache_flush();
+    debug = 0;
+    crypto_release();
+  }
+
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * u2fs_set_allocator:
+ * @malloc_func: allocation function, or NULL for malloc().
+ * @realloc_func: reallocation function, or NULL for realloc().
+ * @free_func: deallocation function, or NULL for free().
+ *
+ * Replace the functions used for every memory allocation made by the
+ * library itself, for example to keep them on a per-thread arena.
+ * Memory handed out by the library, like the strings returned by
+ * u2fs_registration_challenge(), is then obtained from @malloc_func
+ * and must be released with @free_func.  Allocations made internally
+ * by the JSON and crypto libraries are not affected.
+ *
+ * The callbacks must be safe to call from every thread using the
+ * library.  This function is not thread safe and must only be called
+ * while no object created by the library is alive, typically before
+ * u2fs_global_init().
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_allocator(u2fs_malloc_func malloc_func,
+                           u2fs_realloc_func realloc_func,
+                           u2fs_free_func free_func)
+{
+  allocator.malloc = malloc_func ? malloc_func : malloc;
+  allocator.realloc = realloc_func ? realloc_func : realloc;
+  allocator.free = free_func ? free_func : free;
 
-  crypto_release();
+  return U2FS_OK;
 }
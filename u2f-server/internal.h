@@ -33,26 +33,113 @@
 #include <u2f-server/u2f-server.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef void *u2fs_ECDSA_t;
 typedef void *u2fs_X509_t;
 typedef void *u2fs_EC_KEY_t;
+typedef void *u2fs_X509_STORE_t;
 
-extern int debug;
+/*
+ * Set by u2fs_global_init() and read everywhere, possibly from many
+ * threads at once.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+  && !defined(__STDC_NO_ATOMICS__)
+#define U2FS_ATOMIC _Atomic
+#else
+#define U2FS_ATOMIC volatile
+#endif
+
+extern U2FS_ATOMIC int debug;
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define U2FS_THREAD_LOCAL _Thread_local
+#else
+#define U2FS_THREAD_LOCAL __thread
+#endif
+
+struct u2fs_allocator {
+  u2fs_malloc_func malloc;
+  u2fs_realloc_func realloc;
+  u2fs_free_func free;
+};
+
+extern struct u2fs_allocator allocator;
+
+/* All library allocations go through these, see u2fs_set_allocator(). */
+
+static inline void *u2fs_malloc(size_t size)
+{
+  return allocator.malloc(size);
+}
+
+static inline void *u2fs_calloc(size_t nmemb, size_t size)
+{
+  void *p;
+
+  if (size != 0 && nmemb > (size_t) - 1 / size)
+    return NULL;
+
+  p = allocator.malloc(nmemb * size);
+  if (p != NULL)
+    memset(p, 0, nmemb * size);
+
+  return p;
+}
+
+static inline void *u2fs_realloc(void *ptr, size_t size)
+{
+  return allocator.realloc(ptr, size);
+}
+
+static inline void u2fs_free(void *ptr)
+{
+  if (ptr != NULL)
+    allocator.free(ptr);
+}
+
+static inline char *u2fs_strndup(const char *s, size_t n)
+{
+  size_t len = strnlen(s, n);
+  char *p;
+
+  p = allocator.malloc(len + 1);
+  if (p != NULL) {
+    memcpy(p, s, len);
+    p[len] = '\0';
+  }
+
+  return p;
+}
+
+static inline char *u2fs_strdup(const char *s)
+{
+  return u2fs_strndup(s, strlen(s));
+}
 
 #define _SHA256_LEN 32
 #define _B64_BUFSIZE 2048
+#define _SCRATCH_BUFSIZE 4096
 
 #define U2F_VERSION "U2F_V2"
 #define U2FS_HASH_LEN _SHA256_LEN
+/* A P-256 ECDSA signature as the fixed-width concatenation r || s. */
+#define U2FS_ECDSA_RAW_LEN 64
 
+/*
+ * The raw bytes live in the same allocation as the structure; the
+ * encoded strings are derived from them by the getters on first use.
+ */
 struct u2fs_reg_res {
   char *keyHandle;
-  char *publicKey;
-  u2fs_X509_t *attestation_certificate;
-
   char *attestation_certificate_PEM;
-  u2fs_EC_KEY_t *user_public_key;
+
+  unsigned char *keyHandle_raw;
+  size_t keyHandle_len;
+  unsigned char *attestation_certificate;
+  size_t attestation_certificate_len;
+  unsigned char publicKey[U2FS_PUBLIC_KEY_LEN];
 };
 
 struct u2fs_auth_res {
@@ -61,12 +148,37 @@ struct u2fs_auth_res {
   uint8_t user_presence;
 };
 
+struct u2fs_rp {
+  char *origin;
+  size_t origin_len;
+  char *appid;
+  unsigned char application_parameter[U2FS_HASH_LEN];
+};
+
+struct u2fs_pubkey {
+  u2fs_EC_KEY_t *key;
+  unsigned char publicKey[U2FS_PUBLIC_KEY_LEN];
+};
+
 struct u2fs_ctx {
   char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
-  char *keyHandle;
+  unsigned char challenge_raw[U2FS_CHALLENGE_RAW_LEN];
+  char *keyHandle;              /* keyHandle_buf once set, else NULL */
+  char *keyHandle_buf;
+  size_t keyHandle_size;
   u2fs_EC_KEY_t *key;
   char *origin;
+  size_t origin_len;
   char *appid;
+  unsigned char application_parameter[U2FS_HASH_LEN];
+  const u2fs_rp_t *rp;
+  const u2fs_pubkey_t *pubkey;
+  u2fs_store_t *store;
+  u2fs_storeflags store_flags;
+  u2fs_counters_t *counters;
+  u2fs_certcache_t *certcache;
+  u2fs_truststore_t *truststore;
+  u2fs_stats_t *stats;
 };
 
 #endif
@@ -0,0 +1,346 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Keys and signatures on the EC_KEY and ECDSA_SIG API.  The API is
+ * deprecated in OpenSSL 3.0, but it decodes keys several times faster
+ * than the EVP backend there.
+ */
+
+#include "crypto.h"
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <openssl/ecdsa.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+
+/*
+ * The P-256 group, built once by crypto_init().  EC_KEY_set_group()
+ * still gives every key its own copy, but copying a group is an order
+ * of magnitude cheaper than constructing one by curve name.
+ */
+static EC_GROUP *p256;
+
+/*
+ * Return the shared group, or a temporary one in *tmp (to be freed by
+ * the caller) if crypto_init() has not been called.
+ */
+static const EC_GROUP *get_group(EC_GROUP ** tmp)
+{
+  *tmp = NULL;
+
+  if (p256 != NULL)
+    return p256;
+
+  *tmp = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+
+  return *tmp;
+}
+
+u2fs_rc key_init(void)
+{
+  if (p256 != NULL)
+    return U2FS_OK;
+
+  p256 = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+  if (p256 == NULL)
+    return U2FS_CRYPTO_ERROR;
+
+  EC_GROUP_set_asn1_flag(p256, OPENSSL_EC_NAMED_CURVE);
+  EC_GROUP_set_point_conversion_form(p256, POINT_CONVERSION_UNCOMPRESSED);
+
+  return U2FS_OK;
+}
+
+void key_release(void)
+{
+  EC_GROUP_free(p256);
+  p256 = NULL;
+}
+
+u2fs_rc decode_user_key(const unsigned char *data, u2fs_EC_KEY_t ** key)
+{
+  EC_GROUP *tmp;
+  const EC_GROUP *ecg;
+  EC_KEY *eckey = NULL;
+  EC_POINT *point = NULL;
+
+  if (key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  *key = NULL;
+
+  ecg = get_group(&tmp);
+  if (ecg == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  eckey = EC_KEY_new();
+  point = EC_POINT_new(ecg);
+  if (eckey == NULL || point == NULL || EC_KEY_set_group(eckey, ecg) == 0) {
+    EC_KEY_free(eckey);
+    EC_POINT_free(point);
+    EC_GROUP_free(tmp);
+    return U2FS_MEMORY_ERROR;
+  }
+
+  if (EC_POINT_oct2point(ecg, point, data, U2FS_PUBLIC_KEY_LEN, NULL) == 0
+      || EC_KEY_set_public_key(eckey, point) == 0) {
+    if (debug) {
+      unsigned long err = 0;
+      err = ERR_get_error();
+      fprintf(stderr, "Error: %s, %s, %s\n",
+              ERR_lib_error_string(err),
+              ERR_func_error_string(err), ERR_reason_error_string(err));
+    }
+    EC_KEY_free(eckey);
+    EC_POINT_free(point);
+    EC_GROUP_free(tmp);
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  EC_POINT_free(point);
+  point = NULL;
+  EC_GROUP_free(tmp);
+  tmp = NULL;
+
+  *key = (u2fs_EC_KEY_t *) eckey;
+
+  return U2FS_OK;
+
+}
+
+/* Expand the compressed point at @data into its 65-byte form. */
+u2fs_rc decompress_user_key(const unsigned char *data, unsigned char *output)
+{
+  EC_GROUP *tmp;
+  const EC_GROUP *ecg;
+  EC_POINT *point;
+  u2fs_rc rc = U2FS_OK;
+
+  if (data == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ecg = get_group(&tmp);
+  if (ecg == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  point = EC_POINT_new(ecg);
+  if (point == NULL) {
+    EC_GROUP_free(tmp);
+    return U2FS_MEMORY_ERROR;
+  }
+
+  if (EC_POINT_oct2point(ecg, point, data, U2FS_COMPRESSED_KEY_LEN,
+                         NULL) == 0
+      || EC_POINT_point2oct(ecg, point, POINT_CONVERSION_UNCOMPRESSED,
+                            output, U2FS_PUBLIC_KEY_LEN,
+                            NULL) != U2FS_PUBLIC_KEY_LEN) {
+    if (debug) {
+      unsigned long err = 0;
+      err = ERR_get_error();
+      fprintf(stderr, "Error: %s, %s, %s\n",
+              ERR_lib_error_string(err),
+              ERR_func_error_string(err), ERR_reason_error_string(err));
+    }
+    rc = U2FS_CRYPTO_ERROR;
+  }
+
+  EC_POINT_free(point);
+  EC_GROUP_free(tmp);
+
+  return rc;
+}
+
+u2fs_rc verify_ECDSA(const unsigned char *dgst, int dgst_len,
+                     const u2fs_ECDSA_t * sig, u2fs_EC_KEY_t * eckey)
+{
+  if (dgst == NULL || dgst_len == 0 || sig == NULL || eckey == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  int rc =
+      ECDSA_do_verify(dgst, dgst_len, (ECDSA_SIG *) sig, (EC_KEY *) eckey);
+
+  if (rc != 1) {
+    if (rc == -1) {
+      if (debug) {
+        unsigned long err = 0;
+        err = ERR_get_error();
+        fprintf(stderr, "Error: %s, %s, %s\n",
+                ERR_lib_error_string(err),
+                ERR_func_error_string(err), ERR_reason_error_string(err));
+      }
+      return U2FS_CRYPTO_ERROR;
+    } else {
+      return U2FS_SIGNATURE_ERROR;
+    }
+  }
+
+  return U2FS_OK;
+}
+
+/* Verify a signature given as the big-endian concatenation r || s. */
+u2fs_rc verify_ECDSA_raw(const unsigned char *dgst, int dgst_len,
+                         const unsigned char *sig, u2fs_EC_KEY_t * eckey)
+{
+  ECDSA_SIG *ecsig;
+  BIGNUM *r, *s;
+  u2fs_rc rc;
+
+  if (sig == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ecsig = ECDSA_SIG_new();
+  r = BN_bin2bn(sig, U2FS_ECDSA_RAW_LEN / 2, NULL);
+  s = BN_bin2bn(sig + U2FS_ECDSA_RAW_LEN / 2, U2FS_ECDSA_RAW_LEN / 2, NULL);
+  if (ecsig == NULL || r == NULL || s == NULL
+      || ECDSA_SIG_set0(ecsig, r, s) == 0) {
+    ECDSA_SIG_free(ecsig);
+    BN_free(r);
+    BN_free(s);
+    return U2FS_MEMORY_ERROR;
+  }
+
+  rc = verify_ECDSA(dgst, dgst_len, (u2fs_ECDSA_t *) ecsig, eckey);
+  ECDSA_SIG_free(ecsig);
+
+  return rc;
+}
+
+u2fs_rc extract_EC_KEY_from_X509(const u2fs_X509_t * cert,
+                                 u2fs_EC_KEY_t ** key)
+{
+  if (cert == NULL || key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  EVP_PKEY *pkey = X509_get_pubkey((X509 *) cert);
+
+  if (pkey == NULL) {
+    if (debug) {
+      unsigned long err = 0;
+      err = ERR_get_error();
+      fprintf(stderr, "Error: %s, %s, %s\n",
+              ERR_lib_error_string(err),
+              ERR_func_error_string(err), ERR_reason_error_string(err));
+    }
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  *key = (u2fs_EC_KEY_t *) EVP_PKEY_get1_EC_KEY(pkey);
+
+  EVP_PKEY_free(pkey);
+  pkey = NULL;
+
+  if (*key == NULL) {
+    if (debug) {
+      unsigned long err = 0;
+      err = ERR_get_error();
+      fprintf(stderr, "Error: %s, %s, %s\n",
+              ERR_lib_error_string(err),
+              ERR_func_error_string(err), ERR_reason_error_string(err));
+    }
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  EC_GROUP *tmp;
+  const EC_GROUP *ecg = get_group(&tmp);
+
+  if (ecg == NULL) {
+    EC_KEY_free((EC_KEY *) * key);
+    *key = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  EC_KEY_set_asn1_flag((EC_KEY *) * key, OPENSSL_EC_NAMED_CURVE);
+  EC_KEY_set_group((EC_KEY *) * key, ecg);
+
+  EC_GROUP_free(tmp);
+  tmp = NULL;
+
+  return U2FS_OK;
+}
+
+u2fs_EC_KEY_t *dup_key(const u2fs_EC_KEY_t * key)
+{
+  return (u2fs_EC_KEY_t *) EC_KEY_dup((EC_KEY *) key);
+}
+
+void free_key(u2fs_EC_KEY_t * key)
+{
+  EC_KEY_free((EC_KEY *) key);
+}
+
+/* Take another reference to @key, to be released with free_key(). */
+u2fs_EC_KEY_t *ref_key(u2fs_EC_KEY_t * key)
+{
+  EC_KEY_up_ref((EC_KEY *) key);
+  return key;
+}
+
+u2fs_rc dump_user_key(const u2fs_EC_KEY_t * key, char **output)
+{
+  //TODO add PEM - current output is openssl octet string
+
+  EC_GROUP *tmp;
+  const EC_GROUP *ecg;
+  point_conversion_form_t pcf = POINT_CONVERSION_UNCOMPRESSED;
+
+  if (key == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ecg = get_group(&tmp);
+  if (ecg == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  const EC_POINT *point = EC_KEY_get0_public_key((EC_KEY *) key);
+
+  *output = u2fs_malloc(U2FS_PUBLIC_KEY_LEN);
+
+  if (*output == NULL) {
+    EC_GROUP_free(tmp);
+    tmp = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  if (EC_POINT_point2oct
+      (ecg, point, pcf, (unsigned char *) *output, U2FS_PUBLIC_KEY_LEN,
+       NULL) != U2FS_PUBLIC_KEY_LEN) {
+    EC_GROUP_free(tmp);
+    tmp = NULL;
+    u2fs_free(*output);
+    *output = NULL;
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  EC_GROUP_free(tmp);
+  tmp = NULL;
+
+  return U2FS_OK;
+
+}
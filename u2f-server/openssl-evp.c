@@ -0,0 +1,355 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Keys and signatures on the EVP_PKEY API of OpenSSL 3.0 and later.
+ * The P-256 key manager, and from 3.4 on the ECDSA implementation, are
+ * fetched once by key_init() rather than looked up by name for every
+ * key and every verification.
+ */
+
+#include "crypto.h"
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#error "the EVP crypto backend needs OpenSSL 3.0 or later"
+#endif
+
+#define P256_NAME "prime256v1"
+
+/* Largest DER encoding of a P-256 signature: two 33-byte INTEGERs. */
+#define ECDSA_DER_MAX_LEN (2 + 2 * (2 + U2FS_ECDSA_RAW_LEN / 2 + 1))
+
+/* P-256 domain parameters, the template every decoded key is made from. */
+static EVP_PKEY *p256;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30400000L
+static EVP_SIGNATURE *ecdsa;
+#endif
+
+static void debug_error(void)
+{
+  if (debug) {
+    unsigned long err = ERR_get_error();
+    fprintf(stderr, "Error: %s, %s\n", ERR_lib_error_string(err),
+            ERR_reason_error_string(err));
+  }
+}
+
+u2fs_rc key_init(void)
+{
+  EVP_PKEY_CTX *ctx;
+
+  if (p256 != NULL)
+    return U2FS_OK;
+
+  ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (EVP_PKEY_paramgen_init(ctx) <= 0
+      || EVP_PKEY_CTX_set_group_name(ctx, P256_NAME) <= 0
+      || EVP_PKEY_paramgen(ctx, &p256) <= 0) {
+    debug_error();
+    EVP_PKEY_CTX_free(ctx);
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  EVP_PKEY_CTX_free(ctx);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30400000L
+  ecdsa = EVP_SIGNATURE_fetch(NULL, "ECDSA", NULL);
+  if (ecdsa == NULL) {
+    debug_error();
+    EVP_PKEY_free(p256);
+    p256 = NULL;
+    return U2FS_CRYPTO_ERROR;
+  }
+#endif
+
+  return U2FS_OK;
+}
+
+void key_release(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30400000L
+  EVP_SIGNATURE_free(ecdsa);
+  ecdsa = NULL;
+#endif
+  EVP_PKEY_free(p256);
+  p256 = NULL;
+}
+
+/*
+ * Make a public key from the encoded point @data of @len bytes.  The
+ * point is checked to be on the curve.
+ */
+static u2fs_rc new_key(const unsigned char *data, size_t len,
+                       EVP_PKEY ** key)
+{
+  OSSL_PARAM params[3];
+  EVP_PKEY_CTX *ctx;
+  u2fs_rc rc = U2FS_OK;
+
+  *key = NULL;
+
+  if (p256 != NULL)
+    ctx = EVP_PKEY_CTX_new_from_pkey(NULL, p256, NULL);
+  else
+    ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+
+  if (ctx == NULL || EVP_PKEY_fromdata_init(ctx) <= 0) {
+    EVP_PKEY_CTX_free(ctx);
+    return U2FS_MEMORY_ERROR;
+  }
+
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME,
+                                               (char *) P256_NAME, 0);
+  params[1] = OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY,
+                                                (void *) data, len);
+  params[2] = OSSL_PARAM_construct_end();
+
+  if (EVP_PKEY_fromdata(ctx, key, EVP_PKEY_PUBLIC_KEY, params) <= 0) {
+    debug_error();
+    rc = U2FS_CRYPTO_ERROR;
+  }
+
+  EVP_PKEY_CTX_free(ctx);
+
+  return rc;
+}
+
+u2fs_rc decode_user_key(const unsigned char *data, u2fs_EC_KEY_t ** key)
+{
+  EVP_PKEY *pkey;
+  u2fs_rc rc;
+
+  if (data == NULL || key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = new_key(data, U2FS_PUBLIC_KEY_LEN, &pkey);
+  *key = (u2fs_EC_KEY_t *) pkey;
+
+  return rc;
+}
+
+/* Expand the compressed point at @data into its 65-byte form. */
+u2fs_rc decompress_user_key(const unsigned char *data, unsigned char *output)
+{
+  EVP_PKEY *pkey;
+  size_t len;
+  u2fs_rc rc;
+
+  if (data == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = new_key(data, U2FS_COMPRESSED_KEY_LEN, &pkey);
+  if (rc != U2FS_OK)
+    return rc;
+
+  if (EVP_PKEY_set_utf8_string_param(pkey,
+                                     OSSL_PKEY_PARAM_EC_POINT_CONVERSION_FORMAT,
+                                     OSSL_PKEY_EC_POINT_CONVERSION_FORMAT_UNCOMPRESSED)
+      != 1
+      || EVP_PKEY_get_octet_string_param(pkey,
+                                         OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY,
+                                         output, U2FS_PUBLIC_KEY_LEN,
+                                         &len) != 1
+      || len != U2FS_PUBLIC_KEY_LEN) {
+    debug_error();
+    rc = U2FS_CRYPTO_ERROR;
+  }
+
+  EVP_PKEY_free(pkey);
+
+  return rc;
+}
+
+/* Verify the DER signature @der of @der_len bytes over @dgst. */
+static u2fs_rc verify_der(const unsigned char *dgst, int dgst_len,
+                          const unsigned char *der, size_t der_len,
+                          EVP_PKEY * key)
+{
+  EVP_PKEY_CTX *ctx;
+  int rc;
+
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, key, NULL);
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30400000L
+  if (ecdsa != NULL)
+    rc = EVP_PKEY_verify_init_ex2(ctx, ecdsa, NULL);
+  else
+#endif
+    rc = EVP_PKEY_verify_init(ctx);
+
+  if (rc > 0)
+    rc = EVP_PKEY_verify(ctx, der, der_len, dgst, dgst_len);
+  else
+    rc = -1;
+
+  EVP_PKEY_CTX_free(ctx);
+
+  if (rc == 1)
+    return U2FS_OK;
+
+  if (rc == 0)
+    return U2FS_SIGNATURE_ERROR;
+
+  debug_error();
+
+  return U2FS_CRYPTO_ERROR;
+}
+
+u2fs_rc verify_ECDSA(const unsigned char *dgst, int dgst_len,
+                     const u2fs_ECDSA_t * sig, u2fs_EC_KEY_t * eckey)
+{
+  unsigned char *der = NULL;
+  int der_len;
+  u2fs_rc rc;
+
+  if (dgst == NULL || dgst_len == 0 || sig == NULL || eckey == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  der_len = i2d_ECDSA_SIG((const ECDSA_SIG *) sig, &der);
+  if (der_len <= 0)
+    return U2FS_MEMORY_ERROR;
+
+  rc = verify_der(dgst, dgst_len, der, der_len, (EVP_PKEY *) eckey);
+  OPENSSL_free(der);
+
+  return rc;
+}
+
+/* Write the big-endian scalar @in as a minimal DER INTEGER to @out. */
+static size_t put_integer(const unsigned char *in, unsigned char *out)
+{
+  size_t i = 0, len, pad;
+
+  while (i < U2FS_ECDSA_RAW_LEN / 2 - 1 && in[i] == 0x00)
+    i++;
+
+  len = U2FS_ECDSA_RAW_LEN / 2 - i;
+  pad = (in[i] & 0x80) ? 1 : 0;
+
+  out[0] = 0x02;
+  out[1] = len + pad;
+  out[2] = 0x00;
+  memcpy(out + 2 + pad, in + i, len);
+
+  return 2 + pad + len;
+}
+
+/*
+ * Verify a signature given as the big-endian concatenation r || s.
+ * It is DER encoded on the stack, which is what the provider takes.
+ */
+u2fs_rc verify_ECDSA_raw(const unsigned char *dgst, int dgst_len,
+                         const unsigned char *sig, u2fs_EC_KEY_t * eckey)
+{
+  unsigned char der[ECDSA_DER_MAX_LEN];
+  size_t len;
+
+  if (dgst == NULL || dgst_len == 0 || sig == NULL || eckey == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  len = 2;
+  len += put_integer(sig, der + len);
+  len += put_integer(sig + U2FS_ECDSA_RAW_LEN / 2, der + len);
+  der[0] = 0x30;
+  der[1] = len - 2;
+
+  return verify_der(dgst, dgst_len, der, len, (EVP_PKEY *) eckey);
+}
+
+u2fs_rc extract_EC_KEY_from_X509(const u2fs_X509_t * cert,
+                                 u2fs_EC_KEY_t ** key)
+{
+  EVP_PKEY *pkey;
+
+  if (cert == NULL || key == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  pkey = X509_get_pubkey((X509 *) cert);
+  if (pkey == NULL || !EVP_PKEY_is_a(pkey, "EC")) {
+    debug_error();
+    EVP_PKEY_free(pkey);
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  *key = (u2fs_EC_KEY_t *) pkey;
+
+  return U2FS_OK;
+}
+
+u2fs_EC_KEY_t *dup_key(const u2fs_EC_KEY_t * key)
+{
+  return (u2fs_EC_KEY_t *) EVP_PKEY_dup((EVP_PKEY *) key);
+}
+
+void free_key(u2fs_EC_KEY_t * key)
+{
+  EVP_PKEY_free((EVP_PKEY *) key);
+}
+
+/* Take another reference to @key, to be released with free_key(). */
+u2fs_EC_KEY_t *ref_key(u2fs_EC_KEY_t * key)
+{
+  EVP_PKEY_up_ref((EVP_PKEY *) key);
+  return key;
+}
+
+u2fs_rc dump_user_key(const u2fs_EC_KEY_t * key, char **output)
+{
+  size_t len;
+
+  if (key == NULL || output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  *output = u2fs_malloc(U2FS_PUBLIC_KEY_LEN);
+  if (*output == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  if (EVP_PKEY_get_octet_string_param((const EVP_PKEY *) key,
+                                      OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY,
+                                      (unsigned char *) *output,
+                                      U2FS_PUBLIC_KEY_LEN, &len) != 1
+      || len != U2FS_PUBLIC_KEY_LEN) {
+    u2fs_free(*output);
+    *output = NULL;
+    return U2FS_CRYPTO_ERROR;
+  }
+
+  return U2FS_OK;
+}
@@ -38,6 +38,8 @@
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
+#include <pthread.h>
+
 void dumpCert(const u2fs_X509_t * certificate)
 {
   X509 *cert = (X509 *) certificate;
@@ -49,20 +51,89 @@ void dumpCert(const u2fs_X509_t * certificate)
   BIO_free(out);
 }
 
-void crypto_init(void)
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * Before 1.1.0 OpenSSL needs locking callbacks to be thread safe.  They
+ * are only installed when the application has not done so itself.
+ */
+static pthread_mutex_t *ssl_locks;
+
+static void ssl_locking(int mode, int n, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&ssl_locks[n]);
+  else
+    pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long ssl_thread_id(void)
+{
+  return (unsigned long) pthread_self();
+}
+
+static u2fs_rc ssl_locks_init(void)
+{
+  int i;
+
+  if (CRYPTO_get_locking_callback() != NULL)
+    return U2FS_OK;
+
+  ssl_locks = u2fs_calloc(CRYPTO_num_locks(), sizeof(*ssl_locks));
+  if (ssl_locks == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_init(&ssl_locks[i], NULL);
+
+  CRYPTO_set_id_callback(ssl_thread_id);
+  CRYPTO_set_locking_callback(ssl_locking);
+
+  return U2FS_OK;
+}
+
+static void ssl_locks_release(void)
+{
+  int i;
+
+  if (ssl_locks == NULL)
+    return;
+
+  CRYPTO_set_locking_callback(NULL);
+  CRYPTO_set_id_callback(NULL);
+
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_destroy(&ssl_locks[i]);
+
+  u2fs_free(ssl_locks);
+  ssl_locks = NULL;
+}
+#endif
+
+u2fs_rc crypto_init(void)
 {
   /* Crypto init functions are deprecated in openssl-1.1.0 */
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
+  u2fs_rc rc;
+
    SSL_load_error_strings();
+
+  rc = ssl_locks_init();
+  if (rc != U2FS_OK)
+    return rc;
 #endif
+
+  return key_init();
 }
 
 void crypto_release(void)
 {
+  key_release();
+
   /* Crypto deinit functions are deprecated in openssl-1.1.0. */
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
   RAND_cleanup();
   ERR_free_strings();
+  ssl_locks_release();
 #endif
 }
 
@@ -79,6 +150,19 @@ u2fs_rc set_random_bytes(char *data, size_t len)
 
 }
 
+/* Clear @data in a way the compiler cannot optimize away. */
+void cleanse_bytes(void *data, size_t len)
+{
+  if (data != NULL)
+    OPENSSL_cleanse(data, len);
+}
+
+/* Compare @len bytes in time independent of their contents. */
+int equal_bytes(const void *a, const void *b, size_t len)
+{
+  return CRYPTO_memcmp(a, b, len) == 0;
+}
+
 u2fs_rc decode_X509(const unsigned char *data, size_t len,
                     u2fs_X509_t ** cert)
 {
@@ -133,226 +217,148 @@ u2fs_rc decode_ECDSA(const unsigned char *data, size_t len,
   return U2FS_OK;
 }
 
-u2fs_rc decode_user_key(const unsigned char *data, u2fs_EC_KEY_t ** key)
+/* Take another reference to @cert, to be released with free_cert(). */
+u2fs_X509_t *ref_cert(u2fs_X509_t * cert)
 {
-
-  if (key == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  EC_GROUP *ecg = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-  *key = (u2fs_EC_KEY_t *) EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-
-  EC_POINT *point = EC_POINT_new(ecg);
-  point_conversion_form_t pcf = POINT_CONVERSION_UNCOMPRESSED;
-  EC_GROUP_set_point_conversion_form(ecg, pcf);
-
-  if (EC_POINT_oct2point(ecg, point, data, U2FS_PUBLIC_KEY_LEN, NULL) == 0) {
-    if (debug) {
-      unsigned long err = 0;
-      err = ERR_get_error();
-      fprintf(stderr, "Error: %s, %s, %s\n",
-              ERR_lib_error_string(err),
-              ERR_func_error_string(err), ERR_reason_error_string(err));
-    }
-    *key = NULL;
-    EC_GROUP_free(ecg);
-    ecg = NULL;
-    EC_POINT_free(point);
-    point = NULL;
-    return U2FS_CRYPTO_ERROR;
-  }
-
-  EC_GROUP_free(ecg);
-  ecg = NULL;
-
-  if (EC_KEY_set_public_key((EC_KEY *) * key, point) == 0) {
-    if (debug) {
-      unsigned long err = 0;
-      err = ERR_get_error();
-      fprintf(stderr, "Error: %s, %s, %s\n",
-              ERR_lib_error_string(err),
-              ERR_func_error_string(err), ERR_reason_error_string(err));
-    }
-    *key = NULL;
-    EC_POINT_free(point);
-    point = NULL;
-    return U2FS_CRYPTO_ERROR;
-  }
-
-  EC_POINT_free(point);
-  point = NULL;
-
-  return U2FS_OK;
-
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&((X509 *) cert)->references, 1, CRYPTO_LOCK_X509);
+#else
+  X509_up_ref((X509 *) cert);
+#endif
+  return cert;
 }
 
-u2fs_rc verify_ECDSA(const unsigned char *dgst, int dgst_len,
-                     const u2fs_ECDSA_t * sig, u2fs_EC_KEY_t * eckey)
+void free_cert(u2fs_X509_t * cert)
 {
-  if (dgst == NULL || dgst_len == 0 || sig == NULL || eckey == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  int rc =
-      ECDSA_do_verify(dgst, dgst_len, (ECDSA_SIG *) sig, (EC_KEY *) eckey);
-
-  if (rc != 1) {
-    if (rc == -1) {
-      if (debug) {
-        unsigned long err = 0;
-        err = ERR_get_error();
-        fprintf(stderr, "Error: %s, %s, %s\n",
-                ERR_lib_error_string(err),
-                ERR_func_error_string(err), ERR_reason_error_string(err));
-      }
-      return U2FS_CRYPTO_ERROR;
-    } else {
-      return U2FS_SIGNATURE_ERROR;
-    }
-  }
-
-  return U2FS_OK;
+  X509_free((X509 *) cert);
 }
 
-u2fs_rc extract_EC_KEY_from_X509(const u2fs_X509_t * cert,
-                                 u2fs_EC_KEY_t ** key)
+void free_sig(u2fs_ECDSA_t * sig)
 {
-  if (cert == NULL || key == NULL)
-    return U2FS_MEMORY_ERROR;
-
-  EVP_PKEY *pkey = X509_get_pubkey((X509 *) cert);
+  ECDSA_SIG_free((ECDSA_SIG *) sig);
+}
 
-  if (pkey == NULL) {
-    if (debug) {
-      unsigned long err = 0;
-      err = ERR_get_error();
-      fprintf(stderr, "Error: %s, %s, %s\n",
-              ERR_lib_error_string(err),
-              ERR_func_error_string(err), ERR_reason_error_string(err));
-    }
-    return U2FS_CRYPTO_ERROR;
-  }
+/*
+ * Load the trusted certificates of the PEM bundle @file and/or the
+ * hashed directory @dir.  Every certificate loaded is a trust anchor,
+ * so vendor intermediates can be trusted without their root.
+ */
+u2fs_rc load_X509_store(const char *file, const char *dir,
+                        u2fs_X509_STORE_t ** store)
+{
+  X509_STORE *s;
 
-  *key = (u2fs_EC_KEY_t *) EVP_PKEY_get1_EC_KEY(pkey);
+  if (store == NULL || (file == NULL && dir == NULL))
+    return U2FS_MEMORY_ERROR;
 
-  EVP_PKEY_free(pkey);
-  pkey = NULL;
+  s = X509_STORE_new();
+  if (s == NULL)
+    return U2FS_MEMORY_ERROR;
 
-  if (*key == NULL) {
+  if (X509_STORE_load_locations(s, file, dir) != 1) {
     if (debug) {
-      unsigned long err = 0;
-      err = ERR_get_error();
+      unsigned long err = ERR_get_error();
       fprintf(stderr, "Error: %s, %s, %s\n",
               ERR_lib_error_string(err),
               ERR_func_error_string(err), ERR_reason_error_string(err));
     }
+    X509_STORE_free(s);
     return U2FS_CRYPTO_ERROR;
   }
 
-  EC_GROUP *ecg = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-
-  EC_KEY_set_asn1_flag((EC_KEY *) * key, OPENSSL_EC_NAMED_CURVE);
-  EC_KEY_set_group((EC_KEY *) * key, ecg);
+  X509_STORE_set_flags(s, X509_V_FLAG_PARTIAL_CHAIN);
 
-  EC_GROUP_free(ecg);
-  ecg = NULL;
+  *store = (u2fs_X509_STORE_t *) s;
 
   return U2FS_OK;
 }
 
-u2fs_EC_KEY_t *dup_key(const u2fs_EC_KEY_t * key)
-{
-  return (u2fs_EC_KEY_t *) EC_KEY_dup((EC_KEY *) key);
-}
-
-void free_key(u2fs_EC_KEY_t * key)
-{
-  EC_KEY_free((EC_KEY *) key);
-}
-
-u2fs_X509_t *dup_cert(const u2fs_X509_t * cert)
-{
-  return (u2fs_X509_t *) X509_dup((X509 *) cert);
-}
-
-void free_cert(u2fs_X509_t * cert)
+void free_X509_store(u2fs_X509_STORE_t * store)
 {
-  X509_free((X509 *) cert);
+  X509_STORE_free((X509_STORE *) store);
 }
 
-void free_sig(u2fs_ECDSA_t * sig)
-{
-  ECDSA_SIG_free((ECDSA_SIG *) sig);
-}
-
-u2fs_rc dump_user_key(const u2fs_EC_KEY_t * key, char **output)
+/*
+ * Verify @cert against @store.  On success *@valid_until is lowered to
+ * the first time any certificate of the chain expires, if earlier.
+ */
+u2fs_rc verify_X509_chain(u2fs_X509_STORE_t * store,
+                          const u2fs_X509_t * cert, time_t * valid_until)
 {
-  //TODO add PEM - current output is openssl octet string
-
-  if (key == NULL || output == NULL)
+  STACK_OF(X509) * chain;
+  X509_STORE_CTX *ctx;
+  int i, days, secs;
+  time_t now;
+  u2fs_rc rc = U2FS_ATTESTATION_ERROR;
+
+  ctx = X509_STORE_CTX_new();
+  if (ctx == NULL)
     return U2FS_MEMORY_ERROR;
 
-  EC_GROUP *ecg = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-  point_conversion_form_t pcf = POINT_CONVERSION_UNCOMPRESSED;
-
-  if (ecg == NULL)
+  if (X509_STORE_CTX_init(ctx, (X509_STORE *) store, (X509 *) cert,
+                          NULL) != 1) {
+    X509_STORE_CTX_free(ctx);
     return U2FS_MEMORY_ERROR;
+  }
 
-  const EC_POINT *point = EC_KEY_get0_public_key((EC_KEY *) key);
-
-  *output = malloc(U2FS_PUBLIC_KEY_LEN);
-
-  if (*output == NULL) {
-    EC_GROUP_free(ecg);
-    ecg = NULL;
-    return U2FS_MEMORY_ERROR;
+  if (X509_verify_cert(ctx) != 1) {
+    if (debug)
+      fprintf(stderr, "Attestation certificate: %s\n",
+              X509_verify_cert_error_string(X509_STORE_CTX_get_error(ctx)));
+    goto done;
   }
 
-  if (EC_POINT_point2oct
-      (ecg, point, pcf, (unsigned char *) *output, U2FS_PUBLIC_KEY_LEN,
-       NULL) != U2FS_PUBLIC_KEY_LEN) {
-    free(ecg);
-    ecg = NULL;
-    free(*output);
-    *output = NULL;
-    return U2FS_CRYPTO_ERROR;
+  now = time(NULL);
+  chain = X509_STORE_CTX_get1_chain(ctx);
+  for (i = 0; chain != NULL && i < sk_X509_num(chain); i++) {
+    if (ASN1_TIME_diff(&days, &secs, NULL,
+                       X509_get_notAfter(sk_X509_value(chain, i))) == 1
+        && now + days * 86400L + secs < *valid_until)
+      *valid_until = now + days * 86400L + secs;
   }
+  sk_X509_pop_free(chain, X509_free);
 
-  EC_GROUP_free(ecg);
-  ecg = NULL;
+  rc = U2FS_OK;
 
-  return U2FS_OK;
+done:
+  X509_STORE_CTX_free(ctx);
 
+  return rc;
 }
 
-u2fs_rc dump_X509_cert(const u2fs_X509_t * cert, char **output)
+#define PEM_HEADER "-----BEGIN CERTIFICATE-----\n"
+#define PEM_FOOTER "-----END CERTIFICATE-----\n"
+#define PEM_LINE 48
+
+/*
+ * PEM encode the DER certificate @der of @len bytes directly, in the
+ * same layout as PEM_write_bio_X509() but without decoding it first.
+ */
+u2fs_rc dump_X509_der(const unsigned char *der, size_t len, char **output)
 {
-  //input: openssl X509 certificate
-  //output: PEM-formatted char buffer
+  size_t lines, chunk;
+  char *p;
 
-  if (cert == NULL || output == NULL)
+  if (der == NULL || output == NULL)
     return U2FS_MEMORY_ERROR;
 
-  *output = NULL;
-
-  BIO *bio = BIO_new(BIO_s_mem());
-  if (bio == NULL)
+  lines = (len + PEM_LINE - 1) / PEM_LINE;
+  *output = u2fs_malloc(sizeof(PEM_HEADER) - 1 + lines * 65 +
+                        sizeof(PEM_FOOTER));
+  if (*output == NULL)
     return U2FS_MEMORY_ERROR;
 
-  if(!PEM_write_bio_X509(bio, (X509 *)cert)) {
-    BIO_free(bio);
-    return U2FS_CRYPTO_ERROR;
-  }
+  p = *output;
+  memcpy(p, PEM_HEADER, sizeof(PEM_HEADER) - 1);
+  p += sizeof(PEM_HEADER) - 1;
 
-  char *PEM_data;
-  int length = BIO_get_mem_data(bio, &PEM_data);
-  *output = malloc(length);
-  if (*output == NULL) {
-    BIO_free(bio);
-    return U2FS_MEMORY_ERROR;
+  for (; len > 0; der += chunk, len -= chunk) {
+    chunk = len < PEM_LINE ? len : PEM_LINE;
+    p += EVP_EncodeBlock((unsigned char *) p, der, (int) chunk);
+    *p++ = '\n';
   }
 
-  memcpy(*output, PEM_data, length);
-  BIO_free(bio);
+  memcpy(p, PEM_FOOTER, sizeof(PEM_FOOTER));
 
   return U2FS_OK;
 }
@@ -427,6 +433,90 @@ END_TEST START_TEST(test_dup_key)
 
 }
 
+END_TEST START_TEST(test_shared_group)
+{
+
+  u2fs_EC_KEY_t *key = NULL;
+  char *output = NULL;
+
+  unsigned char userkey_dat[] = {
+    0x04, 0x5c, 0x6d, 0xd1, 0x38, 0x3c, 0x71, 0x91, 0x68, 0x95, 0x13, 0x2b,
+    0xd8, 0x58, 0xe0, 0x6a, 0xd7, 0xfe, 0x36, 0x5a, 0xe5, 0xe5, 0xa0,
+    0x8c, 0x92, 0xba, 0x21, 0xfc, 0x1e, 0xce, 0xb9, 0xdd, 0x1e, 0xf4,
+    0x22, 0xed, 0x04, 0x2d, 0x60, 0x0d, 0xaa, 0x02, 0x0e, 0x0d, 0xad,
+    0xe6, 0xcd, 0x91, 0x20, 0xa8, 0x3b, 0x02, 0x74, 0x57, 0x53, 0xf3,
+    0x2e, 0x53, 0xf5, 0x5a, 0xbf, 0xce, 0x92, 0xef, 0xf4
+  };
+
+  ck_assert_int_eq(crypto_init(), U2FS_OK);
+  ck_assert(p256 != NULL);
+
+  ck_assert_int_eq(decode_user_key(userkey_dat, &key), U2FS_OK);
+  ck_assert_int_eq(dump_user_key(key, &output), U2FS_OK);
+  ck_assert_int_eq(memcmp(output, userkey_dat, U2FS_PUBLIC_KEY_LEN), 0);
+
+  free(output);
+  free_key(key);
+  crypto_release();
+  ck_assert(p256 == NULL);
+
+}
+
+END_TEST START_TEST(test_raw_signature)
+{
+
+  u2fs_EC_KEY_t *key = NULL;
+  u2fs_ECDSA_t *sig = NULL;
+
+  /* An authentication signature from the core tests. */
+  unsigned char userkey_dat[] = {
+    0x04, 0x14, 0xc3, 0x2e, 0x41, 0x0b, 0x30, 0x9d, 0x6e, 0x93, 0x7f, 0x8b,
+    0x5d, 0x81, 0xf9, 0xe5, 0x64, 0xfd, 0x11, 0x2c, 0xe5, 0xfe, 0xf0, 0x10,
+    0x5e, 0xfb, 0xec, 0xd5, 0x55, 0x54, 0x52, 0x25, 0x25, 0xe4, 0x54, 0x29,
+    0x0f, 0xf4, 0x2e, 0xa1, 0xd8, 0x77, 0x19, 0x36, 0x12, 0xe3, 0x6e, 0x39,
+    0x17, 0x91, 0x24, 0xb5, 0x93, 0x8e, 0xe0, 0xfe, 0xf3, 0x69, 0xac, 0xb9,
+    0x4c, 0x37, 0x97, 0x83, 0xcb
+  };
+
+  unsigned char dgst[] = {
+    0x27, 0x2c, 0x7f, 0x10, 0xbd, 0x9d, 0x90, 0xe7, 0x50, 0xf3, 0x6a, 0x6e,
+    0x10, 0x94, 0xfb, 0x27, 0x39, 0x8d, 0xd9, 0x29, 0xdd, 0xa6, 0xe6, 0x73,
+    0x68, 0xbf, 0x4d, 0x66, 0xa8, 0xc1, 0x70, 0xa3
+  };
+
+  unsigned char der[] = {
+    0x30, 0x44, 0x02, 0x20, 0x5d, 0x41, 0x41, 0xe2, 0x98, 0x42, 0xba, 0xa7,
+    0x1c, 0xd3, 0xe6, 0xbd, 0xa1, 0xb0, 0xfc, 0x4b, 0xf7, 0x8c, 0xb8, 0xc2,
+    0x5b, 0x4c, 0x2d, 0x3f, 0x56, 0xb5, 0xa2, 0xce, 0x6c, 0x07, 0x69, 0xd1,
+    0x02, 0x20, 0x05, 0xdb, 0xfc, 0x66, 0x80, 0x10, 0x8b, 0x80, 0x26, 0xff,
+    0x34, 0xe9, 0xe5, 0x2f, 0x32, 0x37, 0x36, 0x42, 0x2f, 0xa2, 0x8b, 0x92,
+    0x0c, 0x6c, 0xdc, 0x36, 0x61, 0x4d, 0xad, 0xdf, 0xd5, 0xa9
+  };
+
+  unsigned char raw[] = {
+    0x5d, 0x41, 0x41, 0xe2, 0x98, 0x42, 0xba, 0xa7, 0x1c, 0xd3, 0xe6, 0xbd,
+    0xa1, 0xb0, 0xfc, 0x4b, 0xf7, 0x8c, 0xb8, 0xc2, 0x5b, 0x4c, 0x2d, 0x3f,
+    0x56, 0xb5, 0xa2, 0xce, 0x6c, 0x07, 0x69, 0xd1, 0x05, 0xdb, 0xfc, 0x66,
+    0x80, 0x10, 0x8b, 0x80, 0x26, 0xff, 0x34, 0xe9, 0xe5, 0x2f, 0x32, 0x37,
+    0x36, 0x42, 0x2f, 0xa2, 0x8b, 0x92, 0x0c, 0x6c, 0xdc, 0x36, 0x61, 0x4d,
+    0xad, 0xdf, 0xd5, 0xa9
+  };
+
+  ck_assert_int_eq(decode_user_key(userkey_dat, &key), U2FS_OK);
+  ck_assert_int_eq(decode_ECDSA(der, sizeof(der), &sig), U2FS_OK);
+
+  ck_assert_int_eq(verify_ECDSA(dgst, sizeof(dgst), sig, key), U2FS_OK);
+  ck_assert_int_eq(verify_ECDSA_raw(dgst, sizeof(dgst), raw, key), U2FS_OK);
+
+  raw[U2FS_ECDSA_RAW_LEN - 1] ^= 0x01;
+  ck_assert_int_eq(verify_ECDSA_raw(dgst, sizeof(dgst), raw, key),
+                   U2FS_SIGNATURE_ERROR);
+
+  free_sig(sig);
+  free_key(key);
+
+}
+
 END_TEST Suite *u2fs_crypto_suite(void)
 {
   Suite *s;
@@ -439,6 +529,8 @@ END_TEST Suite *u2fs_crypto_suite(void)
 
   tcase_add_test(tc_crypto, test_errors);
   tcase_add_test(tc_crypto, test_dup_key);
+  tcase_add_test(tc_crypto, test_shared_group);
+  tcase_add_test(tc_crypto, test_raw_signature);
   suite_add_tcase(s, tc_crypto);
 
   return s;
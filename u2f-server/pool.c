@@ -0,0 +1,290 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * A fixed set of worker threads taking verifications off one FIFO
+ * queue.  A job carries its own copy of the response, so the caller
+ * may release it as soon as the job is submitted.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POOL_MAX_THREADS 1024
+
+struct pool_job {
+  struct pool_job *next;
+  u2fs_ctx_t *ctx;
+  u2fs_registration_func reg_func;
+  u2fs_authentication_func auth_func;
+  void *data;
+  char *response;
+};
+
+struct u2fs_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct pool_job *head;
+  struct pool_job *tail;
+  int stopping;
+  size_t nthreads;
+  pthread_t *threads;
+};
+
+static void run_job(struct pool_job *job)
+{
+  u2fs_reg_res_t *reg_res = NULL;
+  u2fs_auth_res_t *auth_res = NULL;
+  u2fs_rc rc;
+
+  if (job->reg_func != NULL) {
+    rc = u2fs_registration_verify(job->ctx, job->response, &reg_res);
+    job->reg_func(job->ctx, rc, reg_res, job->data);
+  } else {
+    rc = u2fs_authentication_verify(job->ctx, job->response, &auth_res);
+    job->auth_func(job->ctx, rc, auth_res, job->data);
+  }
+}
+
+static void *pool_worker(void *arg)
+{
+  u2fs_pool_t *pool = arg;
+  struct pool_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->stopping)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+
+    job = pool->head;
+    if (job == NULL) {
+      /* Stopping, and the queue is drained. */
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+
+    pool->head = job->next;
+    if (pool->head == NULL)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_job(job);
+    u2fs_free(job);
+  }
+
+  return NULL;
+}
+
+static void pool_stop(u2fs_pool_t * pool, size_t nthreads)
+{
+  size_t i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->lock);
+  u2fs_free(pool->threads);
+  u2fs_free(pool);
+}
+
+static u2fs_rc pool_submit(u2fs_pool_t * pool, u2fs_ctx_t * ctx,
+                           const char *response,
+                           u2fs_registration_func reg_func,
+                           u2fs_authentication_func auth_func, void *data)
+{
+  struct pool_job *job;
+  size_t len;
+
+  len = strlen(response);
+  job = u2fs_malloc(sizeof(*job) + len + 1);
+  if (job == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  job->next = NULL;
+  job->ctx = ctx;
+  job->reg_func = reg_func;
+  job->auth_func = auth_func;
+  job->data = data;
+  job->response = (char *) (job + 1);
+  memcpy(job->response, response, len + 1);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail != NULL)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_pool_init:
+ * @pool: pointer to output variable holding a thread pool handle.
+ * @threads: number of worker threads, or 0 for one per online CPU.
+ *
+ * Start a pool of @threads worker threads running the verifications
+ * submitted with u2fs_registration_verify_async() and
+ * u2fs_authentication_verify_async(), in submission order.  Any number
+ * of threads may submit to the pool at the same time.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_pool_init(u2fs_pool_t ** pool, size_t threads)
+{
+  long cpus;
+  size_t i;
+
+  if (pool == NULL || threads > POOL_MAX_THREADS)
+    return U2FS_MEMORY_ERROR;
+
+  if (threads == 0) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 && cpus <= POOL_MAX_THREADS ? (size_t) cpus : 1;
+  }
+
+  *pool = u2fs_calloc(1, sizeof(**pool));
+  if (*pool == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*pool)->threads = u2fs_calloc(threads, sizeof(*(*pool)->threads));
+  if ((*pool)->threads == NULL) {
+    u2fs_free(*pool);
+    *pool = NULL;
+    return U2FS_MEMORY_ERROR;
+  }
+
+  pthread_mutex_init(&(*pool)->lock, NULL);
+  pthread_cond_init(&(*pool)->ready, NULL);
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&(*pool)->threads[i], NULL, pool_worker,
+                       *pool) != 0) {
+      pool_stop(*pool, i);
+      *pool = NULL;
+      return U2FS_MEMORY_ERROR;
+    }
+  }
+  (*pool)->nthreads = threads;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_pool_done:
+ * @pool: a thread pool handle, from u2fs_pool_init()
+ *
+ * Run every verification still queued in @pool, wait for their
+ * callbacks to return, then stop the worker threads and deallocate
+ * resources associated with @pool.  Nothing may be submitted to
+ * @pool once this is called, and it must not be called from a
+ * completion callback.
+ */
+void u2fs_pool_done(u2fs_pool_t * pool)
+{
+  if (pool == NULL)
+    return;
+
+  pool_stop(pool, pool->nthreads);
+}
+
+/**
+ * u2fs_registration_verify_async:
+ * @pool: a thread pool handle, from u2fs_pool_init()
+ * @ctx: a context handle, from u2fs_init()
+ * @response: a U2F registration response message, copied by the call.
+ * @func: callback receiving the outcome.
+ * @data: pointer handed to @func.
+ *
+ * Queue @response to be checked by u2fs_registration_verify() on one
+ * of the threads of @pool, and return immediately.  @func is then
+ * called on that thread with @ctx, the result code and the result,
+ * which it owns and should free with u2fs_free_reg_res().  @ctx
+ * belongs to the pool from this call until @func is entered, and must
+ * not be used by the caller in between.  To get back to an event loop,
+ * let @func wake it up, for example through an eventfd or a pipe.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned and @func will
+ * be called exactly once.  On errors a #u2fs_rc error code is returned
+ * and @func is not called.
+ */
+u2fs_rc u2fs_registration_verify_async(u2fs_pool_t * pool,
+                                       u2fs_ctx_t * ctx,
+                                       const char *response,
+                                       u2fs_registration_func func,
+                                       void *data)
+{
+  if (pool == NULL || ctx == NULL || response == NULL || func == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  return pool_submit(pool, ctx, response, func, NULL, data);
+}
+
+/**
+ * u2fs_authentication_verify_async:
+ * @pool: a thread pool handle, from u2fs_pool_init()
+ * @ctx: a context handle, from u2fs_init()
+ * @response: a U2F authentication response message, copied by the call.
+ * @func: callback receiving the outcome.
+ * @data: pointer handed to @func.
+ *
+ * Queue @response to be checked by u2fs_authentication_verify() on
+ * one of the threads of @pool, and return immediately.  @func is then
+ * called on that thread with @ctx, the result code and the result,
+ * which it owns and should free with u2fs_free_auth_res().  @ctx
+ * belongs to the pool from this call until @func is entered, and must
+ * not be used by the caller in between.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned and @func will
+ * be called exactly once.  On errors a #u2fs_rc error code is returned
+ * and @func is not called.
+ */
+u2fs_rc u2fs_authentication_verify_async(u2fs_pool_t * pool,
+                                         u2fs_ctx_t * ctx,
+                                         const char *response,
+                                         u2fs_authentication_func func,
+                                         void *data)
+{
+  if (pool == NULL || ctx == NULL || response == NULL || func == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  return pool_submit(pool, ctx, response, NULL, func, data);
+}
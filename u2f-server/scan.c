@@ -0,0 +1,320 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Minimal scanner for the flat JSON objects exchanged in U2F: a single
+ * object whose members are strings or scalars.  It finds the values of
+ * a few known keys without building an object tree.  Anything outside
+ * that subset (nesting, \u escapes, malformed input) is reported as
+ * SCAN_UNSUPPORTED so the caller can hand the message to json-c.
+ */
+
+#include "scan.h"
+
+#include <string.h>
+
+struct scanner {
+  const char *p;
+  const char *end;
+};
+
+static void skip_ws(struct scanner *s)
+{
+  while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' ||
+                           *s->p == '\n' || *s->p == '\r'))
+    s->p++;
+}
+
+static int expect(struct scanner *s, char c)
+{
+  skip_ws(s);
+  if (s->p == s->end || *s->p != c)
+    return 0;
+  s->p++;
+
+  return 1;
+}
+
+static int scan_string(struct scanner *s, struct u2fs_span *out)
+{
+  const char *start;
+
+  if (!expect(s, '"'))
+    return 0;
+
+  start = s->p;
+  out->escaped = 0;
+
+  while (s->p < s->end && *s->p != '"') {
+    if ((unsigned char) *s->p < 0x20)
+      return 0;
+
+    if (*s->p == '\\') {
+      if (++s->p == s->end || strchr("\"\\/bfnrt", *s->p) == NULL
+          || *s->p == '\0')
+        return 0;
+      out->escaped = 1;
+    }
+    s->p++;
+  }
+
+  if (s->p == s->end)
+    return 0;
+
+  out->ptr = start;
+  out->len = s->p - start;
+  s->p++;
+
+  return 1;
+}
+
+static int scan_scalar(struct scanner *s)
+{
+  static const char *const literals[] = { "true", "false", "null" };
+  size_t i, n;
+
+  for (i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    n = strlen(literals[i]);
+    if ((size_t) (s->end - s->p) >= n && memcmp(s->p, literals[i], n) == 0) {
+      s->p += n;
+      return 1;
+    }
+  }
+
+  if (s->p == s->end || (*s->p != '-' && (*s->p < '0' || *s->p > '9')))
+    return 0;
+
+  while (s->p < s->end && *s->p != '\0'
+         && strchr("+-.0123456789eE", *s->p))
+    s->p++;
+
+  return 1;
+}
+
+/*
+ * Scan the object in @json and store the values of the @count @keys
+ * in @values.  Keys that are absent get a NULL ptr.  As with json-c,
+ * the last occurrence of a duplicated key wins.
+ */
+scan_rc scan_object(const char *json, size_t len, const char *const *keys,
+                    struct u2fs_span *values, size_t count)
+{
+  struct scanner s = { json, json + len };
+  struct u2fs_span key, value;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    values[i].ptr = NULL;
+
+  if (!expect(&s, '{'))
+    return SCAN_UNSUPPORTED;
+
+  skip_ws(&s);
+  if (s.p < s.end && *s.p == '}')
+    s.p++;
+  else
+    for (;;) {
+      if (!scan_string(&s, &key) || key.escaped || !expect(&s, ':'))
+        return SCAN_UNSUPPORTED;
+
+      for (i = 0; i < count; i++)
+        if (strlen(keys[i]) == key.len
+            && memcmp(keys[i], key.ptr, key.len) == 0)
+          break;
+
+      skip_ws(&s);
+      if (s.p < s.end && *s.p == '"') {
+        if (!scan_string(&s, &value))
+          return SCAN_UNSUPPORTED;
+        if (i < count)
+          values[i] = value;
+      } else if (i < count || !scan_scalar(&s))
+        return SCAN_UNSUPPORTED;
+
+      if (expect(&s, '}'))
+        break;
+      if (!expect(&s, ','))
+        return SCAN_UNSUPPORTED;
+    }
+
+  skip_ws(&s);
+  if (s.p != s.end)
+    return SCAN_UNSUPPORTED;
+
+  return SCAN_OK;
+}
+
+/*
+ * Copy the value of @span to @output, which must hold span->len
+ * bytes, resolving escape sequences.  Returns the resulting length.
+ */
+size_t scan_unescape(const struct u2fs_span *span, char *output)
+{
+  const char *p = span->ptr;
+  const char *end = span->ptr + span->len;
+  size_t n = 0;
+
+  while (p < end) {
+    if (*p != '\\') {
+      output[n++] = *p++;
+      continue;
+    }
+
+    switch (*++p) {
+    case 'b':
+      output[n++] = '\b';
+      break;
+    case 'f':
+      output[n++] = '\f';
+      break;
+    case 'n':
+      output[n++] = '\n';
+      break;
+    case 'r':
+      output[n++] = '\r';
+      break;
+    case 't':
+      output[n++] = '\t';
+      break;
+    default:
+      output[n++] = *p;
+      break;
+    }
+    p++;
+  }
+
+  return n;
+}
+
+#ifdef MAKE_CHECK
+#include <check.h>
+#include <stdlib.h>
+
+static const char *const test_keys[] = { "challenge", "origin" };
+
+START_TEST(test_scan_ok)
+{
+
+  const char *json =
+      "{ \"challenge\": \"v31IKBFdLkdN\", \"typ\": \"navigator.id\","
+      " \"n\": -1.5e3, \"b\": true, \"origin\": \"http:\\/\\/a.b\" }";
+  struct u2fs_span values[2];
+  char buf[32];
+  size_t len;
+
+  ck_assert_int_eq(scan_object(json, strlen(json), test_keys, values, 2),
+                   SCAN_OK);
+  ck_assert_int_eq(values[0].len, 12);
+  ck_assert(memcmp(values[0].ptr, "v31IKBFdLkdN", 12) == 0);
+  ck_assert_int_eq(values[0].escaped, 0);
+  ck_assert(values[0].ptr > json && values[0].ptr < json + strlen(json));
+
+  ck_assert_int_eq(values[1].escaped, 1);
+  len = scan_unescape(&values[1], buf);
+  ck_assert_int_eq(len, 10);
+  ck_assert(memcmp(buf, "http://a.b", 10) == 0);
+
+}
+
+END_TEST START_TEST(test_scan_missing)
+{
+
+  const char *json = "{\"challenge\":\"abc\",\"challenge\":\"def\"}";
+  struct u2fs_span values[2];
+
+  ck_assert_int_eq(scan_object(json, strlen(json), test_keys, values, 2),
+                   SCAN_OK);
+  ck_assert(memcmp(values[0].ptr, "def", 3) == 0);
+  ck_assert(values[1].ptr == NULL);
+
+  ck_assert_int_eq(scan_object("{}", 2, test_keys, values, 2), SCAN_OK);
+  ck_assert(values[0].ptr == NULL);
+
+}
+
+END_TEST START_TEST(test_scan_unsupported)
+{
+
+  static const char *const bad[] = {
+    "",
+    "[]",
+    "{",
+    "{\"challenge\": \"abc\"",
+    "{\"challenge\": \"abc\",}",
+    "{\"challenge\": \"a\\u0062c\"}",
+    "{\"challenge\": 12}",
+    "{\"x\": {\"challenge\": \"abc\"}}",
+    "{\"x\": bogus}",
+    "{\"challenge\": \"abc\"} trailing",
+    "{\"chal\\u006cenge\": \"abc\"}",
+    "{\"challenge\": \"a\nb\"}"
+  };
+  struct u2fs_span values[2];
+  size_t i;
+
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    ck_assert_int_eq(scan_object(bad[i], strlen(bad[i]), test_keys,
+                                 values, 2), SCAN_UNSUPPORTED);
+
+}
+
+END_TEST Suite *u2fs_scan_suite(void)
+{
+  Suite *s;
+  TCase *tc_scan;
+
+  s = suite_create("u2fs_scan");
+
+  tc_scan = tcase_create("Scan");
+
+  tcase_add_test(tc_scan, test_scan_ok);
+  tcase_add_test(tc_scan, test_scan_missing);
+  tcase_add_test(tc_scan, test_scan_unsupported);
+  suite_add_tcase(s, tc_scan);
+
+  return s;
+}
+
+int main(void)
+{
+
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = u2fs_scan_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+#endif
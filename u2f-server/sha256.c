@@ -38,6 +38,23 @@
 
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+
+/* __builtin_cpu_supports() has no "sha" before GCC 11. */
+static int sha_supported(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+
+  return (ebx >> 29) & 1;
+}
+#endif
+
 /* the K array */
 static const uint32_t K[64] = {
   0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
@@ -79,7 +96,7 @@ static const uint32_t K[64] = {
 #define Gamma1(x)       (S(x, 17) ^ S(x, 19) ^ R(x, 10))
 
 /* compress 512-bits */
-static void sha256_compress(struct sha256_state *md, unsigned char *buf)
+static void compress_block(uint32_t * state, const unsigned char *buf)
 {
   uint32_t S[8], W[64], t0, t1;
   uint32_t t;
@@ -87,7 +104,7 @@ static void sha256_compress(struct sha256_state *md, unsigned char *buf)
 
   /* copy state into S */
   for (i = 0; i < 8; i++) {
-    S[i] = md->state[i];
+    S[i] = state[i];
   }
 
   /* copy the state into 512-bits into W[0..15] */
@@ -122,8 +139,190 @@ static void sha256_compress(struct sha256_state *md, unsigned char *buf)
 
   /* feedback */
   for (i = 0; i < 8; i++) {
-    md->state[i] = md->state[i] + S[i];
+    state[i] = state[i] + S[i];
+  }
+}
+
+static void compress_portable(uint32_t * state, const unsigned char *buf,
+                              size_t blocks)
+{
+  for (; blocks > 0; blocks--, buf += 64)
+    compress_block(state, buf);
+}
+
+static void compress2_portable(uint32_t * state_a,
+                               const unsigned char *buf_a,
+                               uint32_t * state_b,
+                               const unsigned char *buf_b, size_t blocks)
+{
+  compress_portable(state_a, buf_a, blocks);
+  compress_portable(state_b, buf_b, blocks);
+}
+
+#ifdef SHA256_X86
+/*
+ * SHA extensions.  The message schedule and rounds are written as
+ * macros over a set of named registers so that the two-way variant
+ * can interleave two independent messages, hiding the latency of
+ * sha256rnds2.
+ */
+#define SHANI_LOAD_STATE(st, s0, s1, tmp)                          \
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (st)), 0xB1); \
+  s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) ((st) + 4)), 0x1B); \
+  s0 = _mm_alignr_epi8(tmp, s1, 8);                                \
+  s1 = _mm_blend_epi16(s1, tmp, 0xF0)
+
+#define SHANI_STORE_STATE(st, s0, s1, tmp)                         \
+  tmp = _mm_shuffle_epi32(s0, 0x1B);                               \
+  s1 = _mm_shuffle_epi32(s1, 0xB1);                                \
+  s0 = _mm_blend_epi16(tmp, s1, 0xF0);                             \
+  s1 = _mm_alignr_epi8(s1, tmp, 8);                                \
+  _mm_storeu_si128((__m128i *) (st), s0);                          \
+  _mm_storeu_si128((__m128i *) ((st) + 4), s1)
+
+#define SHANI_LOAD(w, buf, n)                                      \
+  w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) ((buf) + 16 * (n))), \
+                       mask)
+
+#define SHANI_SCHED(w0, w1, w2, w3)                                \
+  w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), \
+                                          _mm_alignr_epi8(w3, w2, 4)), w3)
+
+#define SHANI_ROUNDS(s0, s1, msg, w, k)                            \
+  msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *) (K + (k)))); \
+  s1 = _mm_sha256rnds2_epu32(s1, s0, msg);                         \
+  msg = _mm_shuffle_epi32(msg, 0x0E);                              \
+  s0 = _mm_sha256rnds2_epu32(s0, s1, msg)
+
+__attribute__ ((target("sha,sse4.1")))
+static void compress_shani(uint32_t * state, const unsigned char *buf,
+                           size_t blocks)
+{
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i s0, s1, save0, save1, msg, tmp, w0, w1, w2, w3;
+  int i;
+
+  SHANI_LOAD_STATE(state, s0, s1, tmp);
+
+  for (; blocks > 0; blocks--, buf += 64) {
+    save0 = s0;
+    save1 = s1;
+
+    SHANI_LOAD(w0, buf, 0);
+    SHANI_ROUNDS(s0, s1, msg, w0, 0);
+    SHANI_LOAD(w1, buf, 1);
+    SHANI_ROUNDS(s0, s1, msg, w1, 4);
+    SHANI_LOAD(w2, buf, 2);
+    SHANI_ROUNDS(s0, s1, msg, w2, 8);
+    SHANI_LOAD(w3, buf, 3);
+    SHANI_ROUNDS(s0, s1, msg, w3, 12);
+
+    for (i = 16; i < 64; i += 16) {
+      SHANI_SCHED(w0, w1, w2, w3);
+      SHANI_ROUNDS(s0, s1, msg, w0, i);
+      SHANI_SCHED(w1, w2, w3, w0);
+      SHANI_ROUNDS(s0, s1, msg, w1, i + 4);
+      SHANI_SCHED(w2, w3, w0, w1);
+      SHANI_ROUNDS(s0, s1, msg, w2, i + 8);
+      SHANI_SCHED(w3, w0, w1, w2);
+      SHANI_ROUNDS(s0, s1, msg, w3, i + 12);
+    }
+
+    s0 = _mm_add_epi32(s0, save0);
+    s1 = _mm_add_epi32(s1, save1);
+  }
+
+  SHANI_STORE_STATE(state, s0, s1, tmp);
+}
+
+__attribute__ ((target("sha,sse4.1")))
+static void compress2_shani(uint32_t * state_a, const unsigned char *buf_a,
+                            uint32_t * state_b, const unsigned char *buf_b,
+                            size_t blocks)
+{
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i a0, a1, asave0, asave1, amsg, aw0, aw1, aw2, aw3;
+  __m128i b0, b1, bsave0, bsave1, bmsg, bw0, bw1, bw2, bw3;
+  __m128i tmp;
+  int i;
+
+  SHANI_LOAD_STATE(state_a, a0, a1, tmp);
+  SHANI_LOAD_STATE(state_b, b0, b1, tmp);
+
+  for (; blocks > 0; blocks--, buf_a += 64, buf_b += 64) {
+    asave0 = a0;
+    asave1 = a1;
+    bsave0 = b0;
+    bsave1 = b1;
+
+    SHANI_LOAD(aw0, buf_a, 0);
+    SHANI_LOAD(bw0, buf_b, 0);
+    SHANI_ROUNDS(a0, a1, amsg, aw0, 0);
+    SHANI_ROUNDS(b0, b1, bmsg, bw0, 0);
+    SHANI_LOAD(aw1, buf_a, 1);
+    SHANI_LOAD(bw1, buf_b, 1);
+    SHANI_ROUNDS(a0, a1, amsg, aw1, 4);
+    SHANI_ROUNDS(b0, b1, bmsg, bw1, 4);
+    SHANI_LOAD(aw2, buf_a, 2);
+    SHANI_LOAD(bw2, buf_b, 2);
+    SHANI_ROUNDS(a0, a1, amsg, aw2, 8);
+    SHANI_ROUNDS(b0, b1, bmsg, bw2, 8);
+    SHANI_LOAD(aw3, buf_a, 3);
+    SHANI_LOAD(bw3, buf_b, 3);
+    SHANI_ROUNDS(a0, a1, amsg, aw3, 12);
+    SHANI_ROUNDS(b0, b1, bmsg, bw3, 12);
+
+    for (i = 16; i < 64; i += 16) {
+      SHANI_SCHED(aw0, aw1, aw2, aw3);
+      SHANI_SCHED(bw0, bw1, bw2, bw3);
+      SHANI_ROUNDS(a0, a1, amsg, aw0, i);
+      SHANI_ROUNDS(b0, b1, bmsg, bw0, i);
+      SHANI_SCHED(aw1, aw2, aw3, aw0);
+      SHANI_SCHED(bw1, bw2, bw3, bw0);
+      SHANI_ROUNDS(a0, a1, amsg, aw1, i + 4);
+      SHANI_ROUNDS(b0, b1, bmsg, bw1, i + 4);
+      SHANI_SCHED(aw2, aw3, aw0, aw1);
+      SHANI_SCHED(bw2, bw3, bw0, bw1);
+      SHANI_ROUNDS(a0, a1, amsg, aw2, i + 8);
+      SHANI_ROUNDS(b0, b1, bmsg, bw2, i + 8);
+      SHANI_SCHED(aw3, aw0, aw1, aw2);
+      SHANI_SCHED(bw3, bw0, bw1, bw2);
+      SHANI_ROUNDS(a0, a1, amsg, aw3, i + 12);
+      SHANI_ROUNDS(b0, b1, bmsg, bw3, i + 12);
+    }
+
+    a0 = _mm_add_epi32(a0, asave0);
+    a1 = _mm_add_epi32(a1, asave1);
+    b0 = _mm_add_epi32(b0, bsave0);
+    b1 = _mm_add_epi32(b1, bsave1);
+  }
+
+  SHANI_STORE_STATE(state_a, a0, a1, tmp);
+  SHANI_STORE_STATE(state_b, b0, b1, tmp);
+}
+#endif
+
+static void (*compress) (uint32_t * state, const unsigned char *buf,
+                         size_t blocks) = compress_portable;
+static void (*compress2) (uint32_t * state_a, const unsigned char *buf_a,
+                          uint32_t * state_b, const unsigned char *buf_b,
+                          size_t blocks) = compress2_portable;
+
+/**
+   Select the fastest implementation for this CPU.  Not thread safe,
+   called from u2fs_global_init().
+*/
+void sha256_setup(void)
+{
+#ifdef SHA256_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1") && sha_supported()) {
+    compress = compress_shani;
+    compress2 = compress2_shani;
   }
+#endif
 }
 
 /**
@@ -150,14 +349,14 @@ void sha256_process(struct sha256_state *md, const unsigned char *in,
                     unsigned long inlen)
 {
   unsigned long n;
-  int err;
 
   while (inlen > 0) {
     if (md->curlen == 0 && inlen >= block_size) {
-      sha256_compress(md, (unsigned char *) in);
-      md->length += block_size * 8;
-      in += block_size;
-      inlen -= block_size;
+      n = inlen / block_size;
+      compress(md->state, in, n);
+      md->length += n * block_size * 8;
+      in += n * block_size;
+      inlen -= n * block_size;
     } else {
       n = MIN(inlen, (block_size - md->curlen));
       memcpy(md->buf + md->curlen, in, (size_t) n);
@@ -165,7 +364,7 @@ void sha256_process(struct sha256_state *md, const unsigned char *in,
       in += n;
       inlen -= n;
       if (md->curlen == block_size) {
-        sha256_compress(md, md->buf);
+        compress(md->state, md->buf, 1);
         md->length += 8 * block_size;
         md->curlen = 0;
       }
@@ -197,7 +396,7 @@ void sha256_done(struct sha256_state *md, unsigned char *out)
     while (md->curlen < 64) {
       md->buf[md->curlen++] = (unsigned char) 0;
     }
-    sha256_compress(md, md->buf);
+    compress(md->state, md->buf, 1);
     md->curlen = 0;
   }
 
@@ -208,10 +407,209 @@ void sha256_done(struct sha256_state *md, unsigned char *out)
 
   /* store length */
   STORE64H(md->length, md->buf + 56);
-  sha256_compress(md, md->buf);
+  compress(md->state, md->buf, 1);
 
   /* copy output */
   for (i = 0; i < 8; i++) {
     STORE32H(md->state[i], out + (4 * i));
   }
 }
+
+/**
+   Hash a complete message in one call
+   @param in     The message
+   @param inlen  Its length in bytes
+   @param out    [out] The destination of the hash (32 bytes)
+*/
+void sha256_digest(const unsigned char *in, unsigned long inlen,
+                   unsigned char *out)
+{
+  struct sha256_state md;
+
+  sha256_init(&md);
+  sha256_process(&md, in, inlen);
+  sha256_done(&md, out);
+}
+
+/**
+   Hash several independent messages, two at a time where the
+   implementation can interleave them
+   @param in     The messages
+   @param inlen  Their lengths in bytes
+   @param out    [out] The destinations of the hashes (32 bytes each)
+   @param count  Number of messages
+*/
+void sha256_digest_multi(const unsigned char *const *in,
+                         const unsigned long *inlen,
+                         unsigned char *const *out, size_t count)
+{
+  struct sha256_state a, b;
+  unsigned long n;
+  size_t i;
+
+  for (i = 0; i + 1 < count; i += 2) {
+    sha256_init(&a);
+    sha256_init(&b);
+
+    n = MIN(inlen[i], inlen[i + 1]) / block_size;
+    if (n > 0) {
+      compress2(a.state, in[i], b.state, in[i + 1], n);
+      a.length = b.length = n * block_size * 8;
+    }
+
+    sha256_process(&a, in[i] + n * block_size, inlen[i] - n * block_size);
+    sha256_process(&b, in[i + 1] + n * block_size,
+                   inlen[i + 1] - n * block_size);
+    sha256_done(&a, out[i]);
+    sha256_done(&b, out[i + 1]);
+  }
+
+  if (i < count)
+    sha256_digest(in[i], inlen[i], out[i]);
+}
+
+#ifdef MAKE_CHECK
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void hex(const unsigned char *digest, char *out)
+{
+  int i;
+
+  for (i = 0; i < 32; i++)
+    sprintf(out + 2 * i, "%02x", digest[i]);
+}
+
+START_TEST(test_vectors)
+{
+
+  static const char *const msgs[] = {
+    "",
+    "abc",
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+  };
+  static const char *const digests[] = {
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+  };
+  unsigned char digest[32];
+  char out[65];
+  size_t i;
+  int k;
+
+  for (k = 0; k < 2; k++) {
+    if (k == 1)
+      sha256_setup();
+
+    for (i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+      sha256_digest((const unsigned char *) msgs[i], strlen(msgs[i]),
+                    digest);
+      hex(digest, out);
+      ck_assert_str_eq(out, digests[i]);
+    }
+  }
+
+}
+
+END_TEST START_TEST(test_implementations)
+{
+
+  unsigned char data[1000];
+  uint32_t expected[8], state[8], state_b[8];
+  size_t i, blocks;
+
+  srand(3);
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = rand();
+
+  sha256_setup();
+#ifdef SHA256_X86
+  if (__builtin_cpu_supports("sse4.1") && sha_supported())
+    ck_assert(compress == compress_shani);
+#endif
+
+  for (blocks = 1; blocks <= sizeof(data) / 64; blocks++) {
+    for (i = 0; i < 8; i++)
+      expected[i] = state[i] = state_b[i] = K[i];
+
+    compress_portable(expected, data, blocks);
+    compress(state, data, blocks);
+    ck_assert(memcmp(state, expected, sizeof(state)) == 0);
+
+    for (i = 0; i < 8; i++)
+      state[i] = K[i];
+    compress2(state, data, state_b, data, blocks);
+    ck_assert(memcmp(state, expected, sizeof(state)) == 0);
+    ck_assert(memcmp(state_b, expected, sizeof(state)) == 0);
+  }
+
+}
+
+END_TEST START_TEST(test_multi)
+{
+
+  unsigned char data[300];
+  unsigned char digests[5][32], expected[32];
+  const unsigned char *in[5];
+  unsigned long inlen[5] = { 0, 69, 300, 128, 200 };
+  unsigned char *out[5];
+  size_t i;
+
+  srand(4);
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = rand();
+
+  sha256_setup();
+
+  for (i = 0; i < 5; i++) {
+    in[i] = data + i;
+    if (inlen[i] > sizeof(data) - i)
+      inlen[i] = sizeof(data) - i;
+    out[i] = digests[i];
+  }
+
+  sha256_digest_multi(in, inlen, out, 5);
+
+  for (i = 0; i < 5; i++) {
+    sha256_digest(in[i], inlen[i], expected);
+    ck_assert(memcmp(digests[i], expected, 32) == 0);
+  }
+
+}
+
+END_TEST Suite *u2fs_sha256_suite(void)
+{
+  Suite *s;
+  TCase *tc_sha256;
+
+  s = suite_create("u2fs_sha256");
+
+  tc_sha256 = tcase_create("SHA256");
+
+  tcase_add_test(tc_sha256, test_vectors);
+  tcase_add_test(tc_sha256, test_implementations);
+  tcase_add_test(tc_sha256, test_multi);
+  suite_add_tcase(s, tc_sha256);
+
+  return s;
+}
+
+int main(void)
+{
+
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = u2fs_sha256_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+#endif
@@ -30,6 +30,7 @@
 #ifndef SHA256_H
 #define SHA256_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct sha256_state {
@@ -43,4 +44,11 @@ void sha256_process(struct sha256_state *md, const unsigned char *in,
                     unsigned long inlen);
 void sha256_done(struct sha256_state *md, unsigned char *out);
 
+void sha256_setup(void);
+void sha256_digest(const unsigned char *in, unsigned long inlen,
+                   unsigned char *out);
+void sha256_digest_multi(const unsigned char *const *in,
+                         const unsigned long *inlen,
+                         unsigned char *const *out, size_t count);
+
 #endif
@@ -0,0 +1,99 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "internal.h"
+
+static const char *const stage_names[U2FS_STAGE_COUNT] = {
+  "json", "base64", "hash", "decode", "verify", "attestation"
+};
+
+/**
+ * u2fs_set_stats:
+ * @ctx: a context handle, from u2fs_init()
+ * @stats: a zeroed counter block owned by the caller, or %NULL.
+ *
+ * Make registrations and authentications verified with @ctx add the
+ * time spent in each #u2fs_stage, and their result, to @stats.  The
+ * clock is only read while a block is attached.  The context only
+ * keeps a reference: @stats must stay alive for as long as @ctx uses
+ * it, and must not be shared between contexts used by different
+ * threads at the same time.  Passing %NULL detaches the block.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * an #u2fs_rc error code.
+ */
+u2fs_rc u2fs_set_stats(u2fs_ctx_t * ctx, u2fs_stats_t * stats)
+{
+  if (ctx == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  ctx->stats = stats;
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_stats_add:
+ * @total: a counter block to add to.
+ * @stats: a counter block to add, for example the one of one thread.
+ *
+ * Add every counter of @stats to the matching one of @total.
+ */
+void u2fs_stats_add(u2fs_stats_t * total, const u2fs_stats_t * stats)
+{
+  int i;
+
+  if (total == NULL || stats == NULL)
+    return;
+
+  for (i = 0; i < U2FS_STATS_STAGES; i++) {
+    total->calls[i] += stats->calls[i];
+    total->nsec[i] += stats->nsec[i];
+  }
+
+  for (i = 0; i < U2FS_STATS_RESULTS; i++)
+    total->results[i] += stats->results[i];
+}
+
+/**
+ * u2fs_stats_stage_name:
+ * @stage: a #u2fs_stage.
+ *
+ * Get a short lowercase name for @stage, such as "json" or "verify",
+ * suitable as a metric label.
+ *
+ * Returns: a static string, or %NULL if @stage is not a valid stage.
+ */
+const char *u2fs_stats_stage_name(u2fs_stage stage)
+{
+  if ((int) stage < 0 || stage >= U2FS_STAGE_COUNT)
+    return NULL;
+
+  return stage_names[stage];
+}
@@ -0,0 +1,72 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "internal.h"
+
+#include <time.h>
+
+/*
+ * Timing of the stages of a verification into an optional
+ * u2fs_stats_t; without one the clock is never read.
+ */
+
+static inline uint64_t stats_begin(const u2fs_stats_t * stats)
+{
+  struct timespec ts;
+
+  if (stats == NULL)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static inline void stats_end(u2fs_stats_t * stats, u2fs_stage stage,
+                             uint64_t start)
+{
+  if (stats == NULL || (int) stage < 0 || stage >= U2FS_STATS_STAGES)
+    return;
+
+  stats->calls[stage]++;
+  stats->nsec[stage] += stats_begin(stats) - start;
+}
+
+static inline u2fs_rc stats_result(u2fs_stats_t * stats, u2fs_rc rc)
+{
+  if (stats != NULL && rc <= 0 && -rc < U2FS_STATS_RESULTS)
+    stats->results[-rc]++;
+
+  return rc;
+}
+
+#endif
@@ -0,0 +1,581 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * In-process store of outstanding challenges.
+ *
+ * Entries are spread over a fixed number of shards by hash, each with
+ * its own lock, chained hash table and timer wheel.  The wheel has one
+ * slot per second; an entry sits in the slot of the second it expires
+ * in and is reclaimed when the shard's clock passes that slot.  The
+ * clock is only advanced by operations on that shard, so an idle store
+ * costs nothing.
+ */
+
+#include "internal.h"
+#include "store.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define STORE_SHARDS 16
+#define STORE_MIN_BUCKETS 64
+#define STORE_MAX_SLOTS 1024
+
+struct store_entry {
+  struct store_entry *next;
+  struct store_entry *wheel_prev;
+  struct store_entry *wheel_next;
+  uint64_t expires;
+  uint32_t hash;
+  enum store_kind kind;
+  char challenge[U2FS_CHALLENGE_B64U_LEN];
+};
+
+struct store_shard {
+  pthread_mutex_t lock;
+  struct store_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  struct store_entry **wheel;
+  uint64_t now;
+};
+
+struct u2fs_store {
+  unsigned int ttl;
+  size_t nslots;
+  struct store_shard shards[STORE_SHARDS];
+};
+
+static uint64_t store_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec;
+}
+
+/* FNV-1a; challenges are random, so nothing stronger is needed. */
+static uint32_t store_hash(const char *challenge)
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < U2FS_CHALLENGE_B64U_LEN; i++) {
+    h ^= (unsigned char) challenge[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static struct store_shard *get_shard(u2fs_store_t * store, uint32_t hash)
+{
+  return &store->shards[hash >> 28];
+}
+
+static void wheel_link(u2fs_store_t * store, struct store_shard *shard,
+                       struct store_entry *e)
+{
+  struct store_entry **slot = &shard->wheel[e->expires & (store->nslots - 1)];
+
+  e->wheel_prev = NULL;
+  e->wheel_next = *slot;
+  if (*slot != NULL)
+    (*slot)->wheel_prev = e;
+  *slot = e;
+}
+
+static void wheel_unlink(u2fs_store_t * store, struct store_shard *shard,
+                         struct store_entry *e)
+{
+  if (e->wheel_prev != NULL)
+    e->wheel_prev->wheel_next = e->wheel_next;
+  else
+    shard->wheel[e->expires & (store->nslots - 1)] = e->wheel_next;
+  if (e->wheel_next != NULL)
+    e->wheel_next->wheel_prev = e->wheel_prev;
+}
+
+static void bucket_unlink(struct store_shard *shard, struct store_entry *e)
+{
+  struct store_entry **p = &shard->buckets[e->hash & (shard->nbuckets - 1)];
+
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  shard->count--;
+}
+
+/* Drop everything that expired between the shard's clock and @now. */
+static void shard_advance(u2fs_store_t * store, struct store_shard *shard,
+                          uint64_t now)
+{
+  struct store_entry *e, *next;
+  uint64_t steps, t;
+
+  if (now <= shard->now)
+    return;
+
+  steps = now - shard->now;
+  if (steps > store->nslots)
+    steps = store->nslots;
+
+  for (t = now - steps + 1; t <= now; t++) {
+    for (e = shard->wheel[t & (store->nslots - 1)]; e != NULL; e = next) {
+      next = e->wheel_next;
+      if (e->expires > now)
+        continue;
+      wheel_unlink(store, shard, e);
+      bucket_unlink(shard, e);
+      u2fs_free(e);
+    }
+  }
+
+  shard->now = now;
+}
+
+static struct store_entry *shard_find(struct store_shard *shard,
+                                      const char *challenge, uint32_t hash)
+{
+  struct store_entry *e;
+
+  for (e = shard->buckets[hash & (shard->nbuckets - 1)]; e != NULL;
+       e = e->next)
+    if (e->hash == hash
+        && memcmp(e->challenge, challenge, U2FS_CHALLENGE_B64U_LEN) == 0)
+      return e;
+
+  return NULL;
+}
+
+/* Double the bucket array; on allocation failure the chains just grow. */
+static void shard_grow(struct store_shard *shard)
+{
+  struct store_entry **buckets, *e, *next;
+  size_t nbuckets = shard->nbuckets * 2;
+  size_t i;
+
+  buckets = u2fs_calloc(nbuckets, sizeof(*buckets));
+  if (buckets == NULL)
+    return;
+
+  for (i = 0; i < shard->nbuckets; i++) {
+    for (e = shard->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (nbuckets - 1)];
+      buckets[e->hash & (nbuckets - 1)] = e;
+    }
+  }
+
+  u2fs_free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+static u2fs_rc store_put_at(u2fs_store_t * store, const char *challenge,
+                            enum store_kind kind, uint64_t now)
+{
+  uint32_t hash = store_hash(challenge);
+  struct store_shard *shard = get_shard(store, hash);
+  struct store_entry *e;
+  u2fs_rc rc = U2FS_OK;
+
+  pthread_mutex_lock(&shard->lock);
+
+  shard_advance(store, shard, now);
+
+  e = shard_find(shard, challenge, hash);
+  if (e != NULL) {
+    wheel_unlink(store, shard, e);
+  } else {
+    e = u2fs_malloc(sizeof(*e));
+    if (e == NULL) {
+      rc = U2FS_MEMORY_ERROR;
+      goto done;
+    }
+
+    e->hash = hash;
+    memcpy(e->challenge, challenge, U2FS_CHALLENGE_B64U_LEN);
+    e->next = shard->buckets[hash & (shard->nbuckets - 1)];
+    shard->buckets[hash & (shard->nbuckets - 1)] = e;
+
+    if (++shard->count > shard->nbuckets)
+      shard_grow(shard);
+  }
+
+  e->kind = kind;
+  e->expires = now + store->ttl;
+  wheel_link(store, shard, e);
+
+done:
+  pthread_mutex_unlock(&shard->lock);
+
+  return rc;
+}
+
+static u2fs_rc store_consume_at(u2fs_store_t * store, const char *challenge,
+                                size_t len, enum store_kind kind,
+                                uint64_t now)
+{
+  struct store_shard *shard;
+  struct store_entry *e;
+  uint32_t hash;
+
+  if (len != U2FS_CHALLENGE_B64U_LEN)
+    return U2FS_CHALLENGE_ERROR;
+
+  hash = store_hash(challenge);
+  shard = get_shard(store, hash);
+
+  pthread_mutex_lock(&shard->lock);
+
+  shard_advance(store, shard, now);
+
+  e = shard_find(shard, challenge, hash);
+  if (e != NULL && e->kind == kind && e->expires > now) {
+    wheel_unlink(store, shard, e);
+    bucket_unlink(shard, e);
+  } else {
+    e = NULL;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (e == NULL)
+    return U2FS_CHALLENGE_ERROR;
+
+  u2fs_free(e);
+
+  return U2FS_OK;
+}
+
+/*
+ * Remember @challenge for the store's lifetime.  Storing a challenge
+ * that is already present restarts its lifetime.
+ */
+u2fs_rc store_put(u2fs_store_t * store, const char *challenge,
+                  enum store_kind kind)
+{
+  if (strlen(challenge) != U2FS_CHALLENGE_B64U_LEN)
+    return U2FS_CHALLENGE_ERROR;
+
+  return store_put_at(store, challenge, kind, store_clock());
+}
+
+/*
+ * Remove @challenge if it is stored, unexpired and was handed out for
+ * @kind.  Of several threads consuming the same challenge, only one
+ * gets %U2FS_OK.
+ */
+u2fs_rc store_consume(u2fs_store_t * store, const char *challenge,
+                      size_t len, enum store_kind kind)
+{
+  return store_consume_at(store, challenge, len, kind, store_clock());
+}
+
+static void store_free(u2fs_store_t * store)
+{
+  struct store_entry *e, *next;
+  struct store_shard *shard;
+  size_t i, j;
+
+  for (i = 0; i < STORE_SHARDS; i++) {
+    shard = &store->shards[i];
+    if (shard->buckets != NULL) {
+      for (j = 0; j < shard->nbuckets; j++) {
+        for (e = shard->buckets[j]; e != NULL; e = next) {
+          next = e->next;
+          u2fs_free(e);
+        }
+      }
+      u2fs_free(shard->buckets);
+    }
+    u2fs_free(shard->wheel);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  u2fs_free(store);
+}
+
+/**
+ * u2fs_store_init:
+ * @store: pointer to output variable holding a challenge store handle.
+ * @ttl: lifetime of a stored challenge, in seconds.
+ *
+ * Create an in-process store of outstanding challenges.  Once attached
+ * to a context with u2fs_set_store(), every challenge handed out by
+ * that context is remembered for @ttl seconds, and a response only
+ * verifies while its challenge is in the store.  A successful
+ * verification removes the challenge, so it cannot be replayed.  The
+ * store is thread safe and may be shared by any number of contexts.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_store_init(u2fs_store_t ** store, unsigned int ttl)
+{
+  struct store_shard *shard;
+  uint64_t now;
+  size_t i;
+
+  if (store == NULL || ttl == 0)
+    return U2FS_MEMORY_ERROR;
+
+  *store = u2fs_calloc(1, sizeof(**store));
+  if (*store == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  (*store)->ttl = ttl;
+  for ((*store)->nslots = 1;
+       (*store)->nslots <= ttl && (*store)->nslots < STORE_MAX_SLOTS;
+       (*store)->nslots *= 2);
+
+  now = store_clock();
+  for (i = 0; i < STORE_SHARDS; i++) {
+    pthread_mutex_init(&(*store)->shards[i].lock, NULL);
+    (*store)->shards[i].now = now;
+  }
+
+  for (i = 0; i < STORE_SHARDS; i++) {
+    shard = &(*store)->shards[i];
+    shard->nbuckets = STORE_MIN_BUCKETS;
+    shard->buckets = u2fs_calloc(shard->nbuckets, sizeof(*shard->buckets));
+    shard->wheel = u2fs_calloc((*store)->nslots, sizeof(*shard->wheel));
+    if (shard->buckets == NULL || shard->wheel == NULL) {
+      store_free(*store);
+      *store = NULL;
+      return U2FS_MEMORY_ERROR;
+    }
+  }
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_store_done:
+ * @store: a challenge store handle, from u2fs_store_init()
+ *
+ * Deallocate resources associated with @store, including any
+ * challenges still outstanding.  No context referring to @store may
+ * be used afterwards.
+ */
+void u2fs_store_done(u2fs_store_t * store)
+{
+  if (store == NULL)
+    return;
+
+  store_free(store);
+}
+
+#ifdef MAKE_CHECK
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct u2fs_allocator allocator = { malloc, realloc, free };
+
+static void make_challenge(char *buf, unsigned int n)
+{
+  snprintf(buf, U2FS_CHALLENGE_B64U_LEN + 1, "%043u", n);
+}
+
+/* A store whose clock starts at zero, for the *_at() functions. */
+static u2fs_store_t *store_at_zero(unsigned int ttl)
+{
+  u2fs_store_t *store;
+  size_t i;
+
+  ck_assert_int_eq(u2fs_store_init(&store, ttl), U2FS_OK);
+  for (i = 0; i < STORE_SHARDS; i++)
+    store->shards[i].now = 0;
+
+  return store;
+}
+
+static size_t store_count(u2fs_store_t * store, uint64_t now)
+{
+  size_t i, count = 0;
+
+  for (i = 0; i < STORE_SHARDS; i++) {
+    shard_advance(store, &store->shards[i], now);
+    count += store->shards[i].count;
+  }
+
+  return count;
+}
+
+START_TEST(single_use)
+{
+
+  char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
+  u2fs_store_t *store;
+
+  store = store_at_zero(60);
+  make_challenge(challenge, 1);
+
+  ck_assert_int_eq(store_put_at(store, challenge, STORE_REGISTRATION, 100),
+                   U2FS_OK);
+  ck_assert_int_eq(store_consume_at(store, challenge,
+                                    U2FS_CHALLENGE_B64U_LEN,
+                                    STORE_AUTHENTICATION, 100),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(store_consume_at(store, challenge, 10,
+                                    STORE_REGISTRATION, 100),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(store_consume_at(store, challenge,
+                                    U2FS_CHALLENGE_B64U_LEN,
+                                    STORE_REGISTRATION, 100), U2FS_OK);
+  ck_assert_int_eq(store_consume_at(store, challenge,
+                                    U2FS_CHALLENGE_B64U_LEN,
+                                    STORE_REGISTRATION, 100),
+                   U2FS_CHALLENGE_ERROR);
+
+  ck_assert_int_eq(store_put(store, "short", STORE_REGISTRATION),
+                   U2FS_CHALLENGE_ERROR);
+  ck_assert_int_eq(u2fs_store_init(&store, 0), U2FS_MEMORY_ERROR);
+
+  u2fs_store_done(store);
+}
+
+END_TEST START_TEST(expiry)
+{
+
+  char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
+  u2fs_store_t *store;
+  unsigned int ttl;
+  size_t i;
+
+  /* Both with a wheel covering the lifetime and one wrapping around. */
+  for (ttl = 200; ttl <= 5000; ttl *= 25) {
+    store = store_at_zero(ttl);
+
+    for (i = 0; i < 100; i++) {
+      make_challenge(challenge, i);
+      ck_assert_int_eq(store_put_at(store, challenge, STORE_AUTHENTICATION,
+                                    1000 + i), U2FS_OK);
+    }
+
+    /* Restarting the lifetime of challenge 0. */
+    make_challenge(challenge, 0);
+    ck_assert_int_eq(store_put_at(store, challenge, STORE_AUTHENTICATION,
+                                  1099), U2FS_OK);
+
+    ck_assert_int_eq(store_count(store, 1049 + ttl), 51);
+
+    make_challenge(challenge, 98);
+    ck_assert_int_eq(store_consume_at(store, challenge,
+                                      U2FS_CHALLENGE_B64U_LEN,
+                                      STORE_AUTHENTICATION,
+                                      1098 + ttl), U2FS_CHALLENGE_ERROR);
+    make_challenge(challenge, 99);
+    ck_assert_int_eq(store_consume_at(store, challenge,
+                                      U2FS_CHALLENGE_B64U_LEN,
+                                      STORE_AUTHENTICATION,
+                                      1098 + ttl), U2FS_OK);
+    make_challenge(challenge, 0);
+    ck_assert_int_eq(store_consume_at(store, challenge,
+                                      U2FS_CHALLENGE_B64U_LEN,
+                                      STORE_AUTHENTICATION,
+                                      1098 + ttl), U2FS_OK);
+
+    ck_assert_int_eq(store_count(store, 1098 + ttl), 0);
+
+    ck_assert_int_eq(store_put_at(store, challenge, STORE_AUTHENTICATION,
+                                  1000000), U2FS_OK);
+    ck_assert_int_eq(store_count(store, 1000000), 1);
+
+    u2fs_store_done(store);
+  }
+}
+
+END_TEST START_TEST(many)
+{
+
+  char challenge[U2FS_CHALLENGE_B64U_LEN + 1];
+  u2fs_store_t *store;
+  unsigned int i;
+
+  store = store_at_zero(60);
+
+  for (i = 0; i < 20000; i++) {
+    make_challenge(challenge, i);
+    ck_assert_int_eq(store_put_at(store, challenge, STORE_REGISTRATION,
+                                  10), U2FS_OK);
+  }
+  ck_assert(store->shards[0].nbuckets > STORE_MIN_BUCKETS);
+
+  for (i = 0; i < 20000; i += 2) {
+    make_challenge(challenge, i);
+    ck_assert_int_eq(store_consume_at(store, challenge,
+                                      U2FS_CHALLENGE_B64U_LEN,
+                                      STORE_REGISTRATION, 20), U2FS_OK);
+  }
+
+  /* The remaining half is released by u2fs_store_done(). */
+  u2fs_store_done(store);
+}
+
+END_TEST Suite *u2fs_store_suite(void)
+{
+  Suite *s;
+  TCase *tc_store;
+
+  s = suite_create("u2fs_store");
+
+  tc_store = tcase_create("Store");
+
+  tcase_add_test(tc_store, single_use);
+  tcase_add_test(tc_store, expiry);
+  tcase_add_test(tc_store, many);
+  suite_add_tcase(s, tc_store);
+
+  return s;
+}
+
+int main(void)
+{
+
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = u2fs_store_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+#endif
@@ -0,0 +1,163 @@
+/*
+* Copyright (c) 2014 Yubico AB
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Trusted attestation roots, with a memo of certificates that already
+ * verified.  The memo maps the SHA-256 of a certificate's DER encoding
+ * to the time the verified chain stops being valid, capped at a day so
+ * a long-lived process picks up changes like a root's expiry.  It is
+ * direct mapped: a colliding certificate just replaces the older one.
+ */
+
+#include "internal.h"
+#include "truststore.h"
+#include "crypto.h"
+#include "sha256.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define TRUST_MEMO_SLOTS 256
+#define TRUST_MEMO_MAX_AGE 86400
+
+struct trust_memo {
+  unsigned char digest[_SHA256_LEN];
+  time_t valid_until;
+};
+
+struct u2fs_truststore {
+  u2fs_X509_STORE_t *store;
+  pthread_mutex_t lock;
+  struct trust_memo memo[TRUST_MEMO_SLOTS];
+};
+
+static struct trust_memo *memo_slot(u2fs_truststore_t * trust,
+                                    const unsigned char *digest)
+{
+  return &trust->memo[digest[0] % TRUST_MEMO_SLOTS];
+}
+
+/*
+ * Check that @cert, whose DER encoding is @der of @len bytes, chains
+ * to a trusted certificate.
+ */
+u2fs_rc truststore_verify(u2fs_truststore_t * trust,
+                          const unsigned char *der, size_t len,
+                          const u2fs_X509_t * cert)
+{
+  unsigned char digest[_SHA256_LEN];
+  struct trust_memo *m;
+  time_t now = time(NULL), valid_until;
+  int hit;
+  u2fs_rc rc;
+
+  sha256_digest(der, len, digest);
+  m = memo_slot(trust, digest);
+
+  pthread_mutex_lock(&trust->lock);
+  hit = memcmp(m->digest, digest, sizeof(digest)) == 0
+      && now < m->valid_until;
+  pthread_mutex_unlock(&trust->lock);
+
+  if (hit)
+    return U2FS_OK;
+
+  valid_until = now + TRUST_MEMO_MAX_AGE;
+  rc = verify_X509_chain(trust->store, cert, &valid_until);
+  if (rc != U2FS_OK)
+    return rc;
+
+  pthread_mutex_lock(&trust->lock);
+  memcpy(m->digest, digest, sizeof(digest));
+  m->valid_until = valid_until;
+  pthread_mutex_unlock(&trust->lock);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_truststore_init:
+ * @trust: pointer to output variable holding a trust store handle.
+ * @file: a PEM bundle of trusted certificates, or %NULL.
+ * @dir: a directory of trusted certificates, hashed as by
+ *   "openssl rehash", or %NULL.
+ *
+ * Load the certificates that attestation certificates must chain to.
+ * Every certificate loaded is trusted on its own, so a vendor
+ * intermediate can be listed without its root.  Once attached to a
+ * context with u2fs_set_truststore(), registrations whose attestation
+ * certificate does not verify fail with %U2FS_ATTESTATION_ERROR.
+ * Verified certificates are remembered, so repeat registrations from
+ * devices sharing a certificate cost a hash lookup.  The trust store is
+ * thread safe and may be shared by any number of contexts.
+ *
+ * Returns: On success %U2FS_OK (integer 0) is returned, and on errors
+ * a #u2fs_rc error code.
+ */
+u2fs_rc u2fs_truststore_init(u2fs_truststore_t ** trust, const char *file,
+                             const char *dir)
+{
+  u2fs_rc rc;
+
+  if (trust == NULL || (file == NULL && dir == NULL))
+    return U2FS_MEMORY_ERROR;
+
+  *trust = u2fs_calloc(1, sizeof(**trust));
+  if (*trust == NULL)
+    return U2FS_MEMORY_ERROR;
+
+  rc = load_X509_store(file, dir, &(*trust)->store);
+  if (rc != U2FS_OK) {
+    u2fs_free(*trust);
+    *trust = NULL;
+    return rc;
+  }
+
+  pthread_mutex_init(&(*trust)->lock, NULL);
+
+  return U2FS_OK;
+}
+
+/**
+ * u2fs_truststore_done:
+ * @trust: a trust store handle, from u2fs_truststore_init()
+ *
+ * Deallocate resources associated with @trust.  No context referring
+ * to @trust may be used afterwards.
+ */
+void u2fs_truststore_done(u2fs_truststore_t * trust)
+{
+  if (trust == NULL)
+    return;
+
+  free_X509_store(trust->store);
+  pthread_mutex_destroy(&trust->lock);
+  u2fs_free(trust);
+}
@@ -42,7 +42,40 @@ extern "C" {
 #define U2FS_CHALLENGE_RAW_LEN 32
 #define U2FS_CHALLENGE_B64U_LEN 43
 #define U2FS_PUBLIC_KEY_LEN 65
+#define U2FS_COMPRESSED_KEY_LEN 33
 #define U2FS_COUNTER_LEN 4
+#define U2FS_KEYHANDLE_MAX_LEN 255
+
+/**
+ * U2FS_CREDENTIAL_VERSION:
+ *
+ * Version of the binary credential format written by
+ * u2fs_credential_encode() and u2fs_credentials_header().
+ */
+#define U2FS_CREDENTIAL_VERSION 1
+
+/**
+ * U2FS_CREDENTIAL_LEN:
+ *
+ * Size of one binary credential record, in bytes.
+ */
+#define U2FS_CREDENTIAL_LEN 336
+
+/**
+ * U2FS_CREDENTIAL_HEADER_LEN:
+ *
+ * Size of the header of an array of credential records, in bytes.
+ */
+#define U2FS_CREDENTIAL_HEADER_LEN 16
+
+/**
+ * U2FS_AUTH_BUFSIZE:
+ * @len: length of an authentication response, in bytes.
+ *
+ * Size of a buffer that is always large enough for
+ * u2fs_authentication_verify_buf() to process a response of @len bytes.
+ */
+#define U2FS_AUTH_BUFSIZE(len) (3 * (len) + 64)
 
 /**
  * u2fs_rc:
@@ -55,6 +88,9 @@ extern "C" {
  * @U2FS_CHALLENGE_ERROR: Challenge error.
  * @U2FS_SIGNATURE_ERROR: Signature mismatch.
  * @U2FS_FORMAT_ERROR: Message format error.
+ * @U2FS_COUNTER_ERROR: Signature counter did not increase.
+ * @U2FS_ATTESTATION_ERROR: Attestation certificate not trusted.
+ * @U2FS_KEYHANDLE_ERROR: Key handle mismatch.
  *
  * Error codes.
  */
@@ -67,9 +103,74 @@ extern "C" {
     U2FS_ORIGIN_ERROR = -5,
     U2FS_CHALLENGE_ERROR = -6,
     U2FS_SIGNATURE_ERROR = -7,
-    U2FS_FORMAT_ERROR = -8
+    U2FS_FORMAT_ERROR = -8,
+    U2FS_COUNTER_ERROR = -9,
+    U2FS_ATTESTATION_ERROR = -10,
+    U2FS_KEYHANDLE_ERROR = -11
   } u2fs_rc;
 
+/**
+ * U2FS_STATS_RESULTS:
+ *
+ * Number of elements of the @results member of #u2fs_stats_t.  It is
+ * fixed, so that new #u2fs_rc codes do not change the size of the
+ * structure; an error @rc with -@rc of %U2FS_STATS_RESULTS or more is
+ * not counted.
+ */
+#define U2FS_STATS_RESULTS 32
+
+/**
+ * u2fs_stage:
+ * @U2FS_STAGE_JSON: Parsing the JSON of responses and client data.
+ * @U2FS_STAGE_BASE64: Decoding websafe Base64.
+ * @U2FS_STAGE_HASH: Hashing the signed data.
+ * @U2FS_STAGE_DECODE: Decoding public keys, certificates and signatures.
+ * @U2FS_STAGE_VERIFY: Checking ECDSA signatures.
+ * @U2FS_STAGE_ATTESTATION: Checking attestation certificates against a
+ *   trust store.
+ * @U2FS_STAGE_COUNT: Number of stages.
+ *
+ * Stages of a verification timed in a #u2fs_stats_t.
+ */
+  typedef enum {
+    U2FS_STAGE_JSON = 0,
+    U2FS_STAGE_BASE64,
+    U2FS_STAGE_HASH,
+    U2FS_STAGE_DECODE,
+    U2FS_STAGE_VERIFY,
+    U2FS_STAGE_ATTESTATION,
+    U2FS_STAGE_COUNT
+  } u2fs_stage;
+
+/**
+ * U2FS_STATS_STAGES:
+ *
+ * Number of elements of the @calls and @nsec members of #u2fs_stats_t.
+ * It is fixed, so that new #u2fs_stage values do not change the size
+ * of the structure; stages of %U2FS_STATS_STAGES or more are not
+ * timed.
+ */
+#define U2FS_STATS_STAGES 16
+
+/**
+ * u2fs_stats_t:
+ * @calls: number of times each #u2fs_stage was entered.
+ * @nsec: nanoseconds spent in each #u2fs_stage.
+ * @results: number of registration and authentication verifications
+ *   that returned each #u2fs_rc, %U2FS_OK in element 0 and error @rc
+ *   in element -@rc, for codes that fit in %U2FS_STATS_RESULTS.
+ *
+ * Counters filled in by the verifications of the contexts it is
+ * attached to with u2fs_set_stats().  The block is owned and zeroed
+ * by the caller, and is not locked: give each thread its own and sum
+ * them with u2fs_stats_add() when reporting.
+ */
+  typedef struct u2fs_stats {
+    uint64_t calls[U2FS_STATS_STAGES];
+    uint64_t nsec[U2FS_STATS_STAGES];
+    uint64_t results[U2FS_STATS_RESULTS];
+  } u2fs_stats_t;
+
 /**
  * u2fs_initflags:
  * @U2FS_DEBUG: Print debug messages.
@@ -80,13 +181,103 @@ extern "C" {
     U2FS_DEBUG = 1
   } u2fs_initflags;
 
+/**
+ * u2fs_storeflags:
+ * @U2FS_STORE_ANY: With no challenge set in the context, accept a
+ *   response to any challenge in the store.
+ *
+ * Flags passed to u2fs_set_store().
+ */
+  typedef enum {
+    U2FS_STORE_ANY = 1
+  } u2fs_storeflags;
+
+/**
+ * u2fs_malloc_func:
+ * @size: number of bytes to allocate.
+ *
+ * Allocation callback, see u2fs_set_allocator().
+ */
+  typedef void *(*u2fs_malloc_func) (size_t size);
+
+/**
+ * u2fs_realloc_func:
+ * @ptr: memory returned by the #u2fs_malloc_func, or NULL.
+ * @size: new size in bytes.
+ *
+ * Reallocation callback, see u2fs_set_allocator().
+ */
+  typedef void *(*u2fs_realloc_func) (void *ptr, size_t size);
+
+/**
+ * u2fs_free_func:
+ * @ptr: memory returned by the #u2fs_malloc_func, or NULL.
+ *
+ * Deallocation callback, see u2fs_set_allocator().
+ */
+  typedef void (*u2fs_free_func) (void *ptr);
+
+/**
+ * u2fs_counter_func:
+ * @keyHandle: a key handle in websafe Base64 form.
+ * @counter: the last counter value seen for @keyHandle.
+ * @data: the pointer passed to u2fs_counters_snapshot().
+ *
+ * Callback of u2fs_counters_snapshot().
+ *
+ * Returns: zero to continue, non-zero to stop the iteration.
+ */
+  typedef int (*u2fs_counter_func) (const char *keyHandle, uint32_t counter,
+                                    void *data);
+
   typedef struct u2fs_ctx u2fs_ctx_t;
+  typedef struct u2fs_rp u2fs_rp_t;
+  typedef struct u2fs_pubkey u2fs_pubkey_t;
+  typedef struct u2fs_store u2fs_store_t;
+  typedef struct u2fs_counters u2fs_counters_t;
+  typedef struct u2fs_certcache u2fs_certcache_t;
+  typedef struct u2fs_truststore u2fs_truststore_t;
+  typedef struct u2fs_creddb u2fs_creddb_t;
+  typedef struct u2fs_pool u2fs_pool_t;
   typedef struct u2fs_reg_res u2fs_reg_res_t;
   typedef struct u2fs_auth_res u2fs_auth_res_t;
 
+/**
+ * u2fs_registration_func:
+ * @ctx: the context passed to u2fs_registration_verify_async().
+ * @rc: the result of the verification.
+ * @result: the registration result on success, otherwise %NULL.  Memory
+ *   should be free'd.
+ * @data: the pointer passed to u2fs_registration_verify_async().
+ *
+ * Completion callback of u2fs_registration_verify_async(), called on
+ * a thread of the pool.
+ */
+  typedef void (*u2fs_registration_func) (u2fs_ctx_t * ctx, u2fs_rc rc,
+                                          u2fs_reg_res_t * result,
+                                          void *data);
+
+/**
+ * u2fs_authentication_func:
+ * @ctx: the context passed to u2fs_authentication_verify_async().
+ * @rc: the result of the verification.
+ * @result: the authentication result on success, otherwise %NULL.
+ *   Memory should be free'd.
+ * @data: the pointer passed to u2fs_authentication_verify_async().
+ *
+ * Completion callback of u2fs_authentication_verify_async(), called
+ * on a thread of the pool.
+ */
+  typedef void (*u2fs_authentication_func) (u2fs_ctx_t * ctx, u2fs_rc rc,
+                                            u2fs_auth_res_t * result,
+                                            void *data);
+
 /* Must be called successfully before using any other functions. */
   u2fs_rc u2fs_global_init(u2fs_initflags flags);
   void u2fs_global_done(void);
+  u2fs_rc u2fs_set_allocator(u2fs_malloc_func malloc_func,
+                             u2fs_realloc_func realloc_func,
+                             u2fs_free_func free_func);
 
 /* Error handling */
   const char *u2fs_strerror(int err);
@@ -96,31 +287,135 @@ extern "C" {
 
   u2fs_rc u2fs_init(u2fs_ctx_t ** ctx);
   void u2fs_done(u2fs_ctx_t * ctx);
+  u2fs_rc u2fs_reset(u2fs_ctx_t * ctx);
   u2fs_rc u2fs_set_origin(u2fs_ctx_t * ctx, const char *origin);
   u2fs_rc u2fs_set_appid(u2fs_ctx_t * ctx, const char *appid);
   u2fs_rc u2fs_set_challenge(u2fs_ctx_t * ctx, const char *challenge);
+  u2fs_rc u2fs_generate_challenges(char *challenges, size_t count);
   u2fs_rc u2fs_set_keyHandle(u2fs_ctx_t * ctx, const char *keyHandle);
   u2fs_rc u2fs_set_publicKey(u2fs_ctx_t * ctx,
                              const unsigned char *publicKey);
+  u2fs_rc u2fs_compress_publicKey(const unsigned char *publicKey,
+                                  unsigned char *output);
+  u2fs_rc u2fs_decompress_publicKey(const unsigned char *compressed,
+                                    unsigned char *output);
+
+/* Contexts cached per thread for reuse. */
+
+  u2fs_rc u2fs_ctx_acquire(u2fs_ctx_t ** ctx);
+  void u2fs_ctx_release(u2fs_ctx_t * ctx);
+
+/* Relying party settings, shareable between contexts. */
+
+  u2fs_rc u2fs_rp_init(u2fs_rp_t ** rp, const char *origin,
+                       const char *appid);
+  void u2fs_rp_done(u2fs_rp_t * rp);
+  u2fs_rc u2fs_set_rp(u2fs_ctx_t * ctx, const u2fs_rp_t * rp);
+
+/* Pre-decoded user public keys, shareable between contexts. */
+
+  u2fs_rc u2fs_pubkey_init(u2fs_pubkey_t ** key,
+                           const unsigned char *publicKey);
+  void u2fs_pubkey_done(u2fs_pubkey_t * key);
+  u2fs_rc u2fs_set_pubkey(u2fs_ctx_t * ctx, const u2fs_pubkey_t * key);
+
+/* Single-use challenge store, shareable between contexts and threads. */
+
+  u2fs_rc u2fs_store_init(u2fs_store_t ** store, unsigned int ttl);
+  void u2fs_store_done(u2fs_store_t * store);
+  u2fs_rc u2fs_set_store(u2fs_ctx_t * ctx, u2fs_store_t * store,
+                         u2fs_storeflags flags);
+
+/* Signature counter table, shareable between contexts and threads. */
+
+  u2fs_rc u2fs_counters_init(u2fs_counters_t ** counters, size_t size);
+  void u2fs_counters_done(u2fs_counters_t * counters);
+  u2fs_rc u2fs_counters_restore(u2fs_counters_t * counters,
+                                const char *keyHandle, uint32_t counter);
+  u2fs_rc u2fs_counters_snapshot(u2fs_counters_t * counters,
+                                 u2fs_counter_func func, void *data);
+  u2fs_rc u2fs_set_counters(u2fs_ctx_t * ctx, u2fs_counters_t * counters);
+
+/* Attestation certificate cache, shareable between contexts and threads. */
+
+  u2fs_rc u2fs_certcache_init(u2fs_certcache_t ** cache, size_t size);
+  void u2fs_certcache_done(u2fs_certcache_t * cache);
+  u2fs_rc u2fs_set_certcache(u2fs_ctx_t * ctx, u2fs_certcache_t * cache);
+
+/* Trusted attestation roots, shareable between contexts and threads. */
+
+  u2fs_rc u2fs_truststore_init(u2fs_truststore_t ** trust,
+                               const char *file, const char *dir);
+  void u2fs_truststore_done(u2fs_truststore_t * trust);
+  u2fs_rc u2fs_set_truststore(u2fs_ctx_t * ctx, u2fs_truststore_t * trust);
+
+/* Per-stage timings and result counts, owned by the caller. */
+
+  u2fs_rc u2fs_set_stats(u2fs_ctx_t * ctx, u2fs_stats_t * stats);
+  void u2fs_stats_add(u2fs_stats_t * total, const u2fs_stats_t * stats);
+  const char *u2fs_stats_stage_name(u2fs_stage stage);
+
+/* Binary credential records and arrays of them. */
+
+  u2fs_rc u2fs_credential_encode(unsigned char *record,
+                                 const unsigned char *keyHandle,
+                                 size_t keyHandle_len,
+                                 const unsigned char *publicKey,
+                                 uint32_t counter, uint8_t flags);
+  u2fs_rc u2fs_credential_decode(const unsigned char *record,
+                                 const unsigned char **keyHandle,
+                                 size_t * keyHandle_len,
+                                 const unsigned char **publicKey,
+                                 uint32_t * counter, uint8_t * flags);
+  u2fs_rc u2fs_credentials_header(unsigned char *header, size_t count);
+  u2fs_rc u2fs_credentials_parse(const void *data, size_t len,
+                                 const unsigned char **records,
+                                 size_t * count);
+
+/* Mapped credential database, shareable between contexts and threads. */
+
+  u2fs_rc u2fs_creddb_init(u2fs_creddb_t ** db, const char *path);
+  u2fs_rc u2fs_creddb_refresh(u2fs_creddb_t * db);
+  void u2fs_creddb_done(u2fs_creddb_t * db);
+  u2fs_rc u2fs_creddb_lookup(const u2fs_creddb_t * db,
+                             const char *keyHandle,
+                             const unsigned char **record);
+  u2fs_rc u2fs_set_credential(u2fs_ctx_t * ctx, const u2fs_creddb_t * db,
+                              const char *keyHandle);
 
 /* U2F Registration functions */
 
   u2fs_rc u2fs_registration_challenge(u2fs_ctx_t * ctx, char **output);
+  u2fs_rc u2fs_registration_challenge_buf(u2fs_ctx_t * ctx, char *buf,
+                                          size_t * buflen);
   u2fs_rc u2fs_registration_verify(u2fs_ctx_t * ctx, const char *response,
                                    u2fs_reg_res_t ** output);
 
   const char *u2fs_get_registration_keyHandle(u2fs_reg_res_t * result);
   const char *u2fs_get_registration_publicKey(u2fs_reg_res_t * result);
   const char *u2fs_get_registration_attestation(u2fs_reg_res_t * result);
+  u2fs_rc u2fs_get_registration_credential(const u2fs_reg_res_t * result,
+                                           unsigned char *record);
 
   void u2fs_free_reg_res(u2fs_reg_res_t * result);
 
 /* U2F Authentication functions */
 
   u2fs_rc u2fs_authentication_challenge(u2fs_ctx_t * ctx, char **output);
+  u2fs_rc u2fs_authentication_challenge_buf(u2fs_ctx_t * ctx, char *buf,
+                                            size_t * buflen);
   u2fs_rc u2fs_authentication_verify(u2fs_ctx_t * ctx,
                                      const char *response,
                                      u2fs_auth_res_t ** output);
+  u2fs_rc u2fs_authentication_verify_buf(u2fs_ctx_t * ctx,
+                                         const char *response, void *buf,
+                                         size_t buflen,
+                                         u2fs_auth_res_t ** output);
+  u2fs_rc u2fs_authentication_verify_batch(u2fs_ctx_t ** ctx,
+                                           const char **responses,
+                                           size_t count,
+                                           u2fs_auth_res_t ** outputs,
+                                           u2fs_rc * rcs);
 
   u2fs_rc u2fs_get_authentication_result(u2fs_auth_res_t * result,
                                          u2fs_rc * verified,
@@ -129,6 +424,21 @@ extern "C" {
 
   void u2fs_free_auth_res(u2fs_auth_res_t * result);
 
+/* Verification on a pool of worker threads, with completion callbacks. */
+
+  u2fs_rc u2fs_pool_init(u2fs_pool_t ** pool, size_t threads);
+  void u2fs_pool_done(u2fs_pool_t * pool);
+  u2fs_rc u2fs_registration_verify_async(u2fs_pool_t * pool,
+                                         u2fs_ctx_t * ctx,
+                                         const char *response,
+                                         u2fs_registration_func func,
+                                         void *data);
+  u2fs_rc u2fs_authentication_verify_async(u2fs_pool_t * pool,
+                                           u2fs_ctx_t * ctx,
+                                           const char *response,
+                                           u2fs_authentication_func func,
+                                           void *data);
+
 #ifdef __cplusplus
 }
 #endif